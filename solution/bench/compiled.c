@@ -0,0 +1,184 @@
+// wsh2c benchmark: scripts run by the interpreter against the same scripts
+// compiled with wsh2c.
+//
+// Build with `make all bench` and run `./bench/compiled [SCALE]` from the
+// solution directory. Each workload is generated, compiled once with
+// ./wsh2c, then run under ./wsh and as the compiled program; the best of
+// COMPILED_RUNS wall times is shown with the outputs checked to match.
+
+#include "../wsh.h"
+
+#define COMPILED_RUNS 5
+
+// A generated script and how many times one measurement runs it
+typedef struct Workload {
+    const char *name;
+    int lines;              // per SCALE
+    int runs;               // back-to-back executions per measurement
+} Workload;
+
+static const Workload workloads[] = {
+    {"startup", 4, 200},    // a few lines: process start and script loading
+    {"builtins", 20000, 1}, // variables, cd and redirected builtins
+    {"programs", 200, 1},   // external programs, where fork and exec dominate
+};
+
+/**
+ * @brief Returns the current monotonic time in seconds.
+ */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Writes a workload's script.
+ */
+static void generate(const Workload *w, int scale, const char *work, const char *path) {
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        perror("bench");
+        exit(EXIT_FAILURE);
+    }
+    unsigned seed = 11;
+    int lines = w->lines * scale;
+    for (int i = 0; i < lines; i++) {
+        seed = seed * 1103515245 + 12345;
+        if (strcmp(w->name, "programs") == 0) {
+            fprintf(out, i % 2 ? "/bin/true %d\n" : "/bin/echo line %d\n", i);
+            continue;
+        }
+        switch ((seed >> 16) % 8) {
+        case 0: case 1:
+            fprintf(out, "local KEY%d=value%d\n", i % 256, i);
+            break;
+        case 2:
+            fprintf(out, "local COPY%d=$KEY%d\n", i % 32, (seed >> 4) % 256);
+            break;
+        case 3:
+            fprintf(out, "# step %d\n", i);
+            break;
+        case 4:
+            fprintf(out, "cd %s\n", work);
+            break;
+        case 5:
+            fprintf(out, "export STAGE=%d\n", i);
+            break;
+        default:
+            fprintf(out, "pwd >/dev/null\n");
+            break;
+        }
+    }
+    fprintf(out, "/bin/echo $KEY1 $COPY1 $STAGE\n");
+    fclose(out);
+}
+
+/**
+ * @brief Runs argv runs times in a row with stdout to output; returns the wall time in ms.
+ */
+static double run(char *const argv[], int runs, const char *output) {
+    double start = now();
+    for (int i = 0; i < runs; i++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("bench");
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+            int out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            int null = open("/dev/null", O_RDWR);
+            if (out == -1 || null == -1) _exit(127);
+            dup2(null, STDIN_FILENO);
+            dup2(out, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+            execv(argv[0], argv);
+            _exit(127);
+        }
+        int status;
+        if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+            fprintf(stderr, "bench: %s failed\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return (now() - start) * 1e3;
+}
+
+/**
+ * @brief Returns the best of COMPILED_RUNS measurements.
+ */
+static double best_of(char *const argv[], int runs, const char *output) {
+    double best = -1;
+    for (int i = 0; i < COMPILED_RUNS; i++) {
+        double ms = run(argv, runs, output);
+        if (best < 0 || ms < best) best = ms;
+    }
+    return best;
+}
+
+/**
+ * @brief Tells whether two files have the same contents.
+ */
+static int same_output(const char *a, const char *b) {
+    FILE *fa = fopen(a, "r"), *fb = fopen(b, "r");
+    int same = fa && fb;
+    while (same) {
+        int ca = fgetc(fa), cb = fgetc(fb);
+        if (ca != cb) same = 0;
+        if (ca == EOF) break;
+    }
+    if (fa) fclose(fa);
+    if (fb) fclose(fb);
+    return same;
+}
+
+int main(int argc, char **argv) {
+    int scale = argc > 1 ? atoi(argv[1]) : 1;
+    if (scale < 1) scale = 1;
+
+    char work[] = "/tmp/wsh-bench-compiled-XXXXXX";
+    if (!mkdtemp(work)) {
+        perror("bench");
+        return EXIT_FAILURE;
+    }
+
+    printf("scale %d, best of %d; times cover all runs of a workload\n\n", scale, COMPILED_RUNS);
+    printf("%-9s %6s %5s %12s %12s %8s %11s\n", "workload", "lines", "runs", "wsh ms", "compiled ms",
+           "speedup", "compile ms");
+    int differs = 0;
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        const Workload *w = &workloads[i];
+        char script[PATH_MAX], binary[PATH_MAX], interpreted_out[PATH_MAX], compiled_out[PATH_MAX];
+        snprintf(script, sizeof(script), "%s/%s.wsh", work, w->name);
+        snprintf(binary, sizeof(binary), "%s/%s", work, w->name);
+        snprintf(interpreted_out, sizeof(interpreted_out), "%s/%s.wsh.out", work, w->name);
+        snprintf(compiled_out, sizeof(compiled_out), "%s/%s.out", work, w->name);
+        generate(w, scale, work, script);
+
+        char *translate[] = {"./wsh2c", "-o", binary, script, NULL};
+        double compile_ms = run(translate, 1, "/dev/null");
+        char *interpreted[] = {"./wsh", script, NULL};
+        char *compiled[] = {binary, NULL};
+        double wsh_ms = best_of(interpreted, w->runs, interpreted_out);
+        double compiled_ms = best_of(compiled, w->runs, compiled_out);
+
+        const char *mark = "";
+        if (!same_output(interpreted_out, compiled_out)) {
+            mark = "  *";
+            differs = 1;
+        }
+        printf("%-9s %6d %5d %12.1f %12.1f %7.2fx %11.0f%s\n", w->name, w->lines * scale, w->runs,
+               wsh_ms, compiled_ms, wsh_ms / compiled_ms, compile_ms, mark);
+    }
+
+    if (differs) {
+        printf("\n* output differs between wsh and the compiled program; see %s\n", work);
+    } else {
+        char command[PATH_MAX + 16];
+        snprintf(command, sizeof(command), "rm -rf %s", work);
+        if (system(command) != 0) {
+            fprintf(stderr, "bench: could not remove %s\n", work);
+        }
+    }
+    return EXIT_SUCCESS;
+}
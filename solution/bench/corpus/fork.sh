@@ -0,0 +1,29 @@
+# Fork-heavy: build and packaging steps, each a short-lived program.
+# Runs in $WORK, which holds input.txt; one redirection per command.
+cd $WORK
+mkdir -p build/obj build/bin build/pkg
+cp input.txt build/obj/a.txt
+cp build/obj/a.txt build/obj/b.txt
+cat build/obj/a.txt >/dev/null
+sort input.txt >build/sorted.txt
+sort -u build/sorted.txt >build/unique.txt
+cut -d , -f 1 input.txt >build/ids.txt
+sort -r input.txt >build/reversed.txt
+sed -n 1,20p input.txt >/dev/null
+grep -c error input.txt >/dev/null
+basename build/obj/a.txt >/dev/null
+dirname build/obj/a.txt >/dev/null
+uname -s >/dev/null
+id -u >/dev/null
+env >/dev/null
+touch build/stamp
+chmod 644 build/stamp
+ln -sf build/stamp build/stamp.link
+ls build >/dev/null
+wc -l input.txt >/dev/null
+head -n 5 input.txt >/dev/null
+tail -n 5 input.txt >/dev/null
+cmp build/obj/a.txt build/obj/b.txt
+mv build/obj/b.txt build/pkg/b.txt
+rm -f build/pkg/b.txt build/stamp.link
+rm -rf build
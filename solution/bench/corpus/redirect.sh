@@ -0,0 +1,18 @@
+# Redirection-heavy: writing, appending and reading small files.
+# wsh takes one redirection per command.
+cd $WORK
+echo started >log.txt
+echo step one >>log.txt
+echo step two >>log.txt
+cat log.txt >copy.txt
+cat copy.txt >>log.txt
+sort log.txt >sorted.txt
+head -n 2 sorted.txt >head.txt
+tail -n 1 sorted.txt >>head.txt
+wc -l <log.txt
+cat <head.txt
+pwd >where.txt
+pwd >>where.txt
+cat head.txt where.txt >summary.txt
+sort -r <summary.txt
+rm log.txt copy.txt sorted.txt head.txt where.txt summary.txt
@@ -0,0 +1,40 @@
+# Variable-heavy: configuration assignments and lookups between builtins.
+APP=inventory
+VERSION=4.2.1
+CHANNEL=stable
+PREFIX=/opt/inventory
+REGION=eu-west-1
+DB_HOST=db.internal
+DB_PORT=5432
+DB_NAME=inventory
+DB_USER=svc_inventory
+CACHE_HOST=cache.internal
+CACHE_PORT=6379
+LOG_LEVEL=info
+WORKERS=8
+TIMEOUT=30
+RETRIES=5
+RELEASE=$VERSION
+INSTALL_DIR=$PREFIX
+PRIMARY=$DB_HOST
+REPLICA=$PRIMARY
+LEVEL=$LOG_LEVEL
+export APP_ENV=production
+export APP_REGION=eu-west-1
+cd $WORK
+pwd >/dev/null
+cd /
+cd $WORK
+BUILD_ID=b1842
+ARTIFACT=$BUILD_ID
+PREVIOUS=$RELEASE
+RELEASE=$PREVIOUS
+CURRENT=$ARTIFACT
+TARGET=$INSTALL_DIR
+LEVEL=$LEVEL
+HOST=$REPLICA
+PORT=$DB_PORT
+USER_NAME=$DB_USER
+pwd >/dev/null
+# once
+echo $APP $RELEASE $INSTALL_DIR $REPLICA $LEVEL $CURRENT $TARGET $USER_NAME
@@ -0,0 +1,101 @@
+// match benchmark: the builtin against a cold grep -F, and search throughput.
+//
+// Build with `make bench` and run `./bench/match [KB] [runs]`.
+
+#include "../wsh.h"
+
+/**
+ * @brief Returns the current monotonic time in seconds.
+ */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Writes a log-like file of roughly size bytes; one line in 64 has "ERROR".
+ */
+static void make_log(const char *path, size_t size) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        perror("bench");
+        exit(EXIT_FAILURE);
+    }
+    const char *levels[] = {"INFO", "DEBUG", "WARN", "TRACE"};
+    unsigned seed = 1;
+    for (size_t written = 0, line = 0; written < size; line++) {
+        seed = seed * 1103515245 + 12345;
+        const char *level = line % 64 == 63 ? "ERROR" : levels[(seed >> 16) % 4];
+        int n = fprintf(fp, "2026-10-18T02:%02zu:%02zu.%03u %s worker-%u request %u took %u ms\n",
+                        line / 60 % 60, line % 60, seed % 1000, level, (seed >> 8) % 16,
+                        seed >> 12, (seed >> 4) % 5000);
+        written += n;
+    }
+    fclose(fp);
+}
+
+/**
+ * @brief Times a command line run through execute_command(), per invocation.
+ */
+static double time_command(const char *line, int runs) {
+    double start = now();
+    for (int i = 0; i < runs; i++) {
+        char *copy = strdup(line);
+        char **args = parse_line(copy);
+        execute_command(args);
+        free_tokens(args);
+        free(copy);
+    }
+    return (now() - start) / runs;
+}
+
+int main(int argc, char **argv) {
+    size_t kb = argc > 1 ? (size_t)atoi(argv[1]) : 512;
+    int runs = argc > 2 ? atoi(argv[2]) : 100;
+    initialize_shell();
+
+    char path[] = "/tmp/wsh-bench-match-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        perror("bench");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    make_log(path, kb << 10);
+
+    const char *searches[] = {
+        "-c ERROR",
+        "-c -e ERROR -e WARN -e worker-7",
+        "-v -e INFO -e DEBUG -e TRACE",
+        "-l nothing-like-this",
+    };
+    printf("%zu KiB log, %d runs each\n", kb, runs);
+    for (size_t i = 0; i < sizeof(searches) / sizeof(char *); i++) {
+        char line[256];
+        snprintf(line, sizeof(line), "match %s %s >/dev/null", searches[i], path);
+        double builtin = time_command(line, runs);
+        snprintf(line, sizeof(line), "/usr/bin/grep -F %s %s >/dev/null", searches[i], path);
+        double forked = time_command(line, runs);
+        printf("%-34s builtin %8.1f us (%6.2f GB/s)   grep -F %8.1f us   %5.1fx\n", searches[i],
+               builtin * 1e6, (kb << 10) / builtin / 1e9, forked * 1e6, forked / builtin);
+    }
+
+    // Single-pattern search throughput for each finder
+    printf("\n");
+    const char *classifiers[] = {"scalar", "sse2", "avx2"};
+    for (size_t i = 0; i < sizeof(classifiers) / sizeof(char *); i++) {
+        if (select_classifier(classifiers[i]) != 0) {
+            printf("%-8s unsupported on this CPU\n", classifiers[i]);
+            continue;
+        }
+        char line[256];
+        snprintf(line, sizeof(line), "match -c ERROR %s >/dev/null", path);
+        double builtin = time_command(line, runs);
+        printf("%-8s match -c ERROR %7.2f GB/s\n", classifiers[i], (kb << 10) / builtin / 1e9);
+    }
+
+    unlink(path);
+    cleanup_shell();
+    return EXIT_SUCCESS;
+}
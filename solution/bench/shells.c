@@ -0,0 +1,299 @@
+// Cross-shell benchmark: runs the scripts in bench/corpus under wsh, dash
+// and bash and reports wall time, CPU time and peak RSS side by side.
+//
+// Build with `make bench` and run `./bench/shells [SCALE] [SHELL...]` from
+// the solution directory. SHELL defaults to ./wsh, dash and bash; shells
+// that are not installed are skipped.
+//
+// Each corpus script is repeated to make it long enough to time; lines
+// after a `# once` line run a single time at the end. Transcripts (.txt)
+// are fed on stdin to an interactive shell. A large generated batch file
+// is added to the corpus.
+
+#include "../wsh.h"
+#include <sys/resource.h>
+
+#define CORPUS_DIR "bench/corpus"
+#define CORPUS_RUNS 3
+
+// One corpus entry, expanded into a script file under the work directory
+typedef struct Workload {
+    const char *name;
+    const char *source;     // file in CORPUS_DIR, or NULL for the generated batch
+    int repeat;             // copies of the body per SCALE
+    int interactive;        // fed on stdin to an interactive shell
+} Workload;
+
+static const Workload workloads[] = {
+    {"fork", "fork.sh", 10, 0},
+    {"vars", "vars.sh", 500, 0},
+    {"redirect", "redirect.sh", 50, 0},
+    {"transcript", "transcript.txt", 40, 1},
+    {"batch", NULL, 1, 0},
+};
+
+// Best of CORPUS_RUNS for one shell and workload
+typedef struct Measurement {
+    double wall_ms;
+    double cpu_ms;          // user + system, including the programs the shell ran
+    long rss_kib;
+    int status;
+} Measurement;
+
+/**
+ * @brief Returns the current monotonic time in seconds.
+ */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Reads a whole file; exits on error.
+ */
+static char *slurp(const char *path, size_t *len) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "bench: %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    rewind(fp);
+    char *data = malloc(size + 1);
+    if (!data || fread(data, 1, size, fp) != (size_t)size) {
+        fprintf(stderr, "bench: cannot read %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    data[size] = '\0';
+    fclose(fp);
+    *len = size;
+    return data;
+}
+
+/**
+ * @brief Writes the repeated body of a corpus file, then its `# once` part.
+ */
+static void expand_workload(const Workload *w, int scale, const char *out_path) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", CORPUS_DIR, w->source);
+    size_t len;
+    char *text = slurp(path, &len);
+    char *once = strstr(text, "# once\n");
+    size_t body = once ? (size_t)(once - text) : len;
+
+    FILE *out = fopen(out_path, "w");
+    if (!out) {
+        perror("bench");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < w->repeat * scale; i++) {
+        fwrite(text, 1, body, out);
+    }
+    if (once) {
+        fputs(once, out);
+    }
+    fclose(out);
+    free(text);
+}
+
+/**
+ * @brief Generates a large batch file: assignments, comments, blank lines and builtins.
+ */
+static void generate_batch(int scale, const char *out_path) {
+    FILE *out = fopen(out_path, "w");
+    if (!out) {
+        perror("bench");
+        exit(EXIT_FAILURE);
+    }
+    unsigned seed = 7;
+    int lines = 20000 * scale;
+    for (int i = 0; i < lines; i++) {
+        seed = seed * 1103515245 + 12345;
+        switch ((seed >> 16) % 10) {
+        case 0: case 1: case 2:
+            fprintf(out, "KEY%d=value%d\n", i % 512, i);
+            break;
+        case 3:
+            fprintf(out, "COPY%d=$KEY%d\n", i % 64, (seed >> 4) % 512);
+            break;
+        case 4: case 5:
+            fprintf(out, "# step %d of the generated batch\n", i);
+            break;
+        case 6:
+            fprintf(out, "\n");
+            break;
+        case 7:
+            fprintf(out, "cd $WORK\n");
+            break;
+        case 8:
+            fprintf(out, "export STAGE=%d\n", i);
+            break;
+        default:
+            fprintf(out, "pwd >/dev/null\n");
+            break;
+        }
+    }
+    fprintf(out, "echo $KEY1 $KEY511 $STAGE\n");
+    fclose(out);
+}
+
+/**
+ * @brief Writes input.txt, the data file the corpus scripts work on.
+ */
+static void generate_input(const char *work) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/input.txt", work);
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        perror("bench");
+        exit(EXIT_FAILURE);
+    }
+    const char *levels[] = {"info", "debug", "warn", "error"};
+    for (int i = 0; i < 400; i++) {
+        fprintf(out, "%d,%s,request %d served in %d ms\n", i, levels[i % 7 % 4], i * 37 % 1000, i * 13 % 250);
+    }
+    fclose(out);
+}
+
+/**
+ * @brief Runs one shell on one script CORPUS_RUNS times and keeps the fastest run.
+ * 
+ * @param output Where the shell's stdout goes.
+ * @return int 0 on success, -1 if the shell could not be started.
+ */
+static int measure(const char *shell, const Workload *w, const char *script, const char *output,
+                   Measurement *best) {
+    best->wall_ms = -1;
+    for (int run = 0; run < CORPUS_RUNS; run++) {
+        double start = now();
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("bench");
+            return -1;
+        }
+        if (pid == 0) {
+            int out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            int null = open("/dev/null", O_RDWR);
+            int in = w->interactive ? open(script, O_RDONLY) : null;
+            if (out == -1 || null == -1 || in == -1) _exit(127);
+            dup2(in, STDIN_FILENO);
+            dup2(out, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+
+            // wsh is interactive when given no script; dash and bash need -i
+            const char *base = strrchr(shell, '/') ? strrchr(shell, '/') + 1 : shell;
+            int is_wsh = strcmp(base, "wsh") == 0;
+            if (!w->interactive) {
+                execlp(shell, shell, script, (char *)NULL);
+            } else if (is_wsh) {
+                execlp(shell, shell, (char *)NULL);
+            } else if (strcmp(base, "bash") == 0) {
+                execlp(shell, shell, "--norc", "-i", (char *)NULL);
+            } else {
+                execlp(shell, shell, "-i", (char *)NULL);
+            }
+            _exit(127);
+        }
+        int status;
+        struct rusage usage;
+        if (wait4(pid, &status, 0, &usage) == -1) {
+            perror("bench");
+            return -1;
+        }
+        double wall = (now() - start) * 1e3;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+            return -1;
+        }
+        if (best->wall_ms < 0 || wall < best->wall_ms) {
+            best->wall_ms = wall;
+            best->cpu_ms = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e3
+                         + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e3;
+            best->rss_kib = usage.ru_maxrss;
+            best->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Tells whether two files have the same contents.
+ */
+static int same_output(const char *a, const char *b) {
+    size_t len_a, len_b;
+    char *data_a = slurp(a, &len_a);
+    char *data_b = slurp(b, &len_b);
+    int same = len_a == len_b && memcmp(data_a, data_b, len_a) == 0;
+    free(data_a);
+    free(data_b);
+    return same;
+}
+
+int main(int argc, char **argv) {
+    int scale = argc > 1 ? atoi(argv[1]) : 1;
+    if (scale < 1) scale = 1;
+    const char *default_shells[] = {"./wsh", "dash", "bash"};
+    const char **shells = argc > 2 ? (const char **)&argv[2] : default_shells;
+    int nshells = argc > 2 ? argc - 2 : 3;
+
+    char work[] = "/tmp/wsh-bench-shells-XXXXXX";
+    if (!mkdtemp(work)) {
+        perror("bench");
+        return EXIT_FAILURE;
+    }
+    setenv("WORK", work, 1);
+    char history[PATH_MAX];
+    snprintf(history, sizeof(history), "%s/history", work);
+    setenv("HISTFILE", history, 1);
+    generate_input(work);
+
+    printf("scale %d, best of %d runs; CPU includes the programs each shell ran\n\n", scale, CORPUS_RUNS);
+    printf("%-11s %-8s %7s %10s %10s %9s\n", "workload", "shell", "lines", "wall ms", "cpu ms", "rss KiB");
+    int differs = 0;
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        const Workload *w = &workloads[i];
+        char script[PATH_MAX];
+        snprintf(script, sizeof(script), "%s/%s.%s", work, w->name, w->interactive ? "txt" : "sh");
+        if (w->source) {
+            expand_workload(w, scale, script);
+        } else {
+            generate_batch(scale, script);
+        }
+        size_t len;
+        char *text = slurp(script, &len);
+        size_t lines = 0;
+        for (size_t k = 0; k < len; k++) lines += text[k] == '\n';
+        free(text);
+
+        char first_output[PATH_MAX] = "";
+        for (int s = 0; s < nshells; s++) {
+            char output[PATH_MAX];
+            snprintf(output, sizeof(output), "%s/%s.out.%d", work, w->name, s);
+            Measurement m;
+            if (measure(shells[s], w, script, output, &m) == -1) {
+                printf("%-11s %-8s %7s   not found, skipped\n", w->name, shells[s], "");
+                continue;
+            }
+            // Interactive output includes each shell's own prompts
+            const char *mark = "";
+            if (!w->interactive && first_output[0] && !same_output(first_output, output)) {
+                mark = "  *";
+                differs = 1;
+            }
+            if (!first_output[0]) snprintf(first_output, sizeof(first_output), "%s", output);
+            printf("%-11s %-8s %7zu %10.1f %10.1f %9ld%s\n", w->name, shells[s], lines,
+                   m.wall_ms, m.cpu_ms, m.rss_kib, mark);
+        }
+    }
+    if (differs) {
+        printf("\n* output differs from the first shell's; see %s\n", work);
+    } else {
+        char command[PATH_MAX + 16];
+        snprintf(command, sizeof(command), "rm -rf %s", work);
+        if (system(command) != 0) {
+            fprintf(stderr, "bench: could not remove %s\n", work);
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,213 @@
+// Soak test: millions of mixed commands in one shell, failing if memory or descriptors creep up.
+//
+// Build with `make bench` and run `./bench/soak [COMMANDS] [EXEC_EVERY]`. Every EXEC_EVERY-th
+// command is a failed exec, which forks; the rest are builtins. VmRSS and the number of open
+// descriptors are sampled from /proc/self as it goes, and the run exits 1 if either trends upward
+// once the first tenth (warm-up, while tables grow to their working size) is behind it.
+
+#include "../wsh.h"
+
+#define SOAK_SAMPLES 64
+#define SOAK_VARIABLES 256
+#define SOAK_RSS_SLACK_KB 512   // allowed RSS growth over the measured part of the run
+
+/**
+ * @brief Returns the current monotonic time in seconds.
+ */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Reads VmRSS from /proc/self/status, in KiB.
+ */
+static long rss_kb(void) {
+    FILE *fp = fopen("/proc/self/status", "r");
+    if (!fp) return -1;
+    char line[256];
+    long kb = -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "VmRSS: %ld", &kb) == 1) break;
+    }
+    fclose(fp);
+    return kb;
+}
+
+/**
+ * @brief Counts the open descriptors in /proc/self/fd, not counting the one reading it.
+ */
+static int open_fds(void) {
+    DIR *dir = opendir("/proc/self/fd");
+    if (!dir) return -1;
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.') count++;
+    }
+    closedir(dir);
+    return count - 1;
+}
+
+/**
+ * @brief Advances a linear congruential generator and returns 15 fresh bits.
+ */
+static unsigned next_random(unsigned *seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 16) & 0x7fff;
+}
+
+/**
+ * @brief Writes the i-th command of the mix into line.
+ *
+ * About half the commands churn shell variables with values of varying length, the rest
+ * resize history, export, and run builtins under every kind of redirection, some of which
+ * fail to open. Every exec_every-th command is a program that does not exist.
+ */
+static void make_command(char *line, size_t size, long i, long exec_every, const char *dir, unsigned *seed) {
+    if (exec_every > 0 && i % exec_every == exec_every - 1) {
+        snprintf(line, size, i / exec_every % 2 ? "/nonexistent/soak-%ld" : "soak-missing-%ld", i);
+        return;
+    }
+
+    unsigned r = next_random(seed);
+    unsigned k = next_random(seed) % SOAK_VARIABLES;
+    char value[128];
+    int len = 1 + next_random(seed) % (sizeof(value) - 1);
+    for (int j = 0; j < len; j++) value[j] = 'a' + (i + j) % 26;
+    value[len] = '\0';
+
+    switch (r % 20) {
+    case 0: case 1: case 2: case 3: case 4: case 5: case 6:
+        snprintf(line, size, "local S%u=%s", k, value);
+        break;
+    case 7: case 8:
+        snprintf(line, size, "local T%u=$S%u", k % 16, k);
+        break;
+    case 9:
+        snprintf(line, size, "history set %u", 1 + next_random(seed) % 100);
+        break;
+    case 10: case 11:
+        snprintf(line, size, "export E%u=%s", k % 32, value);
+        break;
+    case 12:
+        snprintf(line, size, "pwd >%s/log.txt", dir);
+        break;
+    case 13:
+        snprintf(line, size, "pwd >>%s/log.txt", dir);
+        break;
+    case 14:
+        snprintf(line, size, "wc -l <%s/log.txt", dir);
+        break;
+    case 15:
+        snprintf(line, size, "vars &>%s/vars.txt", dir);
+        break;
+    case 16:
+        snprintf(line, size, "pwd >%s/missing/out.txt", dir);
+        break;
+    case 17:
+        snprintf(line, size, "wc -l <%s/missing.txt", dir);
+        break;
+    case 18:
+        snprintf(line, size, "pwd &>>%s/missing/log.txt", dir);
+        break;
+    default:
+        snprintf(line, size, "history >%s/history.txt", dir);
+        break;
+    }
+}
+
+/**
+ * @brief Fits a least-squares line through the samples and returns its rise from first to last.
+ */
+static double trend(const long *samples, int count) {
+    double mean_x = (count - 1) / 2.0, mean_y = 0;
+    for (int i = 0; i < count; i++) mean_y += samples[i];
+    mean_y /= count;
+    double num = 0, den = 0;
+    for (int i = 0; i < count; i++) {
+        num += (i - mean_x) * (samples[i] - mean_y);
+        den += (i - mean_x) * (i - mean_x);
+    }
+    return den > 0 ? num / den * (count - 1) : 0;
+}
+
+int main(int argc, char **argv) {
+    long commands = argc > 1 ? atol(argv[1]) : 20000000;
+    long exec_every = argc > 2 ? atol(argv[2]) : 5000;
+    if (commands < SOAK_SAMPLES * 10) commands = SOAK_SAMPLES * 10;
+    initialize_shell();
+
+    char dir[] = "/tmp/wsh-soak-XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("soak");
+        return EXIT_FAILURE;
+    }
+
+    // Failing redirections and execs report on stderr; keep the harness's own for the verdict
+    int report = dup(STDERR_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (report == -1 || null_fd == -1 || dup2(null_fd, STDOUT_FILENO) == -1 ||
+        dup2(null_fd, STDERR_FILENO) == -1) {
+        perror("soak");
+        return EXIT_FAILURE;
+    }
+    close(null_fd);
+    FILE *out = fdopen(report, "w");
+    setvbuf(out, NULL, _IOLBF, 0);
+
+    long rss[SOAK_SAMPLES], fds[SOAK_SAMPLES];
+    long warmup = commands / 10;
+    long step = (commands - warmup) / SOAK_SAMPLES;
+    int taken = 0;
+    unsigned seed = 1;
+    char line[512];
+    double start = now();
+    fprintf(out, "%ld commands, a failed exec every %ld\n", commands, exec_every);
+    fprintf(out, "%12s %10s %6s\n", "commands", "VmRSS KiB", "fds");
+
+    for (long i = 0; i < commands; i++) {
+        make_command(line, sizeof(line), i, exec_every, dir, &seed);
+        char **args = parse_line(line);
+        execute_command(args);
+        free_tokens(args);
+
+        if (i >= warmup && (i - warmup) % step == step - 1 && taken < SOAK_SAMPLES) {
+            rss[taken] = rss_kb();
+            fds[taken] = open_fds();
+            fprintf(out, "%12ld %10ld %6ld\n", i + 1, rss[taken], fds[taken]);
+            taken++;
+        }
+    }
+    double elapsed = now() - start;
+
+    double rss_rise = trend(rss, taken);
+    long fd_max = fds[0];
+    for (int i = 1; i < taken; i++) {
+        if (fds[i] > fd_max) fd_max = fds[i];
+    }
+    fprintf(out, "%.1f s, %.2f us/command; VmRSS trend %+.0f KiB, fds %ld -> %ld\n", elapsed,
+            elapsed * 1e6 / commands, rss_rise, fds[0], fd_max);
+
+    int failed = 0;
+    if (rss_rise > SOAK_RSS_SLACK_KB) {
+        fprintf(out, "FAIL: VmRSS grew by %.0f KiB (allowed %d)\n", rss_rise, SOAK_RSS_SLACK_KB);
+        failed = 1;
+    }
+    if (fd_max > fds[0]) {
+        fprintf(out, "FAIL: %ld descriptors leaked\n", fd_max - fds[0]);
+        failed = 1;
+    }
+    if (!failed) fprintf(out, "ok\n");
+
+    const char *files[] = {"log.txt", "vars.txt", "history.txt"};
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+        unlink(path);
+    }
+    rmdir(dir);
+    cleanup_shell();
+    return failed;
+}
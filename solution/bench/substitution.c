@@ -0,0 +1,153 @@
+// Command substitution benchmark: lines with several slow $(...) run with
+// sibling substitutions started together and with --serial-substitution.
+//
+// Build with `make all bench` and run `./bench/substitution [LATENCY_MS] [LINES]`
+// from the solution directory. Each query is a small script that sleeps
+// LATENCY_MS before printing a word, standing in for a lookup with network
+// or disk latency. A line with WIDTH substitutions costs about one latency
+// run together and WIDTH latencies run one by one; the best of
+// SUBSTITUTION_RUNS wall times is shown with the outputs checked to match.
+
+#include "../wsh.h"
+
+#define SUBSTITUTION_RUNS 3
+
+static const int widths[] = {1, 2, 4, 8};
+
+/**
+ * @brief Returns the current monotonic time in seconds.
+ */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Writes the query program and a script of lines with width substitutions each.
+ */
+static void generate(const char *work, int width, int lines, int latency_ms, const char *path) {
+    char query[PATH_MAX];
+    snprintf(query, sizeof(query), "%s/query", work);
+    FILE *out = fopen(query, "w");
+    if (!out || fprintf(out, "#!/bin/sh\nsleep $1\necho $2\n") < 0 || fclose(out) != 0 ||
+        chmod(query, 0755) != 0) {
+        perror("bench");
+        exit(EXIT_FAILURE);
+    }
+
+    out = fopen(path, "w");
+    if (!out) {
+        perror("bench");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < lines; i++) {
+        fprintf(out, "/bin/echo");
+        for (int j = 0; j < width; j++) {
+            fprintf(out, " $(%s %d.%03d line%d-%d)", query, latency_ms / 1000, latency_ms % 1000, i, j);
+        }
+        fprintf(out, "\n");
+    }
+    fclose(out);
+}
+
+/**
+ * @brief Runs argv with stdout to output; returns the wall time in ms.
+ */
+static double run(char *const argv[], const char *output) {
+    double start = now();
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("bench");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        int out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out == -1) _exit(127);
+        dup2(out, STDOUT_FILENO);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+        fprintf(stderr, "bench: %s failed\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    return (now() - start) * 1e3;
+}
+
+/**
+ * @brief Returns the best of SUBSTITUTION_RUNS measurements.
+ */
+static double best_of(char *const argv[], const char *output) {
+    double best = -1;
+    for (int i = 0; i < SUBSTITUTION_RUNS; i++) {
+        double ms = run(argv, output);
+        if (best < 0 || ms < best) best = ms;
+    }
+    return best;
+}
+
+/**
+ * @brief Tells whether two files have the same contents.
+ */
+static int same_output(const char *a, const char *b) {
+    FILE *fa = fopen(a, "r"), *fb = fopen(b, "r");
+    int same = fa && fb;
+    while (same) {
+        int ca = fgetc(fa), cb = fgetc(fb);
+        if (ca != cb) same = 0;
+        if (ca == EOF) break;
+    }
+    if (fa) fclose(fa);
+    if (fb) fclose(fb);
+    return same;
+}
+
+int main(int argc, char **argv) {
+    int latency_ms = argc > 1 ? atoi(argv[1]) : 50;
+    int lines = argc > 2 ? atoi(argv[2]) : 4;
+    if (latency_ms < 0) latency_ms = 0;
+    if (lines < 1) lines = 1;
+
+    char work[] = "/tmp/wsh-bench-substitution-XXXXXX";
+    if (!mkdtemp(work)) {
+        perror("bench");
+        return EXIT_FAILURE;
+    }
+
+    printf("%d lines, %d ms per query, best of %d\n\n", lines, latency_ms, SUBSTITUTION_RUNS);
+    printf("%5s %14s %11s %8s %14s\n", "width", "concurrent ms", "serial ms", "speedup", "sum of waits");
+    int differs = 0;
+    for (size_t i = 0; i < sizeof(widths) / sizeof(widths[0]); i++) {
+        char script[PATH_MAX], concurrent_out[PATH_MAX], serial_out[PATH_MAX];
+        snprintf(script, sizeof(script), "%s/width%d.wsh", work, widths[i]);
+        snprintf(concurrent_out, sizeof(concurrent_out), "%s/width%d.out", work, widths[i]);
+        snprintf(serial_out, sizeof(serial_out), "%s/width%d.serial.out", work, widths[i]);
+        generate(work, widths[i], lines, latency_ms, script);
+
+        char *concurrent[] = {"./wsh", script, NULL};
+        char *serial[] = {"./wsh", "--serial-substitution", script, NULL};
+        double concurrent_ms = best_of(concurrent, concurrent_out);
+        double serial_ms = best_of(serial, serial_out);
+
+        const char *mark = "";
+        if (!same_output(concurrent_out, serial_out)) {
+            mark = "  *";
+            differs = 1;
+        }
+        printf("%5d %14.1f %11.1f %7.2fx %14d%s\n", widths[i], concurrent_ms, serial_ms,
+               serial_ms / concurrent_ms, lines * widths[i] * latency_ms, mark);
+    }
+
+    if (differs) {
+        printf("\n* output differs between the two modes; see %s\n", work);
+    } else {
+        char command[PATH_MAX + 16];
+        snprintf(command, sizeof(command), "rm -rf %s", work);
+        if (system(command) != 0) {
+            fprintf(stderr, "bench: could not remove %s\n", work);
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,106 @@
+// Tokenizer throughput benchmark: GB/s for long command lines.
+//
+// Build with `make bench` and run `./bench/tokenize [MB]`.
+
+#include "../wsh.h"
+
+/**
+ * @brief Returns the current monotonic time in seconds.
+ */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Builds a generated command line of roughly size bytes.
+ */
+static char *make_line(size_t size) {
+    char *line = malloc(size + 64);
+    if (!line) {
+        fprintf(stderr, "bench: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t len = 0;
+    unsigned seed = 1;
+    while (len < size) {
+        // Arguments of 4-40 bytes, every 16th one a variable reference
+        seed = seed * 1103515245 + 12345;
+        int arg_len = 4 + (seed >> 16) % 37;
+        if ((seed >> 20) % 16 == 0) line[len++] = '$';
+        for (int i = 0; i < arg_len; i++) {
+            line[len] = 'a' + (len % 26);
+            len++;
+        }
+        line[len++] = (seed >> 24) % 8 == 0 ? '\t' : ' ';
+    }
+    line[len] = '\0';
+    return line;
+}
+
+/**
+ * @brief Frees a token array returned by parse_line_strtok().
+ */
+static void free_strtok_tokens(char **tokens) {
+    for (int i = 0; tokens[i]; i++) {
+        free(tokens[i]);
+    }
+    free(tokens);
+}
+
+/**
+ * @brief The original strtok() + strdup() tokenizer, for comparison.
+ */
+static char **parse_line_strtok(char *line) {
+    size_t bufsize = MAX_TOKENS, position = 0;
+    char **tokens = malloc(bufsize * sizeof(char*));
+    for (char *token = strtok(line, DELIMITERS); token; token = strtok(NULL, DELIMITERS)) {
+        tokens[position++] = handle_variable_substitution(token);
+        if (position >= bufsize) {
+            bufsize *= 2;
+            tokens = realloc(tokens, bufsize * sizeof(char*));
+        }
+    }
+    tokens[position] = NULL;
+    return tokens;
+}
+
+/**
+ * @brief Times one tokenizer over the line and prints its throughput.
+ */
+static void run(const char *name, char **(*parse)(char *), void (*release)(char **),
+                const char *line, size_t len, int rounds) {
+    char *copy = malloc(len + 1);
+    double best = 1e9;
+    for (int r = 0; r < rounds; r++) {
+        memcpy(copy, line, len + 1);
+        double start = now();
+        char **tokens = parse(copy);
+        double elapsed = now() - start;
+        release(tokens);
+        if (elapsed < best) best = elapsed;
+    }
+    printf("%-8s %8.3f GB/s  (%.2f ms)\n", name, len / best / 1e9, best * 1e3);
+    free(copy);
+}
+
+int main(int argc, char **argv) {
+    size_t mb = argc > 1 ? (size_t)atoi(argv[1]) : 16;
+    char *line = make_line(mb << 20);
+    size_t len = strlen(line);
+
+    printf("line: %zu bytes\n", len);
+    run("strtok", parse_line_strtok, free_strtok_tokens, line, len, 5);
+    const char *classifiers[] = {"scalar", "sse2", "avx2"};
+    for (size_t i = 0; i < sizeof(classifiers) / sizeof(char *); i++) {
+        if (select_classifier(classifiers[i]) == 0) {
+            run(classifiers[i], parse_line, free_tokens, line, len, 5);
+        } else {
+            printf("%-8s unsupported on this CPU\n", classifiers[i]);
+        }
+    }
+
+    free(line);
+    return EXIT_SUCCESS;
+}
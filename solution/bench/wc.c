@@ -0,0 +1,115 @@
+// wc/head/tail benchmark: fork elimination on small files and GB/s of line counting.
+//
+// Build with `make bench` and run `./bench/wc [MB] [runs]`.
+
+#include "../wsh.h"
+
+/**
+ * @brief Returns the current monotonic time in seconds.
+ */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Builds text of roughly size bytes: words of 1-12 letters, lines of 1-16 words.
+ */
+static char *make_text(size_t size) {
+    char *text = malloc(size + 64);
+    if (!text) {
+        fprintf(stderr, "bench: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t len = 0;
+    unsigned seed = 1;
+    while (len < size) {
+        seed = seed * 1103515245 + 12345;
+        int words = 1 + (seed >> 16) % 16;
+        for (int w = 0; w < words && len < size; w++) {
+            seed = seed * 1103515245 + 12345;
+            int letters = 1 + (seed >> 16) % 12;
+            for (int i = 0; i < letters; i++) text[len++] = 'a' + i;
+            text[len++] = w + 1 < words ? ' ' : '\n';
+        }
+    }
+    return text;
+}
+
+/**
+ * @brief Times a command line run through execute_command(), per invocation.
+ */
+static double time_command(const char *line, int runs) {
+    double start = now();
+    for (int i = 0; i < runs; i++) {
+        char *copy = strdup(line);
+        char **args = parse_line(copy);
+        execute_command(args);
+        free_tokens(args);
+        free(copy);
+    }
+    return (now() - start) / runs;
+}
+
+int main(int argc, char **argv) {
+    size_t mb = argc > 1 ? (size_t)atoi(argv[1]) : 1024;
+    int runs = argc > 2 ? atoi(argv[2]) : 200;
+    initialize_shell();
+
+    // Small files: the builtin against forking coreutils
+    char small[] = "/tmp/wsh-bench-wc-XXXXXX";
+    int fd = mkstemp(small);
+    char *text = make_text(4096);
+    if (fd == -1 || write(fd, text, 4096) != 4096) {
+        perror("bench");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    free(text);
+
+    const char *tools[] = {"wc -l", "head -n 10", "tail -n 10"};
+    const char *paths[] = {"/usr/bin/wc -l", "/usr/bin/head -n 10", "/usr/bin/tail -n 10"};
+    printf("4 KiB file, %d runs each\n", runs);
+    for (int i = 0; i < 3; i++) {
+        char line[256];
+        snprintf(line, sizeof(line), "%s %s >/dev/null", tools[i], small);
+        double builtin = time_command(line, runs);
+        snprintf(line, sizeof(line), "%s %s >/dev/null", paths[i], small);
+        double forked = time_command(line, runs);
+        printf("%-12s builtin %8.1f us   fork+exec %8.1f us   %6.1fx\n", tools[i],
+               builtin * 1e6, forked * 1e6, forked / builtin);
+    }
+    unlink(small);
+
+    // Throughput over a large in-memory buffer
+    size_t len = mb << 20;
+    text = make_text(len);
+    printf("\n%zu MiB of text\n", mb);
+    const char *classifiers[] = {"scalar", "sse2", "avx2"};
+    for (size_t i = 0; i < sizeof(classifiers) / sizeof(char *); i++) {
+        if (select_classifier(classifiers[i]) != 0) {
+            printf("%-8s unsupported on this CPU\n", classifiers[i]);
+            continue;
+        }
+        double best_lines = 1e9, best_words = 1e9;
+        size_t lines = 0, words = 0;
+        for (int r = 0; r < 3; r++) {
+            double start = now();
+            lines = count_lines(text, len);
+            double elapsed = now() - start;
+            if (elapsed < best_lines) best_lines = elapsed;
+
+            start = now();
+            words = count_words(text, len);
+            elapsed = now() - start;
+            if (elapsed < best_words) best_words = elapsed;
+        }
+        printf("%-8s wc -l %7.2f GB/s   wc %7.2f GB/s   (%zu lines, %zu words)\n",
+               classifiers[i], len / best_lines / 1e9, len / best_words / 1e9, lines, words);
+    }
+
+    free(text);
+    cleanup_shell();
+    return EXIT_SUCCESS;
+}
@@ -8,6 +8,7 @@ typedef struct VarNode {
 } VarNode;
 
 VarNode *var_head = NULL;
+VarNode *var_tail = NULL;
 
 // History structure (circular buffer)
 typedef struct History {
@@ -19,6 +20,474 @@ typedef struct History {
 
 History history = {NULL, 0, 0, 0};
 
+// Checkpoint state for long batch scripts
+typedef struct Checkpoint {
+    char *path;       // checkpoint file (NULL when disabled)
+    char *script;     // absolute path of the script being run
+    off_t size;       // script size when checkpointing started
+    time_t mtime;     // script modification time when checkpointing started
+    long offset;      // byte offset just past the last completed line
+    long pending;     // lines completed since the last write
+    struct timespec last_write;
+} Checkpoint;
+
+Checkpoint checkpoint = {NULL, NULL, 0, 0, 0, 0, {0, 0}};
+
+// Termination signal received while checkpointing (0 if none)
+volatile sig_atomic_t checkpoint_signal = 0;
+
+// Bounded single-producer/single-consumer queue of pointers. The ring
+// indices are only advanced with atomics; the semaphores let either side
+// sleep when the ring is empty or full instead of spinning.
+typedef struct SpscQueue {
+    void **slots;
+    size_t capacity;        // always a power of two
+    _Atomic size_t head;    // next slot to pop, owned by the consumer
+    _Atomic size_t tail;    // next slot to push, owned by the producer
+    sem_t items;
+    sem_t spaces;
+} SpscQueue;
+
+// Open-addressing hash map from strings to values
+typedef struct StrMap {
+    char **keys;
+    void **values;
+    size_t capacity;  // always a power of two (0 when empty)
+    size_t count;
+} StrMap;
+
+// Marks delimiter and '$' bytes in 64-byte blocks, one bit per byte
+typedef void (*Classifier)(const char *s, size_t blocks, uint64_t *delim, uint64_t *dollar);
+
+static void classify_scalar(const char *s, size_t blocks, uint64_t *delim, uint64_t *dollar);
+Classifier classifier = classify_scalar;
+
+// Line and word counts for wc, carried across buffers
+typedef struct TextCounts {
+    uint64_t lines;
+    uint64_t words;
+    int in_word;            // the last byte seen was inside a word
+} TextCounts;
+
+// Counters picked with the classifier: lines and words, or lines alone
+typedef void (*TextCounter)(const char *s, size_t len, TextCounts *counts);
+typedef size_t (*NewlineCounter)(const char *s, size_t len);
+
+static void count_text_scalar(const char *s, size_t len, TextCounts *counts);
+static size_t count_newlines_scalar(const char *s, size_t len);
+TextCounter text_counter = count_text_scalar;
+NewlineCounter newline_counter = count_newlines_scalar;
+
+// Single fixed-string search, also picked with the classifier
+typedef const char *(*SubstringFinder)(const char *s, size_t len, const char *pattern, size_t m);
+
+static const char *find_substring_scalar(const char *s, size_t len, const char *pattern, size_t m);
+SubstringFinder substring_finder = find_substring_scalar;
+
+// Totals for one wc operand
+typedef struct WcCounts {
+    uintmax_t lines;
+    uintmax_t words;
+    uintmax_t bytes;
+    int bytes_only;         // only -c/-m: a regular file's size is enough
+} WcCounts;
+
+// Aho-Corasick automaton for match with several patterns, as a full DFA
+typedef struct AhoCorasick {
+    int32_t *next;          // states * 256 transitions
+    uint8_t *accept;        // the state ends a pattern, directly or through its fail links
+    size_t states;
+} AhoCorasick;
+
+// Patterns and options for one run of the match builtin
+typedef struct Matcher {
+    const char **patterns;  // not NUL-terminated; see lengths
+    size_t *lengths;
+    size_t count;
+    int match_all;          // an empty pattern selects every line
+    size_t *hits;           // up to MATCH_SIMD_PATTERNS: each pattern's next match, SIZE_MAX if none
+    AhoCorasick ac;         // built when there are more patterns than that
+    int invert;             // -v
+    int count_only;         // -c
+    int list_only;          // -l
+    int show_names;         // more than one input: prefix lines with the file name
+} Matcher;
+
+// Pieces of a brace word
+typedef enum BraceKind {
+    BRACE_TEXT,             // literal text
+    BRACE_LIST,             // {a,b,c}
+    BRACE_RANGE,            // {x..y} or {x..y..step}
+} BraceKind;
+
+typedef struct BracePart {
+    BraceKind kind;
+    const char *text;       // BRACE_TEXT: points into the argument, not NUL-terminated
+    size_t len;
+    struct BraceWord *alternatives;  // BRACE_LIST
+    size_t count;
+    intmax_t start;         // BRACE_RANGE: generated on demand, never stored
+    intmax_t step;          // signed in the direction of the range
+    size_t values;
+    int width;              // zero padding, from operands like 01
+    int letters;            // {a..e} rather than numbers
+} BracePart;
+
+// A word as a sequence of parts; it expands to their cartesian product
+typedef struct BraceWord {
+    BracePart *parts;
+    size_t count;
+} BraceWord;
+
+// The parts still to expand after a list alternative, innermost first
+typedef struct BraceRest {
+    const BraceWord *word;
+    size_t part;
+    const struct BraceRest *next;
+} BraceRest;
+
+// Where expanded words go: straight into an argv block, or to builtin output
+typedef struct BraceSink {
+    char **tokens;          // NULL to print one word per line
+    char *storage;
+    size_t position;
+} BraceSink;
+
+// A sourced file, cached as raw tokens per line
+typedef struct SourcedScript {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    char ***lines;      // raw token arrays from tokenize_line()
+    size_t count;
+    int refs;           // the cache's reference plus one per active `source`
+} SourcedScript;
+
+// Sourced files by device and inode
+StrMap source_cache = {NULL, NULL, 0, 0};
+int source_depth = 0;
+
+// A script line read and tokenized ahead of execution
+typedef struct ParsedLine {
+    char *text;     // the line as typed, for history (NULL at end of script)
+    char **raw;     // raw tokens from tokenize_line()
+    long offset;    // script offset just past this line, for checkpoints
+} ParsedLine;
+
+// Parser thread feeding the executor in batch mode
+typedef struct ParseAhead {
+    SpscQueue queue;
+    FILE *input;
+    pthread_t thread;
+    int running;
+    pid_t owner;            // process that started the thread
+    atomic_int stopping;    // set by parse_ahead_stop(), checked by the thread
+    atomic_int done;        // set by the thread as it returns
+} ParseAhead;
+
+ParseAhead parse_ahead = {.running = 0};
+
+// Shell variables by name, so lookups do not walk the list
+StrMap var_index = {NULL, NULL, 0, 0};
+
+// Environment entries the shell allocated, "NAME=value" by NAME
+StrMap env_strings = {NULL, NULL, 0, 0};
+
+// Resolved executable paths for the PATH value in path_cache_env
+StrMap path_cache = {NULL, NULL, 0, 0};
+char *path_cache_env = NULL;
+
+// On-disk layout of a shell state snapshot. Strings are NUL-terminated and
+// every reference is a byte offset from the start of the file, so a mapped
+// snapshot is used in place.
+typedef struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t var_count;        // shell variables, in insertion order
+    uint32_t var_slots;        // hash slots for variable lookup (power of two)
+    uint32_t env_count;
+    uint32_t history_capacity;
+    uint32_t history_count;    // history commands, oldest first
+    uint32_t path_count;       // command path cache entries
+    uint32_t path_slots;       // hash slots for path lookup (power of two)
+    uint64_t vars;             // SnapshotEntry[var_count]
+    uint64_t var_table;        // uint32_t[var_slots], entry index + 1 (0 = empty)
+    uint64_t env;              // uint64_t[env_count], "NAME=VALUE" strings
+    uint64_t history;          // uint64_t[history_count]
+    uint64_t paths;            // SnapshotEntry[path_count]
+    uint64_t path_table;       // uint32_t[path_slots]
+    uint64_t path_env;         // PATH the path cache was built for
+    uint64_t cwd;
+    uint64_t size;             // total file size
+} SnapshotHeader;
+
+typedef struct SnapshotEntry {
+    uint64_t name;
+    uint64_t value;
+} SnapshotEntry;
+
+// Snapshot loaded with --load-state (base is NULL when none is loaded)
+typedef struct Snapshot {
+    char *base;
+    size_t size;
+    const SnapshotHeader *header;
+    char **overrides;   // values assigned with `local` after loading, by entry
+    char **environ;     // environment pointer array into the mapping
+    int paths_valid;    // whether the path cache matches the current PATH
+} Snapshot;
+
+Snapshot snapshot = {NULL, 0, NULL, NULL, NULL, 0};
+
+// File the shell state is saved to on exit (NULL if not requested)
+char *save_state_path = NULL;
+
+static void release_sourced_script(SourcedScript *sourced);
+static void launcher_init(void);
+static void launcher_close(void);
+static int64_t snapshot_find(uint64_t table, uint32_t slots, uint64_t entries, const char *name);
+static int64_t snapshot_find_variable(const char *name);
+static const char *snapshot_lookup_variable(const char *name);
+static char *read_all(int fd, size_t *len);
+static int run_command(char **args, int assignments);
+static int set_environment(const char *name, const char *value);
+static void unset_environment(const char *name);
+static int rate_limit_command(char **args, int assignments);
+static char **substitute_tokens(char **raw);
+static int dispatch_assignments(char **args, int done);
+static void rate_bucket_unmap(void *bucket);
+static int is_builtin(const char *name);
+static int is_assignment(const char *word);
+
+// A directory held open so returning to it never walks its path again
+typedef struct DirEntry {
+    int fd;         // O_PATH descriptor
+    char *path;     // canonical path
+} DirEntry;
+
+// The current directory, kept so pwd and $PWD never call getcwd()
+DirEntry current_dir = {-1, NULL};
+
+// pushd/popd stack, most recently pushed last
+typedef struct DirStack {
+    DirEntry *entries;
+    int count;
+    int capacity;
+} DirStack;
+
+DirStack dir_stack = {NULL, 0, 0};
+
+// io_uring instance ls submits statx batches through; fd -2 until first use, -1 if unusable
+typedef struct StatRing {
+    int fd;
+    unsigned entries;
+#ifdef WSH_HAVE_IO_URING
+    unsigned *sq_head, *sq_tail, *sq_array, sq_mask;
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+#endif
+} StatRing;
+
+StatRing stat_ring = {.fd = -2};
+
+// A set of names to statx relative to one directory
+typedef struct StatBatch {
+    int dirfd;
+    int flags;              // AT_* flags for statx
+    size_t count;
+    char **names;
+    struct statx *out;
+    int *errors;            // errno per name, 0 on success
+    atomic_size_t next;     // next unclaimed index for the thread pool
+} StatBatch;
+
+// One destination of the tee builtin
+typedef struct TeeOutput {
+    int fd;
+    const char *name;
+    int is_pipe;
+    int failed;             // reported once, then skipped
+} TeeOutput;
+
+// One name in a listing
+typedef struct LsEntry {
+    char *name;
+    size_t offset;          // name offset in the arena while reading
+    unsigned char type;     // DT_* from readdir, refined by statx
+    struct statx *st;       // NULL when not stat'ed
+} LsEntry;
+
+// Recently resolved uid or gid names
+typedef struct LsIdCache {
+    unsigned ids[LS_ID_CACHE];
+    char *names[LS_ID_CACHE];
+    int count;
+} LsIdCache;
+
+// Options and output state for one ls invocation
+typedef struct LsState {
+    int long_format;
+    int recursive;
+    int all;
+    int headings;           // print "dir:" before each directory
+    int printed;            // something was printed, so headings need a blank line
+    LsIdCache users;
+    LsIdCache groups;
+} LsState;
+
+// A command's audit line, formatted on the main thread and written by the audit thread
+struct AuditRecord {
+    char *text;
+    size_t len;
+    struct timespec start;  // CLOCK_MONOTONIC when the command started
+};
+
+// WSH_AUDIT_LOG state; the counters are read by the audit builtin
+typedef struct Audit {
+    SpscQueue queue;
+    pthread_t thread;
+    int running;
+    char *path;
+    char *user;
+    int fd;                 // owned by the writer thread while running
+    size_t size;            // bytes in the current log file
+    size_t max_size;        // rotate to PATH.1 beyond this
+    atomic_size_t records;
+    atomic_size_t written;
+    atomic_size_t dropped;
+    atomic_size_t rotations;
+} Audit;
+
+Audit audit = {.running = 0, .fd = -1};
+
+// Marks the end of the audit queue
+#define AUDIT_STOP ((AuditRecord *)&audit)
+
+// A command running in the background under -j
+typedef struct Job {
+    pid_t pid;
+    AuditRecord *record;    // finished when the command is reaped
+    char **paths;           // absolute paths it may touch, from launcher_paths()
+} Job;
+
+// Pressure-aware launcher: gating of spawns and the -j concurrency limit
+typedef struct Launcher {
+    int gating;             // delay spawns while pressure is over the limits
+    int async;              // -j: do not wait for external commands
+    int adaptive;           // -j auto: adjust limit AIMD style
+    int limit, min, max;    // current concurrency and its bounds
+    int credit;             // completions since the limit last grew
+    int cpus;
+    int fds[4];             // /proc/pressure/{cpu,memory,io} and /proc/loadavg
+    double sample[4];       // PSI some avg10 percentages and load per CPU, -1 if unknown
+    double limits[4];
+    struct timespec started, sampled_at, decreased_at;
+    Job *jobs;
+    int count, capacity;
+    AuditRecord *record;    // audit record of the command being dispatched
+    size_t spawns, delays, forced, increases, decreases;
+    double delay_ms;
+    char log[LAUNCH_LOG_SIZE][LAUNCH_LOG_WIDTH];
+    size_t log_count;
+} Launcher;
+
+Launcher launcher = {.fds = {-1, -1, -1, -1}};
+
+// Names of the sample and limits slots, as thresholds and the pressure builtin spell them
+static const char *pressure_names[4] = {"cpu", "memory", "io", "load"};
+
+// Children's environments for VAR=x prefixes: environ's pointers, patched per launch
+typedef struct EnvOverlay {
+    char **envp;
+    size_t capacity;
+} EnvOverlay;
+
+EnvOverlay env_overlay = {NULL, 0};
+
+// A ratelimit token bucket in GCRA form, mapped from /dev/shm so every wsh
+// on the host shares it: the theoretical arrival time of the next command
+typedef struct RateBucket {
+    _Atomic int64_t tat_ns;     // CLOCK_MONOTONIC nanoseconds
+} RateBucket;
+
+// Options of one ratelimit prefix
+typedef struct RateLimit {
+    int64_t interval_ns;        // time per token
+    int64_t burst;              // tokens available after an idle period
+    const char *name;           // bucket name: -k NAME, or the command's base name
+    char **command;
+} RateLimit;
+
+// Buckets mapped so far, by name
+StrMap rate_buckets = {NULL, NULL, 0, 0};
+
+// A job started by --serve-fifo
+typedef struct ServeJob {
+    pid_t pid;              // 0 when the slot is free
+    char id[SERVE_ID_MAX];  // the client's id, or the job's sequence number
+    struct timespec start;
+} ServeJob;
+
+// Set in a --serve-fifo job or a $(...) child: a program replaces the
+// process instead of forking again
+int exec_in_place = 0;
+
+// Set in those same children: they share the script stream and have none
+// of the shell's threads, so `exit` leaves with _exit() and no cleanup
+int forked_child = 0;
+
+// A $(...) on the line being parsed
+typedef struct Substitution {
+    char *command;          // the text between the parentheses
+    pid_t pid;              // 0 once reaped, or if it never forked
+    int fd;                 // read end of its stdout, -1 once drained
+    char *output;
+    size_t len;
+    size_t capacity;
+} Substitution;
+
+// Sibling $(...) that each run one program are started together; --serial-substitution turns this off
+int concurrent_substitution = 1;
+
+// What running a script line costs, as --lint-perf classifies it
+typedef enum LintClass {
+    LINT_INTERNAL,          // handled by the shell itself: assignments
+    LINT_BUILTIN,           // a builtin, run in-process
+    LINT_EXTERNAL,          // a program, one fork and exec
+    LINT_DYNAMIC,           // history N: whatever the history holds when it runs
+} LintClass;
+
+// A distinct command line costing forks, for --lint-perf's offender list
+typedef struct LintCommand {
+    const char *text;       // as written (owned by the map key)
+    long count;             // lines with this text
+    long forks;             // per run, including the lines of sourced files
+    long lines[LINT_LINES_SHOWN];
+    const char *hint;       // a cheaper alternative, if there is one
+    int external;           // a program rather than a sourced file
+} LintCommand;
+
+// Exit status of the last command: the child's status, or 1 if a builtin reported an error
+int last_status = 0;
+
+// Builtin output is formatted here and written with writev, bypassing stdio
+typedef struct OutBuf {
+    int fd;
+    size_t used;
+    char data[OUTBUF_SIZE];
+} OutBuf;
+
+OutBuf out_stdout = {STDOUT_FILENO, 0, {0}};
+OutBuf out_stderr = {STDERR_FILENO, 0, {0}};
+OutBuf *wsh_out = &out_stdout;
+OutBuf *wsh_err = &out_stderr;
+
+// Messages written to wsh_err, so run_builtin can tell whether a builtin failed
+size_t builtin_errors = 0;
+
 // Function declarations for built-in commands
 int wsh_cd(char **args);
 int wsh_exit_cmd(char **args);
@@ -27,6 +496,24 @@ int wsh_local_cmd(char **args);
 int wsh_vars(char **args);
 int wsh_history_cmd(char **args);
 int wsh_ls(char **args);
+int wsh_source(char **args);
+int wsh_pwd(char **args);
+int wsh_pushd(char **args);
+int wsh_popd(char **args);
+int wsh_audit(char **args);
+int wsh_pressure(char **args);
+int wsh_tee(char **args);
+int wsh_head(char **args);
+int wsh_tail(char **args);
+int wsh_wc(char **args);
+int wsh_match(char **args);
+int wsh_braces(char **args);
+int wsh_read(char **args);
+int wsh_date(char **args);
+int wsh_sleep(char **args);
+
+// When the shell started, for $SECONDS
+struct timespec shell_start = {0, 0};
 
 // List of built-in commands and their corresponding functions
 char *builtin_str[] = {
@@ -37,6 +524,22 @@ char *builtin_str[] = {
     "vars",
     "history",
     "ls",
+    "source",
+    ".",
+    "pwd",
+    "pushd",
+    "popd",
+    "audit",
+    "pressure",
+    "tee",
+    "head",
+    "tail",
+    "wc",
+    "match",
+    "braces",
+    "read",
+    "date",
+    "sleep",
 };
 
 int (*builtin_func[]) (char **) = {
@@ -47,18 +550,350 @@ int (*builtin_func[]) (char **) = {
     &wsh_vars,
     &wsh_history_cmd,
     &wsh_ls,
+    &wsh_source,
+    &wsh_source,
+    &wsh_pwd,
+    &wsh_pushd,
+    &wsh_popd,
+    &wsh_audit,
+    &wsh_pressure,
+    &wsh_tee,
+    &wsh_head,
+    &wsh_tail,
+    &wsh_wc,
+    &wsh_match,
+    &wsh_braces,
+    &wsh_read,
+    &wsh_date,
+    &wsh_sleep,
 };
 
 int num_builtins() {
     return sizeof(builtin_str) / sizeof(char *);
 }
 
+/**
+ * @brief Initializes a queue holding up to capacity items.
+ * 
+ * @return int 0 on success, -1 on allocation failure.
+ */
+static int spsc_init(SpscQueue *q, size_t capacity) {
+    q->slots = calloc(capacity, sizeof(void*));
+    if (!q->slots) return -1;
+    q->capacity = capacity;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    sem_init(&q->items, 0, 0);
+    sem_init(&q->spaces, 0, capacity);
+    return 0;
+}
+
+/**
+ * @brief Releases a queue's storage. Items still queued are not freed.
+ */
+static void spsc_destroy(SpscQueue *q) {
+    sem_destroy(&q->items);
+    sem_destroy(&q->spaces);
+    free(q->slots);
+    q->slots = NULL;
+}
+
+/**
+ * @brief Stores an item once a slot is known to be free.
+ */
+static void spsc_store(SpscQueue *q, void *item) {
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    q->slots[tail & (q->capacity - 1)] = item;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    sem_post(&q->items);
+}
+
+/**
+ * @brief Pushes an item, sleeping while the queue is full.
+ */
+static void spsc_push(SpscQueue *q, void *item) {
+    while (sem_wait(&q->spaces) != 0) {
+        // Retry after signal interruptions
+    }
+    spsc_store(q, item);
+}
+
+/**
+ * @brief Pushes an item unless the queue is full.
+ * 
+ * @return int 0 if the item was queued, -1 if the queue was full.
+ */
+static int spsc_try_push(SpscQueue *q, void *item) {
+    if (sem_trywait(&q->spaces) != 0) {
+        return -1;
+    }
+    spsc_store(q, item);
+    return 0;
+}
+
+/**
+ * @brief Pops the oldest item, sleeping while the queue is empty.
+ */
+static void *spsc_pop(SpscQueue *q) {
+    while (sem_wait(&q->items) != 0) {
+        // Retry after signal interruptions
+    }
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    void *item = q->slots[head & (q->capacity - 1)];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    sem_post(&q->spaces);
+    return item;
+}
+
+/**
+ * @brief Pops the oldest item if there is one.
+ * 
+ * @return void* The item, or NULL if the queue was empty.
+ */
+static void *spsc_try_pop(SpscQueue *q) {
+    if (sem_trywait(&q->items) != 0) {
+        return NULL;
+    }
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    void *item = q->slots[head & (q->capacity - 1)];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    sem_post(&q->spaces);
+    return item;
+}
+
+/**
+ * @brief Hashes a string with FNV-1a.
+ */
+static size_t strmap_hash(const char *key) {
+    size_t hash = 1469598103934665603ULL;
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        hash = (hash ^ *p) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Finds the slot holding key, or the empty slot where it belongs.
+ */
+static size_t strmap_slot(const StrMap *map, const char *key) {
+    size_t mask = map->capacity - 1;
+    size_t i = strmap_hash(key) & mask;
+    while (map->keys[i] && strcmp(map->keys[i], key) != 0) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/**
+ * @brief Looks up a key.
+ * 
+ * @return int 1 if found (value stored in *value when non-NULL), 0 otherwise.
+ */
+static int strmap_get(const StrMap *map, const char *key, void **value) {
+    if (map->count == 0) return 0;
+    size_t i = strmap_slot(map, key);
+    if (!map->keys[i]) return 0;
+    if (value) *value = map->values[i];
+    return 1;
+}
+
+/**
+ * @brief Inserts or replaces a key. The key is copied; the value is not.
+ * 
+ * @return int 0 on success, -1 on allocation failure.
+ */
+static int strmap_put(StrMap *map, const char *key, void *value) {
+    // Grow at 50% load to keep probe sequences short
+    if ((map->count + 1) * 2 > map->capacity) {
+        size_t new_capacity = map->capacity ? map->capacity * 2 : 64;
+        char **new_keys = calloc(new_capacity, sizeof(char*));
+        void **new_values = calloc(new_capacity, sizeof(void*));
+        if (!new_keys || !new_values) {
+            free(new_keys);
+            free(new_values);
+            return -1;
+        }
+        StrMap grown = {new_keys, new_values, new_capacity, map->count};
+        for (size_t i = 0; i < map->capacity; i++) {
+            if (map->keys[i]) {
+                size_t slot = strmap_slot(&grown, map->keys[i]);
+                new_keys[slot] = map->keys[i];
+                new_values[slot] = map->values[i];
+            }
+        }
+        free(map->keys);
+        free(map->values);
+        *map = grown;
+    }
+
+    size_t i = strmap_slot(map, key);
+    if (!map->keys[i]) {
+        map->keys[i] = strdup(key);
+        if (!map->keys[i]) return -1;
+        map->count++;
+    }
+    map->values[i] = value;
+    return 0;
+}
+
+/**
+ * @brief Removes every entry, releasing values with free_value when given.
+ */
+static void strmap_clear(StrMap *map, void (*free_value)(void *)) {
+    for (size_t i = 0; i < map->capacity; i++) {
+        if (map->keys[i]) {
+            free(map->keys[i]);
+            if (free_value) free_value(map->values[i]);
+        }
+    }
+    free(map->keys);
+    free(map->values);
+    map->keys = NULL;
+    map->values = NULL;
+    map->capacity = 0;
+    map->count = 0;
+}
+
+/**
+ * @brief Writes out everything buffered, plus extra bytes, with one writev call.
+ * 
+ * @param out The buffer to drain.
+ * @param extra Bytes to write after the buffered data, or NULL.
+ * @param len Length of extra.
+ * @return int 0 on success, -1 on a write error.
+ */
+static int out_drain(OutBuf *out, const void *extra, size_t len) {
+    struct iovec iov[2] = {
+        {out->data, out->used},
+        {(void *)extra, len},
+    };
+    struct iovec *next = iov;
+    int iovcnt = extra && len ? 2 : 1;
+    out->used = 0;
+
+    while (iovcnt > 0) {
+        if (next->iov_len == 0) {
+            next++;
+            iovcnt--;
+            continue;
+        }
+        ssize_t written = writev(out->fd, next, iovcnt);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        // Skip whatever a short write already covered
+        while (iovcnt > 0 && (size_t)written >= next->iov_len) {
+            written -= next->iov_len;
+            next++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            next->iov_base = (char *)next->iov_base + written;
+            next->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Appends bytes to a builtin output buffer, writing through when it is full.
+ */
+void out_write(OutBuf *out, const void *data, size_t len) {
+    // Keep stdout and stderr in program order when both reach one terminal
+    if (out == wsh_err) {
+        builtin_errors++;
+        if (wsh_out->used) out_drain(wsh_out, NULL, 0);
+    } else if (wsh_err->used) {
+        out_drain(wsh_err, NULL, 0);
+    }
+    if (len > OUTBUF_SIZE - out->used) {
+        out_drain(out, data, len);
+        return;
+    }
+    memcpy(out->data + out->used, data, len);
+    out->used += len;
+}
+
+/**
+ * @brief Formats straight into a builtin output buffer.
+ */
+void out_printf(OutBuf *out, const char *format, ...) {
+    if (out == wsh_err) {
+        builtin_errors++;
+        if (wsh_out->used) out_drain(wsh_out, NULL, 0);
+    } else if (wsh_err->used) {
+        out_drain(wsh_err, NULL, 0);
+    }
+
+    va_list ap;
+    va_start(ap, format);
+    size_t room = OUTBUF_SIZE - out->used;
+    int len = vsnprintf(out->data + out->used, room, format, ap);
+    va_end(ap);
+    if (len < 0) {
+        return;
+    }
+    if ((size_t)len < room) {
+        out->used += len;
+        return;
+    }
+
+    // Did not fit: flush and format again, spilling to the heap if the text is huge
+    out_drain(out, NULL, 0);
+    if ((size_t)len < OUTBUF_SIZE) {
+        va_start(ap, format);
+        vsnprintf(out->data, OUTBUF_SIZE, format, ap);
+        va_end(ap);
+        out->used = len;
+        return;
+    }
+    char *text = malloc((size_t)len + 1);
+    if (!text) {
+        return;
+    }
+    va_start(ap, format);
+    vsnprintf(text, (size_t)len + 1, format, ap);
+    va_end(ap);
+    out_drain(out, text, len);
+    free(text);
+}
+
+/**
+ * @brief Like perror(), but through the builtin stderr buffer.
+ */
+void out_perror(const char *prefix) {
+    out_printf(wsh_err, "%s: %s\n", prefix, strerror(errno));
+}
+
+/**
+ * @brief Writes out both builtin buffers.
+ * 
+ * Called after every builtin and before every fork, so a child never
+ * starts with output the shell has not written yet.
+ */
+void out_flush_all(void) {
+    if (out_stdout.used) out_drain(&out_stdout, NULL, 0);
+    if (out_stderr.used) out_drain(&out_stderr, NULL, 0);
+}
+
 /**
  * @brief Initializes the shell environment.
  */
 void initialize_shell(void) {
     // Overwrite PATH with /bin
-    setenv("PATH", DEFAULT_PATH, 1);
+    set_environment("PATH", DEFAULT_PATH);
+    clock_gettime(CLOCK_MONOTONIC, &shell_start);
+
+    // Use the widest vector classifier this CPU supports for tokenizing
+    select_classifier(NULL);
+
+    // Track the current directory from here on
+    current_dir.fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    current_dir.path = getcwd(NULL, 0);
+    if (current_dir.path) {
+        set_environment("PWD", current_dir.path);
+    }
 
     // Initialize history
     history.capacity = MAX_HISTORY;
@@ -72,12 +907,51 @@ void initialize_shell(void) {
     for (int i = 0; i < history.capacity; i++) {
         history.commands[i] = NULL;
     }
+
+    // Pressure sources for --pressure and -j auto
+    launcher_init();
+
+    // Record every command when asked to
+    const char *audit_log = getenv("WSH_AUDIT_LOG");
+    if (audit_log && *audit_log && audit_start(audit_log) == -1) {
+        fprintf(stderr, "wsh: audit logging disabled\n");
+    }
 }
 
 /**
  * @brief Cleans up the shell before exiting.
  */
 void cleanup_shell(void) {
+    // Write out anything a builtin left buffered
+    out_flush_all();
+
+    // Stop reading ahead before the state the parser uses goes away
+    parse_ahead_stop();
+
+    // Let background commands finish so their audit records are complete
+    launcher_close();
+
+    // Write out queued audit records
+    audit_stop();
+
+    // Record progress that has not reached the checkpoint file yet
+    if (checkpoint.path) {
+        if (checkpoint.pending > 0) {
+            checkpoint_write();
+        }
+        free(checkpoint.path);
+        free(checkpoint.script);
+        checkpoint.path = NULL;
+        checkpoint.script = NULL;
+    }
+
+    // Save the final state for a later --load-state
+    if (save_state_path) {
+        save_state(save_state_path);
+        free(save_state_path);
+        save_state_path = NULL;
+    }
+
     // Free shell variables
     VarNode *current = var_head;
     while (current) {
@@ -87,14 +961,83 @@ void cleanup_shell(void) {
         free(temp->value);
         free(temp);
     }
+    var_head = NULL;
+    var_tail = NULL;
+    strmap_clear(&var_index, NULL);
+    free(env_overlay.envp);
+    env_overlay.envp = NULL;
+    env_overlay.capacity = 0;
 
     // Free history
     for (int i = 0; i < history.capacity; i++) {
         if (history.commands[i]) {
-            free(history.commands[i]);
+            free_string(history.commands[i]);
         }
     }
     free(history.commands);
+    history.commands = NULL;
+    history.count = 0;
+
+    // Free cached sourced files
+    for (size_t i = 0; i < source_cache.capacity; i++) {
+        if (source_cache.keys[i]) {
+            release_sourced_script(source_cache.values[i]);
+        }
+    }
+    strmap_clear(&source_cache, NULL);
+
+    // Release the statx ring used by ls
+    stat_ring_close();
+
+    // Close tracked directories
+    for (int i = 0; i < dir_stack.count; i++) {
+        close(dir_stack.entries[i].fd);
+        free(dir_stack.entries[i].path);
+    }
+    free(dir_stack.entries);
+    dir_stack.entries = NULL;
+    dir_stack.count = dir_stack.capacity = 0;
+    if (current_dir.fd != -1) {
+        close(current_dir.fd);
+    }
+    free(current_dir.path);
+    current_dir.fd = -1;
+    current_dir.path = NULL;
+
+    // Unmap ratelimit buckets; their state stays in /dev/shm for other shells
+    strmap_clear(&rate_buckets, rate_bucket_unmap);
+
+    // Free the command path cache
+    strmap_clear(&path_cache, free);
+    free(path_cache_env);
+    path_cache_env = NULL;
+
+    // Release the snapshot last: the environment may still point into it
+    if (snapshot.base) {
+        if (snapshot.overrides) {
+            for (uint32_t i = 0; i < snapshot.header->var_count; i++) {
+                free(snapshot.overrides[i]);
+            }
+            free(snapshot.overrides);
+        }
+        clearenv();
+        strmap_clear(&env_strings, free);
+        free(snapshot.environ);
+        munmap(snapshot.base, snapshot.size);
+        snapshot.base = NULL;
+    }
+}
+
+/**
+ * @brief Frees a string unless it lives inside the loaded snapshot.
+ * 
+ * @param str The string to free.
+ */
+void free_string(char *str) {
+    if (snapshot.base && str >= snapshot.base && str < snapshot.base + snapshot.size) {
+        return;
+    }
+    free(str);
 }
 
 /**
@@ -130,7 +1073,7 @@ void add_history(const char *command) {
         history.count++;
     } else {
         // Overwrite the oldest command
-        free(history.commands[history.start]);
+        free_string(history.commands[history.start]);
         history.commands[history.start] = strdup(command);
         if (!history.commands[history.start]) {
             fprintf(stderr, "wsh: allocation error for history command\n");
@@ -146,7 +1089,7 @@ void add_history(const char *command) {
 void show_history(void) {
     for (int i = 0; i < history.count; i++) {
         int idx = (history.start + history.count - 1 - i) % history.capacity;
-        printf("%d) %s\n", i + 1, history.commands[idx]);
+        out_printf(wsh_out, "%d) %s\n", i + 1, history.commands[idx]);
     }
 }
 
@@ -157,13 +1100,13 @@ void show_history(void) {
  */
 void set_history_capacity(int capacity) {
     if (capacity <= 0) {
-        fprintf(stderr, "wsh: history capacity must be positive\n");
+        out_printf(wsh_err, "wsh: history capacity must be positive\n");
         return;
     }
 
     char **new_commands = malloc(sizeof(char*) * capacity);
     if (!new_commands) {
-        fprintf(stderr, "wsh: allocation error when setting history capacity\n");
+        out_printf(wsh_err, "wsh: allocation error when setting history capacity\n");
         return;
     }
     for (int i = 0; i < capacity; i++) {
@@ -176,7 +1119,7 @@ void set_history_capacity(int capacity) {
         int idx = (history.start + history.count - 1 - i) % history.capacity;
         new_commands[i] = strdup(history.commands[idx]);
         if (!new_commands[i]) {
-            fprintf(stderr, "wsh: allocation error when copying history commands\n");
+            out_printf(wsh_err, "wsh: allocation error when copying history commands\n");
             // Free already copied commands
             for (int j = 0; j < i; j++) {
                 free(new_commands[j]);
@@ -189,7 +1132,7 @@ void set_history_capacity(int capacity) {
     // Free old history
     for (int i = 0; i < history.capacity; i++) {
         if (history.commands[i]) {
-            free(history.commands[i]);
+            free_string(history.commands[i]);
         }
     }
     free(history.commands);
@@ -222,7 +1165,7 @@ int execute_history_command(int number) {
     // Duplicate the command to avoid modifying the history
     char *command_dup = strdup(command);
     if (!command_dup) {
-        fprintf(stderr, "wsh: allocation error for executing history command\n");
+        out_printf(wsh_err, "wsh: allocation error for executing history command\n");
         return 1;
     }
 
@@ -233,604 +1176,7335 @@ int execute_history_command(int number) {
     }
 
     free(command_dup);
-    // Free each token
-    for (int i = 0; args[i] != NULL; i++) {
-        free(args[i]);
-    }
-    free(args);
+    free_tokens(args);
     return 1;
 }
 
 /**
- * @brief Handles variable substitution in tokens.
+ * @brief Looks up a variable, checking the environment before shell variables.
  * 
- * @param token The token to process.
- * @return char* The substituted token.
+ * @param name The variable name.
+ * @return char* The value, or NULL if the variable is not set.
  */
-char *handle_variable_substitution(char *token) {
-    if (token[0] != '$') {
-        return strdup(token);
-    }
-
-    char *var_name = token + 1; // Skip the '$'
-
+char *lookup_variable(const char *name) {
     // Check environment variables first
-    char *env_value = getenv(var_name);
+    char *env_value = getenv(name);
     if (env_value) {
-        return strdup(env_value);
+        return env_value;
     }
 
-    // Then check shell variables
-    VarNode *current = var_head;
-    while (current) {
-        if (strcmp(current->name, var_name) == 0) {
-            return strdup(current->value);
-        }
-        current = current->next;
+    // Then check shell variables, starting with the snapshot's
+    const char *snapshot_value = snapshot_lookup_variable(name);
+    if (snapshot_value) {
+        return (char *)snapshot_value;
     }
-
-    // Variable not found; substitute with empty string
-    return strdup("");
+    void *node;
+    if (strmap_get(&var_index, name, &node)) {
+        return ((VarNode *)node)->value;
+    }
+    return NULL;
 }
 
 /**
- * @brief Parses the input line into tokens, handling variable substitution.
+ * @brief Calls fn for every shell variable in insertion order.
  * 
- * @param line The input line.
- * @return char** Array of tokens.
+ * @param fn Callback receiving each name and value.
+ * @param ctx Passed through to fn.
  */
-char **parse_line(char *line) {
-    int bufsize = MAX_TOKENS, position = 0;
-    char **tokens = malloc(bufsize * sizeof(char*));
-    char *token;
+void for_each_variable(void (*fn)(const char *name, const char *value, void *ctx), void *ctx) {
+    if (snapshot.base) {
+        const SnapshotEntry *entries = (const SnapshotEntry *)(snapshot.base + snapshot.header->vars);
+        for (uint32_t i = 0; i < snapshot.header->var_count; i++) {
+            const char *value = snapshot.overrides && snapshot.overrides[i]
+                ? snapshot.overrides[i] : snapshot.base + entries[i].value;
+            fn(snapshot.base + entries[i].name, value, ctx);
+        }
+    }
+    for (VarNode *var = var_head; var; var = var->next) {
+        fn(var->name, var->value, ctx);
+    }
+}
 
-    if (!tokens) {
-        fprintf(stderr, "wsh: allocation error\n");
-        exit(EXIT_FAILURE);
+/**
+ * @brief Sets a shell variable, appending it if it is new.
+ * 
+ * @param name The variable name.
+ * @param value The new value; ownership passes to the shell.
+ * @return int 0 on success, -1 on allocation failure.
+ */
+int set_shell_variable(const char *name, char *value) {
+    // Variables from a snapshot keep their place and take an override
+    int64_t index = snapshot_find_variable(name);
+    if (index >= 0) {
+        if (!snapshot.overrides) {
+            snapshot.overrides = calloc(snapshot.header->var_count, sizeof(char*));
+            if (!snapshot.overrides) {
+                free(value);
+                return -1;
+            }
+        }
+        free(snapshot.overrides[index]);
+        snapshot.overrides[index] = value;
+        return 0;
     }
 
-    token = strtok(line, DELIMITERS);
-    while (token != NULL) {
-        // Handle variable substitution
-        char *processed_token = handle_variable_substitution(token);
-        tokens[position++] = processed_token;
+    // Check if variable already exists
+    void *existing;
+    if (strmap_get(&var_index, name, &existing)) {
+        // Update existing variable
+        free(((VarNode *)existing)->value);
+        ((VarNode *)existing)->value = value;
+        return 0;
+    }
 
-        if (position >= bufsize) {
-            bufsize += MAX_TOKENS;
-            tokens = realloc(tokens, bufsize * sizeof(char*));
-            if (!tokens) {
-                fprintf(stderr, "wsh: allocation error\n");
-                exit(EXIT_FAILURE);
+    // Add new variable
+    VarNode *new_var = malloc(sizeof(VarNode));
+    if (!new_var) {
+        free(value);
+        return -1;
+    }
+    new_var->name = strdup(name);
+    if (!new_var->name) {
+        free(new_var);
+        free(value);
+        return -1;
+    }
+    new_var->value = value;
+    new_var->next = NULL;
+    if (strmap_put(&var_index, name, new_var) == -1) {
+        free(new_var->name);
+        free(new_var);
+        free(value);
+        return -1;
+    }
+
+    // Append to the end of the list to maintain insertion order
+    if (var_tail == NULL) {
+        var_head = new_var;
+    } else {
+        var_tail->next = new_var;
+    }
+    var_tail = new_var;
+    return 0;
+}
+
+/**
+ * @brief Sets an environment variable to a "NAME=value" string the shell owns.
+ * 
+ * setenv() never frees a string it replaces, so a shell that keeps
+ * exporting or changing directory grows without bound. Entries go in with
+ * putenv() instead and the one replaced is freed here.
+ * 
+ * @return int 0 on success, -1 on allocation failure.
+ */
+static int set_environment(const char *name, const char *value) {
+    size_t name_len = strlen(name);
+    size_t value_len = strlen(value);
+    char *entry = malloc(name_len + value_len + 2);
+    if (!entry) return -1;
+    memcpy(entry, name, name_len);
+    entry[name_len] = '=';
+    memcpy(entry + name_len + 1, value, value_len + 1);
+
+    void *old = NULL;
+    strmap_get(&env_strings, name, &old);
+    if (strmap_put(&env_strings, name, entry) == -1) {
+        free(entry);
+        return -1;
+    }
+    if (putenv(entry) != 0) {
+        strmap_put(&env_strings, name, old);
+        free(entry);
+        return -1;
+    }
+    free(old);
+    return 0;
+}
+
+/**
+ * @brief Removes an environment variable, freeing the entry if the shell owns it.
+ */
+static void unset_environment(const char *name) {
+    unsetenv(name);
+    void *old;
+    if (strmap_get(&env_strings, name, &old)) {
+        strmap_put(&env_strings, name, NULL);
+        free(old);
+    }
+}
+
+/**
+ * @brief Reads a file for $(<FILE), trimming trailing newlines.
+ * 
+ * A regular file is sized with fstat() and read straight into the value,
+ * normally with a single read(); anything else is read until end of file.
+ * 
+ * @return char* The contents (free with free()), empty if the file cannot be
+ *         read, which also sets $? to 1.
+ */
+static char *read_file_value(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        out_printf(wsh_err, "wsh: %s: %s\n", path, strerror(errno));
+        last_status = 1;
+        return strdup("");
+    }
+
+    struct stat st;
+    char *value;
+    size_t len = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        // A file that grows meanwhile is read up to the size it had
+        value = malloc(st.st_size + 1);
+        while (value && len < (size_t)st.st_size) {
+            ssize_t n = read(fd, value + len, st.st_size - len);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) {
+                free(value);
+                value = NULL;
+            }
+            if (n <= 0) break;
+            len += n;
+        }
+    } else {
+        // Pipes, devices and /proc files report no useful size
+        value = read_all(fd, &len);
+        char *terminated = value ? realloc(value, len + 1) : NULL;
+        if (!terminated) free(value);
+        value = terminated;
+    }
+    if (!value) {
+        out_printf(wsh_err, "wsh: %s: %s\n", path, strerror(errno));
+        close(fd);
+        last_status = 1;
+        return strdup("");
+    }
+    close(fd);
+
+    while (len > 0 && value[len - 1] == '\n') len--;
+    value[len] = '\0';
+    return value;
+}
+
+/**
+ * @brief Formats $EPOCHSECONDS, $EPOCHREALTIME or $SECONDS from the vDSO clocks.
+ *
+ * @return int 1 if name is one of them, 0 otherwise.
+ */
+static int time_variable(const char *name, char *buf, size_t size) {
+    struct timespec ts;
+    if (strcmp(name, "EPOCHSECONDS") == 0) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        snprintf(buf, size, "%lld", (long long)ts.tv_sec);
+    } else if (strcmp(name, "EPOCHREALTIME") == 0) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        snprintf(buf, size, "%lld.%06ld", (long long)ts.tv_sec, ts.tv_nsec / 1000);
+    } else if (strcmp(name, "SECONDS") == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        snprintf(buf, size, "%lld", (long long)(ts.tv_sec - shell_start.tv_sec -
+                                                (ts.tv_nsec < shell_start.tv_nsec)));
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Handles variable substitution in tokens.
+ * 
+ * @param token The token to process.
+ * @return char* The substituted token.
+ */
+char *handle_variable_substitution(char *token) {
+    if (token[0] != '$') {
+        return strdup(token);
+    }
+
+    // $(<FILE) reads the file in-process instead of running cat
+    size_t len = strlen(token);
+    if (len > 4 && strncmp(token, "$(<", 3) == 0 && token[len - 1] == ')') {
+        token[len - 1] = '\0';
+        char *value = read_file_value(token + 3);
+        token[len - 1] = ')';
+        return value;
+    }
+
+    char *value = lookup_variable(token + 1); // Skip the '$'
+    if (value) {
+        return strdup(value);
+    }
+
+    // Clock variables, unless a variable of the same name is set
+    char clock_value[32];
+    if (time_variable(token + 1, clock_value, sizeof(clock_value))) {
+        return strdup(clock_value);
+    }
+
+    // Variable not found; substitute with empty string
+    return strdup("");
+}
+
+/**
+ * @brief Classifies 64-byte blocks with plain C, one byte at a time.
+ */
+static void classify_scalar(const char *s, size_t blocks, uint64_t *delim, uint64_t *dollar) {
+    for (size_t b = 0; b < blocks; b++, s += 64) {
+        uint64_t d = 0, v = 0;
+        for (int i = 0; i < 64; i++) {
+            unsigned char c = s[i];
+            if (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\a') {
+                d |= 1ULL << i;
+            } else if (c == '$') {
+                v |= 1ULL << i;
+            }
+        }
+        delim[b] = d;
+        dollar[b] = v;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * @brief Classifies 64-byte blocks 16 bytes at a time with SSE2.
+ */
+__attribute__((target("sse2")))
+static void classify_sse2(const char *s, size_t blocks, uint64_t *delim, uint64_t *dollar) {
+    const __m128i space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+    const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+    const __m128i bell = _mm_set1_epi8('\a'), dol = _mm_set1_epi8('$');
+    for (size_t b = 0; b < blocks; b++, s += 64) {
+        uint64_t d = 0, v = 0;
+        for (int i = 0; i < 64; i += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i *)(s + i));
+            __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, space), _mm_cmpeq_epi8(x, tab)),
+                                     _mm_or_si128(_mm_cmpeq_epi8(x, cr), _mm_cmpeq_epi8(x, lf)));
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(x, bell));
+            d |= (uint64_t)(uint16_t)_mm_movemask_epi8(m) << i;
+            v |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, dol)) << i;
+        }
+        delim[b] = d;
+        dollar[b] = v;
+    }
+}
+
+/**
+ * @brief Classifies 64-byte blocks 32 bytes at a time with AVX2.
+ */
+__attribute__((target("avx2")))
+static void classify_avx2(const char *s, size_t blocks, uint64_t *delim, uint64_t *dollar) {
+    const __m256i space = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t');
+    const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n');
+    const __m256i bell = _mm256_set1_epi8('\a'), dol = _mm256_set1_epi8('$');
+    for (size_t b = 0; b < blocks; b++, s += 64) {
+        uint64_t d = 0, v = 0;
+        for (int i = 0; i < 64; i += 32) {
+            __m256i x = _mm256_loadu_si256((const __m256i *)(s + i));
+            __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x, space), _mm256_cmpeq_epi8(x, tab)),
+                                        _mm256_or_si256(_mm256_cmpeq_epi8(x, cr), _mm256_cmpeq_epi8(x, lf)));
+            m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, bell));
+            d |= (uint64_t)(uint32_t)_mm256_movemask_epi8(m) << i;
+            v |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, dol)) << i;
+        }
+        delim[b] = d;
+        dollar[b] = v;
+    }
+}
+#endif
+
+/**
+ * @brief Adds one 64-byte block's newline, whitespace and printable masks to the counts.
+ * 
+ * Like coreutils wc in the C locale, a word starts at a printable non-space
+ * byte following whitespace; other control bytes neither start nor end one.
+ */
+static inline void count_text_block(uint64_t newline, uint64_t space, uint64_t graph,
+                                    TextCounts *counts) {
+    counts->lines += __builtin_popcountll(newline);
+    if ((space | graph) == ~0ULL) {
+        // Only word and space bytes: a word starts where a graph byte follows a space
+        uint64_t previous = (graph << 1) | (uint64_t)counts->in_word;
+        counts->words += __builtin_popcountll(graph & ~previous);
+        counts->in_word = graph >> 63;
+        return;
+    }
+    for (int i = 0; i < 64; i++) {
+        if (space >> i & 1) {
+            counts->in_word = 0;
+        } else if (graph >> i & 1) {
+            counts->words += !counts->in_word;
+            counts->in_word = 1;
+        }
+    }
+}
+
+/**
+ * @brief Counts lines and words of bytes that do not fill a 64-byte block.
+ */
+static void count_text_tail(const char *s, size_t len, TextCounts *counts) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c == '\n') counts->lines++;
+        if (c == ' ' || (c >= '\t' && c <= '\r')) {
+            counts->in_word = 0;
+        } else if (c > ' ' && c < 0x7f) {
+            counts->words += !counts->in_word;
+            counts->in_word = 1;
+        }
+    }
+}
+
+/**
+ * @brief Counts lines and words one byte at a time.
+ */
+static void count_text_scalar(const char *s, size_t len, TextCounts *counts) {
+    count_text_tail(s, len, counts);
+}
+
+/**
+ * @brief Counts newlines one byte at a time.
+ */
+static size_t count_newlines_scalar(const char *s, size_t len) {
+    size_t count = 0;
+    for (size_t i = 0; i < len; i++) {
+        count += s[i] == '\n';
+    }
+    return count;
+}
+
+/**
+ * @brief Finds the first occurrence of a pattern with memmem().
+ */
+static const char *find_substring_scalar(const char *s, size_t len, const char *pattern, size_t m) {
+    return memmem(s, len, pattern, m);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * @brief Counts lines and words 16 bytes at a time with SSE2.
+ */
+__attribute__((target("sse2")))
+static void count_text_sse2(const char *s, size_t len, TextCounts *counts) {
+    const __m128i lf = _mm_set1_epi8('\n'), sp = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t'), four = _mm_set1_epi8(4);
+    const __m128i bang = _mm_set1_epi8('!'), graph_span = _mm_set1_epi8('~' - '!');
+    size_t blocks = len / 64;
+    for (size_t b = 0; b < blocks; b++, s += 64) {
+        uint64_t newline = 0, space = 0, graph = 0;
+        for (int i = 0; i < 64; i += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i *)(s + i));
+            // \t..\r is one range: (x - '\t') <= 4 unsigned
+            __m128i ctl = _mm_sub_epi8(x, tab);
+            __m128i is_space = _mm_or_si128(_mm_cmpeq_epi8(x, sp),
+                                            _mm_cmpeq_epi8(_mm_min_epu8(ctl, four), ctl));
+            __m128i g = _mm_sub_epi8(x, bang);
+            __m128i is_graph = _mm_cmpeq_epi8(_mm_min_epu8(g, graph_span), g);
+            newline |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, lf)) << i;
+            space |= (uint64_t)(uint16_t)_mm_movemask_epi8(is_space) << i;
+            graph |= (uint64_t)(uint16_t)_mm_movemask_epi8(is_graph) << i;
+        }
+        count_text_block(newline, space, graph, counts);
+    }
+    count_text_tail(s, len % 64, counts);
+}
+
+/**
+ * @brief Counts lines and words 32 bytes at a time with AVX2.
+ */
+__attribute__((target("avx2")))
+static void count_text_avx2(const char *s, size_t len, TextCounts *counts) {
+    const __m256i lf = _mm256_set1_epi8('\n'), sp = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t'), four = _mm256_set1_epi8(4);
+    const __m256i bang = _mm256_set1_epi8('!'), graph_span = _mm256_set1_epi8('~' - '!');
+    size_t blocks = len / 64;
+    for (size_t b = 0; b < blocks; b++, s += 64) {
+        uint64_t newline = 0, space = 0, graph = 0;
+        for (int i = 0; i < 64; i += 32) {
+            __m256i x = _mm256_loadu_si256((const __m256i *)(s + i));
+            __m256i ctl = _mm256_sub_epi8(x, tab);
+            __m256i is_space = _mm256_or_si256(_mm256_cmpeq_epi8(x, sp),
+                                               _mm256_cmpeq_epi8(_mm256_min_epu8(ctl, four), ctl));
+            __m256i g = _mm256_sub_epi8(x, bang);
+            __m256i is_graph = _mm256_cmpeq_epi8(_mm256_min_epu8(g, graph_span), g);
+            newline |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, lf)) << i;
+            space |= (uint64_t)(uint32_t)_mm256_movemask_epi8(is_space) << i;
+            graph |= (uint64_t)(uint32_t)_mm256_movemask_epi8(is_graph) << i;
+        }
+        count_text_block(newline, space, graph, counts);
+    }
+    count_text_tail(s, len % 64, counts);
+}
+
+/**
+ * @brief Counts newlines 16 bytes at a time with SSE2.
+ * 
+ * Matches are accumulated as byte counters and folded with psadbw every
+ * 255 vectors, before any counter can overflow.
+ */
+__attribute__((target("sse2")))
+static size_t count_newlines_sse2(const char *s, size_t len) {
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t count = 0, i = 0;
+    while (len - i >= 16) {
+        size_t vectors = (len - i) / 16;
+        if (vectors > 255) vectors = 255;
+        __m128i acc = _mm_setzero_si128();
+        for (size_t v = 0; v < vectors; v++, i += 16) {
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + i)), lf));
+        }
+        uint64_t lanes[2];
+        _mm_storeu_si128((__m128i *)lanes, _mm_sad_epu8(acc, _mm_setzero_si128()));
+        count += lanes[0] + lanes[1];
+    }
+    return count + count_newlines_scalar(s + i, len - i);
+}
+
+/**
+ * @brief Counts newlines 32 bytes at a time with AVX2.
+ */
+__attribute__((target("avx2")))
+static size_t count_newlines_avx2(const char *s, size_t len) {
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t count = 0, i = 0;
+    while (len - i >= 32) {
+        size_t vectors = (len - i) / 32;
+        if (vectors > 255) vectors = 255;
+        __m256i acc = _mm256_setzero_si256();
+        for (size_t v = 0; v < vectors; v++, i += 32) {
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(s + i)), lf));
+        }
+        uint64_t lanes[4];
+        _mm256_storeu_si256((__m256i *)lanes, _mm256_sad_epu8(acc, _mm256_setzero_si256()));
+        count += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    return count + count_newlines_scalar(s + i, len - i);
+}
+
+/**
+ * @brief Finds a pattern 16 positions at a time with SSE2.
+ * 
+ * Positions whose first and last bytes both match the pattern's are
+ * candidates; only those are compared in full.
+ */
+__attribute__((target("sse2")))
+static const char *find_substring_sse2(const char *s, size_t len, const char *pattern, size_t m) {
+    if (m == 0) return s;
+    if (m > len) return NULL;
+    const __m128i first = _mm_set1_epi8(pattern[0]), last = _mm_set1_epi8(pattern[m - 1]);
+    size_t middle = m > 2 ? m - 2 : 0;
+    size_t i = 0;
+    for (; i + m - 1 + 16 <= len; i += 16) {
+        __m128i head = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i tail = _mm_loadu_si128((const __m128i *)(s + i + m - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first),
+                                                        _mm_cmpeq_epi8(tail, last)));
+        for (; mask; mask &= mask - 1) {
+            size_t at = i + __builtin_ctz(mask);
+            if (memcmp(s + at + 1, pattern + 1, middle) == 0) return s + at;
+        }
+    }
+    return memmem(s + i, len - i, pattern, m);
+}
+
+/**
+ * @brief Finds a pattern 32 positions at a time with AVX2.
+ */
+__attribute__((target("avx2")))
+static const char *find_substring_avx2(const char *s, size_t len, const char *pattern, size_t m) {
+    if (m == 0) return s;
+    if (m > len) return NULL;
+    const __m256i first = _mm256_set1_epi8(pattern[0]), last = _mm256_set1_epi8(pattern[m - 1]);
+    size_t middle = m > 2 ? m - 2 : 0;
+    size_t i = 0;
+    for (; i + m - 1 + 32 <= len; i += 32) {
+        __m256i head = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i tail = _mm256_loadu_si256((const __m256i *)(s + i + m - 1));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(head, first),
+                                                              _mm256_cmpeq_epi8(tail, last)));
+        for (; mask; mask &= mask - 1) {
+            size_t at = i + __builtin_ctz(mask);
+            if (memcmp(s + at + 1, pattern + 1, middle) == 0) return s + at;
+        }
+    }
+    return memmem(s + i, len - i, pattern, m);
+}
+#endif
+
+/**
+ * @brief Selects the byte classifier used by the tokenizer, the wc/tail counters and match.
+ * 
+ * @param name "scalar", "sse2", "avx2", or NULL for the best one this CPU supports.
+ * @return int 0 on success, -1 if the classifier is unknown or unsupported.
+ */
+int select_classifier(const char *name) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    int has_avx2 = __builtin_cpu_supports("avx2");
+    int has_sse2 = __builtin_cpu_supports("sse2");
+    if (name == NULL) {
+        name = has_avx2 ? "avx2" : has_sse2 ? "sse2" : "scalar";
+    }
+    if (strcmp(name, "avx2") == 0 && has_avx2) {
+        classifier = classify_avx2;
+        text_counter = count_text_avx2;
+        newline_counter = count_newlines_avx2;
+        substring_finder = find_substring_avx2;
+        return 0;
+    }
+    if (strcmp(name, "sse2") == 0 && has_sse2) {
+        classifier = classify_sse2;
+        text_counter = count_text_sse2;
+        newline_counter = count_newlines_sse2;
+        substring_finder = find_substring_sse2;
+        return 0;
+    }
+#endif
+    if (name == NULL || strcmp(name, "scalar") == 0) {
+        classifier = classify_scalar;
+        text_counter = count_text_scalar;
+        newline_counter = count_newlines_scalar;
+        substring_finder = find_substring_scalar;
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * @brief Counts newline bytes with the counter picked by select_classifier().
+ * 
+ * @return size_t The number of '\n' bytes in the len bytes at s.
+ */
+size_t count_lines(const char *s, size_t len) {
+    return newline_counter(s, len);
+}
+
+/**
+ * @brief Counts whitespace-separated words the way wc does.
+ * 
+ * @return size_t The number of words in the len bytes at s.
+ */
+size_t count_words(const char *s, size_t len) {
+    TextCounts counts = {0, 0, 0};
+    text_counter(s, len, &counts);
+    return counts.words;
+}
+
+/**
+ * @brief Returns the position of the first set bit at or after pos, or len if none.
+ */
+static size_t next_set_bit(const uint64_t *bits, size_t pos, size_t len) {
+    size_t word = pos >> 6;
+    uint64_t w = bits[word] & (~0ULL << (pos & 63));
+    while (w == 0) {
+        if (++word * 64 >= len) return len;
+        w = bits[word];
+    }
+    size_t found = word * 64 + __builtin_ctzll(w);
+    return found < len ? found : len;
+}
+
+/**
+ * @brief Returns the position of the first clear bit at or after pos, or len if none.
+ */
+static size_t next_clear_bit(const uint64_t *bits, size_t pos, size_t len) {
+    size_t word = pos >> 6;
+    uint64_t w = ~bits[word] & (~0ULL << (pos & 63));
+    while (w == 0) {
+        if (++word * 64 >= len) return len;
+        w = ~bits[word];
+    }
+    size_t found = word * 64 + __builtin_ctzll(w);
+    return found < len ? found : len;
+}
+
+/**
+ * @brief Splits a line into tokens, optionally substituting variables.
+ * 
+ * The line is classified into delimiter and '$' bitmaps a block at a time,
+ * then tokens are cut straight from the bitmaps. The token array and the
+ * token strings share one allocation, released with free_tokens(). Like
+ * strtok(), the line is modified: each token is terminated in place.
+ */
+static char **split_line(char *line, int substitute) {
+    // Typical lines fit the stack bitmaps; only very long lines allocate
+    size_t len = strlen(line);
+    size_t blocks = (len + 63) / 64;
+    uint64_t stack_bits[2 * (MAX_INPUT_SIZE / 64)];
+    uint64_t *delim = stack_bits;
+    if (blocks > MAX_INPUT_SIZE / 64) {
+        delim = malloc(2 * blocks * sizeof(uint64_t));
+        if (!delim) {
+            fprintf(stderr, "wsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    uint64_t *dollar = delim + blocks;
+
+    // Whole blocks are classified in place; the tail is padded with a non-delimiter
+    size_t full = len / 64;
+    classifier(line, full, delim, dollar);
+    if (len % 64) {
+        char tail[64];
+        memset(tail, 'x', sizeof(tail));
+        memcpy(tail, line + full * 64, len % 64);
+        classifier(tail, 1, delim + full, dollar + full);
+    }
+
+    // First pass: terminate tokens, substitute variables and size the result
+    int substituted_size = MAX_TOKENS, substituted_count = 0;
+    char *substituted_stack[MAX_TOKENS];
+    char **substituted = substituted_stack;
+    size_t count = 0, bytes = 0;
+    for (size_t pos = next_clear_bit(delim, 0, len); pos < len; ) {
+        size_t end = next_set_bit(delim, pos, len);
+        line[end] = '\0';
+
+        // Handle variable substitution
+        if (substitute && (dollar[pos >> 6] & (1ULL << (pos & 63)))) {
+            if (substituted_count == substituted_size) {
+                substituted_size *= 2;
+                char **grown = malloc(substituted_size * sizeof(char*));
+                if (!grown) {
+                    fprintf(stderr, "wsh: allocation error\n");
+                    exit(EXIT_FAILURE);
+                }
+                memcpy(grown, substituted, substituted_count * sizeof(char*));
+                if (substituted != substituted_stack) free(substituted);
+                substituted = grown;
             }
+            char *value = handle_variable_substitution(line + pos);
+            substituted[substituted_count++] = value;
+            bytes += (value ? strlen(value) : 0) + 1;
+        } else {
+            bytes += end - pos + 1;
         }
+        count++;
+
+        if (end >= len) break;
+        pos = next_clear_bit(delim, end + 1, len);
+    }
+
+    char **tokens = malloc((count + 1) * sizeof(char*) + bytes);
+    if (!tokens) {
+        fprintf(stderr, "wsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
 
-        token = strtok(NULL, DELIMITERS);
+    // Second pass: copy the tokens behind the pointer array
+    char *storage = (char *)(tokens + count + 1);
+    size_t position = 0;
+    substituted_count = 0;
+    for (size_t pos = next_clear_bit(delim, 0, len); position < count; ) {
+        size_t end = next_set_bit(delim, pos, len);
+        tokens[position++] = storage;
+        if (substitute && (dollar[pos >> 6] & (1ULL << (pos & 63)))) {
+            char *value = substituted[substituted_count++];
+            size_t value_len = value ? strlen(value) : 0;
+            memcpy(storage, value ? value : "", value_len + 1);
+            storage += value_len + 1;
+            free(value);
+        } else {
+            memcpy(storage, line + pos, end - pos + 1);
+            storage += end - pos + 1;
+        }
+        if (end < len) pos = next_clear_bit(delim, end + 1, len);
     }
     tokens[position] = NULL;
+
+    if (substituted != substituted_stack) {
+        free(substituted);
+    }
+    if (delim != stack_bits) {
+        free(delim);
+    }
     return tokens;
 }
 
 /**
- * @brief Parses redirection tokens and sets up file descriptors.
+ * @brief Returns the ')' that closes a $( whose text starts at s, or NULL.
+ */
+static char *substitution_end(char *s) {
+    int depth = 1;
+    for (; *s; s++) {
+        if (*s == '(') {
+            depth++;
+        } else if (*s == ')' && --depth == 0) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Tells whether a line runs exactly one external program.
  * 
- * @param args Array of arguments.
- * @param input Redirected input file (if any).
- * @param output Redirected output file (if any).
- * @param append Whether to append to the output file.
- * @param redirect_stderr Whether to redirect stderr.
- * @return int Status of parsing (0 on success, -1 on error).
+ * Such a line may exec the program in place of a child forked to run it;
+ * builtins, `source`, ratelimit and nested $(...) may start several.
  */
-int parse_redirection(char **args, char **input, char **output, int *append, int *redirect_stderr) {
-    *input = NULL;
-    *output = NULL;
-    *append = 0;
-    *redirect_stderr = 0;
+static int is_single_program(const char *command) {
+    char *copy = strdup(command);
+    if (!copy) {
+        fprintf(stderr, "wsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    char **words = tokenize_line(copy);
+    int program = words[0] && words[0][0] != '$' && !is_assignment(words[0]) && !is_builtin(words[0])
+        && strcmp(words[0], "ratelimit") != 0 && !strstr(command, "$(");
+    free_tokens(words);
+    free(copy);
+    return program;
+}
 
-    int i = 0;
-    while (args[i] != NULL) {
+/**
+ * @brief Classifies a substitution's command.
+ *
+ * @param program Set when it is one external program, which can replace
+ *                the child that runs it.
+ * @return int 1 if it may run alongside its siblings: one external
+ *         program, no nested $(...), and no output redirection through
+ *         which it could change what another substitution reads.
+ */
+static int substitution_is_concurrent(const char *command, int *program) {
+    *program = is_single_program(command);
+    if (!*program || !concurrent_substitution) {
+        return 0;
+    }
+    char *copy = strdup(command);
+    if (!copy) {
+        fprintf(stderr, "wsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    char **words = tokenize_line(copy);
+    int concurrent = 1;
+    for (int i = 1; concurrent && words[i]; i++) {
+        if (words[i][0] == '>' || strncmp(words[i], "&>", 2) == 0) concurrent = 0;
+    }
+    free_tokens(words);
+    free(copy);
+    return concurrent;
+}
+
+/**
+ * @brief Forks a child that runs a substitution with its stdout on a pipe.
+ */
+static void substitution_start(Substitution *sub, int program) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        perror("wsh");
+        return;
+    }
+    out_flush_all();
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        launcher.async = 0;
+        launcher.gating = 0;
+        forked_child = 1;
+        exec_in_place = program;
+        char **args = parse_line(sub->command);
+        execute_command(args);
+        out_flush_all();
+        _exit(last_status & 0xff);
+    }
+    close(fds[1]);
+    if (pid == -1) {
+        perror("wsh");
+        close(fds[0]);
+        return;
+    }
+    sub->pid = pid;
+    sub->fd = fds[0];
+}
+
+/**
+ * @brief Reads the running substitutions' output until each closes its pipe, then reaps them.
+ *
+ * All pipes are polled together, so a child that fills its pipe never
+ * waits on one that is slower.
+ */
+static void substitution_collect(Substitution *subs, size_t count) {
+    struct pollfd fds[count > 0 ? count : 1];
+    size_t owner[count > 0 ? count : 1];
+    for (;;) {
+        nfds_t n = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (subs[i].fd == -1) continue;
+            fds[n].fd = subs[i].fd;
+            fds[n].events = POLLIN;
+            owner[n++] = i;
+        }
+        if (n == 0) break;
+        if (poll(fds, n, -1) == -1) {
+            if (errno == EINTR) continue;
+            perror("wsh");
+            for (nfds_t j = 0; j < n; j++) {
+                close(subs[owner[j]].fd);
+                subs[owner[j]].fd = -1;
+            }
+            break;
+        }
+        for (nfds_t j = 0; j < n; j++) {
+            if (!fds[j].revents) continue;
+            Substitution *sub = &subs[owner[j]];
+            if (sub->capacity - sub->len < 4096) {
+                size_t capacity = sub->capacity ? sub->capacity * 2 : 4096;
+                char *grown = realloc(sub->output, capacity);
+                if (!grown) {
+                    fprintf(stderr, "wsh: allocation error\n");
+                    exit(EXIT_FAILURE);
+                }
+                sub->output = grown;
+                sub->capacity = capacity;
+            }
+            ssize_t r = read(sub->fd, sub->output + sub->len, sub->capacity - sub->len - 1);
+            if (r > 0) {
+                sub->len += r;
+            } else if (r == 0 || errno != EINTR) {
+                close(sub->fd);
+                sub->fd = -1;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (subs[i].pid <= 0) continue;
+        int status;
+        while (waitpid(subs[i].pid, &status, 0) == -1 && errno == EINTR) {}
+        last_status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+        subs[i].pid = 0;
+    }
+}
+
+/**
+ * @brief Appends a copy of n bytes of s to a growing word list.
+ */
+static void push_word(char ***words, size_t *count, size_t *capacity, const char *s, size_t n) {
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 16;
+        char **grown = realloc(*words, *capacity * sizeof(char*));
+        if (!grown) {
+            fprintf(stderr, "wsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        *words = grown;
+    }
+    char *word = strndup(s, n);
+    if (!word) {
+        fprintf(stderr, "wsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    (*words)[(*count)++] = word;
+}
+
+/**
+ * @brief Returns the end of the word at p: the next blank outside $(...).
+ * 
+ * An unterminated $( runs to the end of the line.
+ */
+static char *word_end(char *p) {
+    while (*p && !strchr(DELIMITERS, *p)) {
+        if (p[0] != '$' || p[1] != '(') {
+            p++;
+            continue;
+        }
+        char *end = substitution_end(p + 2);
+        if (!end) return p + strlen(p);
+        p = end + 1;
+    }
+    return p;
+}
+
+/**
+ * @brief Splits a line at blanks outside $(...), keeping each substitution as written.
+ * 
+ * An unterminated $( is reported when the words are substituted. The words
+ * share one allocation, as with split_line().
+ */
+static char **split_words(char *line) {
+    size_t count = 0, bytes = 0;
+    for (char *p = line; *p; ) {
+        p += strspn(p, DELIMITERS);
+        if (!*p) break;
+        char *start = p;
+        p = word_end(p);
+        count++;
+        bytes += p - start + 1;
+    }
+
+    char **tokens = malloc((count + 1) * sizeof(char*) + bytes);
+    if (!tokens) {
+        fprintf(stderr, "wsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    char *storage = (char *)(tokens + count + 1);
+    count = 0;
+    for (char *p = line; *p; ) {
+        p += strspn(p, DELIMITERS);
+        if (!*p) break;
+        char *start = p;
+        p = word_end(p);
+        memcpy(storage, start, p - start);
+        storage[p - start] = '\0';
+        tokens[count++] = storage;
+        storage += p - start + 1;
+    }
+    tokens[count] = NULL;
+    return tokens;
+}
+
+/**
+ * @brief Substitutes the $(...) and $NAME in words from split_words().
+ *
+ * Each substitution
+ * runs in a child; siblings that each run one external program start
+ * together, while any other substitution first waits for those before
+ * it and runs alone, so the line sees the effects in order. Outputs lose
+ * their trailing newlines and are used in order: a word that is only a
+ * $(...) is split at blanks into words (none if empty), one with other
+ * text around it stays one word. $(<FILE) reads the file in-process.
+ *
+ * @param raw The words as written; left untouched.
+ * @return char** A new token array, released with free_tokens().
+ */
+static char **substitute_commands(char **raw) {
+    // First pass: copy out the substitutions
+    size_t raw_count = 0;
+    Substitution *subs = NULL;
+    size_t sub_count = 0, sub_capacity = 0;
+    int unterminated = 0;
+    for (; raw[raw_count] && !unterminated; raw_count++) {
+        for (char *p = raw[raw_count]; (p = strstr(p, "$(")) != NULL; ) {
+            char *end = substitution_end(p + 2);
+            if (!end) {
+                unterminated = 1;
+                break;
+            }
+            if (sub_count == sub_capacity) {
+                sub_capacity = sub_capacity ? sub_capacity * 2 : 4;
+                Substitution *grown = realloc(subs, sub_capacity * sizeof(Substitution));
+                if (!grown) {
+                    fprintf(stderr, "wsh: allocation error\n");
+                    exit(EXIT_FAILURE);
+                }
+                subs = grown;
+            }
+            Substitution *sub = &subs[sub_count++];
+            memset(sub, 0, sizeof(*sub));
+            sub->fd = -1;
+            sub->command = strndup(p + 2, end - (p + 2));
+            if (!sub->command) {
+                fprintf(stderr, "wsh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+            p = end + 1;
+        }
+    }
+    if (unterminated) {
+        out_printf(wsh_err, "wsh: unterminated $(\n");
+        raw_count = 0;
+        for (size_t i = 0; i < sub_count; i++) free(subs[i].command);
+        sub_count = 0;
+    }
+
+    // Run them: concurrent ones are started, anything else waits for those first
+    for (size_t i = 0; i < sub_count; i++) {
+        Substitution *sub = &subs[i];
+        if (sub->command[0] == '<') {
+            sub->output = read_file_value(sub->command + 1);
+            sub->len = sub->output ? strlen(sub->output) : 0;
+            continue;
+        }
+        int program;
+        if (substitution_is_concurrent(sub->command, &program)) {
+            substitution_start(sub, program);
+        } else {
+            substitution_collect(subs, i);
+            substitution_start(sub, program);
+            substitution_collect(sub, 1);
+        }
+    }
+    substitution_collect(subs, sub_count);
+
+    // Second pass: build the words from the outputs in order
+    char **words = NULL;
+    size_t count = 0, capacity = 0, next = 0;
+    for (size_t i = 0; i < raw_count; i++) {
+        char *word = raw[i];
+        if (!strstr(word, "$(")) {
+            if (word[0] == '$') {
+                char *value = handle_variable_substitution(word);
+                push_word(&words, &count, &capacity, value, strlen(value));
+                free(value);
+            } else {
+                push_word(&words, &count, &capacity, word, strlen(word));
+            }
+            continue;
+        }
+
+        // Join literal text and outputs, noting whether the word was a lone $(...)
+        char *joined = NULL;
+        size_t joined_len = 0;
+        FILE *out = open_memstream(&joined, &joined_len);
+        if (!out) {
+            fprintf(stderr, "wsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        int lone = 0;
+        for (char *q = word; *q; ) {
+            if (q[0] != '$' || q[1] != '(') {
+                fputc(*q++, out);
+                continue;
+            }
+            char *end = substitution_end(q + 2);
+            Substitution *sub = &subs[next++];
+            size_t len = sub->len;
+            if (sub->command[0] != '<') {
+                while (len > 0 && sub->output[len - 1] == '\n') len--;
+            }
+            fwrite(sub->output ? sub->output : "", 1, len, out);
+            lone = q == word && end[1] == '\0' && sub->command[0] != '<';
+            q = end + 1;
+        }
+        fclose(out);
+
+        if (lone) {
+            for (char *w = joined; *w; ) {
+                size_t blank = strspn(w, DELIMITERS);
+                w += blank;
+                size_t span = strcspn(w, DELIMITERS);
+                if (span > 0) push_word(&words, &count, &capacity, w, span);
+                w += span;
+            }
+        } else {
+            push_word(&words, &count, &capacity, joined, strlen(joined));
+        }
+        free(joined);
+    }
+
+    // One block like split_line(): pointers first, the words behind them
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; i++) bytes += strlen(words[i]) + 1;
+    char **tokens = malloc((count + 1) * sizeof(char*) + bytes);
+    if (!tokens) {
+        fprintf(stderr, "wsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    char *storage = (char *)(tokens + count + 1);
+    for (size_t i = 0; i < count; i++) {
+        size_t len = strlen(words[i]) + 1;
+        memcpy(storage, words[i], len);
+        tokens[i] = storage;
+        storage += len;
+        free(words[i]);
+    }
+    tokens[count] = NULL;
+
+    for (size_t i = 0; i < sub_count; i++) {
+        free(subs[i].command);
+        free(subs[i].output);
+    }
+    free(subs);
+    free(words);
+    return tokens;
+}
+
+/**
+ * @brief Parses the input line into tokens, handling variable and command substitution.
+ * 
+ * @param line The input line.
+ * @return char** Array of tokens.
+ */
+char **parse_line(char *line) {
+    // Braces and $(...) are handled on the words as written
+    if (strchr(line, '{') || strstr(line, "$(")) {
+        char **raw = tokenize_line(line);
+        char **tokens = expand_tokens(raw);
+        free_tokens(raw);
+        return tokens;
+    }
+    return split_line(line, 1);
+}
+
+/**
+ * @brief Splits the input line into tokens without substituting variables.
+ * 
+ * A $(...) stays in one token as written, blanks included.
+ * 
+ * @param line The input line.
+ * @return char** Array of raw tokens, for expand_tokens().
+ */
+char **tokenize_line(char *line) {
+    if (strstr(line, "$(")) {
+        return split_words(line);
+    }
+    return split_line(line, 0);
+}
+
+/**
+ * @brief Expands braces, then substitutes variables and $(...), in raw tokens from tokenize_line().
+ * 
+ * The raw tokens are left untouched so they can be expanded again. A brace
+ * expansion that is too large leaves an empty command and sets $? to 1.
+ * 
+ * @param raw Array of raw tokens.
+ * @return char** A new token array, released with free_tokens().
+ */
+char **expand_tokens(char **raw) {
+    // Braces first, so that no substituted value is expanded
+    char **braced = NULL;
+    if (expand_braces(raw, &braced) == -1) {
+        out_flush_all();
+        last_status = 1;
+        braced = calloc(1, sizeof(char *));
+        if (!braced) {
+            fprintf(stderr, "wsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        return braced;
+    }
+    char **tokens = substitute_tokens(braced ? braced : raw);
+    free_tokens(braced);
+    return tokens;
+}
+
+/**
+ * @brief Substitutes variables and $(...) in words that had their braces expanded.
+ */
+static char **substitute_tokens(char **raw) {
+    size_t count = 0, bytes = 0, substituted_count = 0;
+    int commands = 0;
+    for (; raw[count]; count++) {
+        bytes += strlen(raw[count]) + 1;
+        if (raw[count][0] == '$') substituted_count++;
+        if (strchr(raw[count], '$') && strstr(raw[count], "$(")) commands = 1;
+    }
+
+    // tokenize_line() kept each $(...) whole, as written
+    if (commands) {
+        return substitute_commands(raw);
+    }
+    bytes = 0;
+
+    char *substituted_stack[MAX_TOKENS];
+    char **substituted = substituted_stack;
+    if (substituted_count > MAX_TOKENS) {
+        substituted = malloc(substituted_count * sizeof(char*));
+        if (!substituted) {
+            fprintf(stderr, "wsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    substituted_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (raw[i][0] == '$') {
+            char *value = handle_variable_substitution(raw[i]);
+            substituted[substituted_count++] = value;
+            bytes += (value ? strlen(value) : 0) + 1;
+        } else {
+            bytes += strlen(raw[i]) + 1;
+        }
+    }
+
+    char **tokens = malloc((count + 1) * sizeof(char*) + bytes);
+    if (!tokens) {
+        fprintf(stderr, "wsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    char *storage = (char *)(tokens + count + 1);
+    substituted_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        const char *value = raw[i];
+        char *owned = NULL;
+        if (raw[i][0] == '$') {
+            owned = substituted[substituted_count++];
+            value = owned ? owned : "";
+        }
+        size_t len = strlen(value) + 1;
+        memcpy(storage, value, len);
+        tokens[i] = storage;
+        storage += len;
+        free(owned);
+    }
+    tokens[count] = NULL;
+
+    if (substituted != substituted_stack) {
+        free(substituted);
+    }
+    return tokens;
+}
+
+/**
+ * @brief Frees a token array returned by parse_line().
+ * 
+ * @param tokens The token array.
+ */
+void free_tokens(char **tokens) {
+    free(tokens);
+}
+
+/**
+ * @brief Adds two sizes, saturating at SIZE_MAX.
+ */
+static size_t saturating_add(size_t a, size_t b) {
+    size_t sum;
+    return __builtin_add_overflow(a, b, &sum) ? SIZE_MAX : sum;
+}
+
+/**
+ * @brief Multiplies two sizes, saturating at SIZE_MAX.
+ */
+static size_t saturating_mul(size_t a, size_t b) {
+    size_t product;
+    return __builtin_mul_overflow(a, b, &product) ? SIZE_MAX : product;
+}
+
+/**
+ * @brief Appends a part to a brace word.
+ */
+static void brace_add_part(BraceWord *word, BracePart part) {
+    // Grow at powers of two
+    if ((word->count & (word->count - 1)) == 0) {
+        BracePart *grown = realloc(word->parts, (word->count ? word->count * 2 : 1) * sizeof(BracePart));
+        if (!grown) {
+            fprintf(stderr, "wsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        word->parts = grown;
+    }
+    word->parts[word->count++] = part;
+}
+
+/**
+ * @brief Frees the parts of a brace word; the text stays in the argument.
+ */
+static void brace_free(BraceWord *word) {
+    for (size_t i = 0; i < word->count; i++) {
+        if (word->parts[i].kind == BRACE_LIST) {
+            for (size_t j = 0; j < word->parts[i].count; j++) {
+                brace_free(&word->parts[i].alternatives[j]);
+            }
+            free(word->parts[i].alternatives);
+        }
+    }
+    free(word->parts);
+}
+
+/**
+ * @brief Parses one integer of a range; padded is set for a leading zero, as in 01.
+ * 
+ * @return int 0 on success, -1 if the text is not an integer in range.
+ */
+static int parse_brace_number(const char *s, size_t len, intmax_t *value, int *padded) {
+    char digits[32];
+    size_t sign = len > 0 && s[0] == '-';
+    if (len == sign || len >= sizeof(digits)) return -1;
+    for (size_t i = sign; i < len; i++) {
+        if (s[i] < '0' || s[i] > '9') return -1;
+    }
+    memcpy(digits, s, len);
+    digits[len] = '\0';
+    errno = 0;
+    *value = strtoimax(digits, NULL, 10);
+    if (errno == ERANGE) return -1;
+    if (padded) *padded = len - sign > 1 && s[sign] == '0';
+    return 0;
+}
+
+/**
+ * @brief Parses the inside of {x..y} or {x..y..step} into a range part.
+ * 
+ * @return int 0 on success, -1 if it is not a range (the braces stay literal).
+ */
+static int parse_brace_range(const char *s, size_t len, BracePart *part) {
+    const char *dots = memmem(s, len, "..", 2);
+    if (!dots) return -1;
+    const char *second = dots + 2;
+    const char *more = memmem(second, s + len - second, "..", 2);
+    const char *second_end = more ? more : s + len;
+    size_t first_len = dots - s, second_len = second_end - second;
+
+    intmax_t start, end, step = 1;
+    int letters = 0, width = 0;
+    if (first_len == 1 && second_len == 1 && isalpha((unsigned char)s[0]) &&
+        isalpha((unsigned char)second[0])) {
+        start = (unsigned char)s[0];
+        end = (unsigned char)second[0];
+        letters = 1;
+    } else {
+        int padded_start, padded_end;
+        if (parse_brace_number(s, first_len, &start, &padded_start) == -1 ||
+            parse_brace_number(second, second_len, &end, &padded_end) == -1) {
+            return -1;
+        }
+        if (padded_start || padded_end) {
+            width = first_len > second_len ? first_len : second_len;
+        }
+    }
+    if (more && parse_brace_number(more + 2, s + len - (more + 2), &step, NULL) == -1) {
+        return -1;
+    }
+
+    // Only the step's size matters; a zero step counts as one, as in bash
+    uintmax_t stride = step < 0 ? -(uintmax_t)step : (uintmax_t)step;
+    if (stride == 0) stride = 1;
+    uintmax_t span = start <= end ? (uintmax_t)end - (uintmax_t)start : (uintmax_t)start - (uintmax_t)end;
+
+    // Count the steps before adding the first value: over the whole intmax
+    // range the sum wraps to zero, which would expand to no words at all
+    uintmax_t steps = span / stride;
+
+    memset(part, 0, sizeof(*part));
+    part->kind = BRACE_RANGE;
+    part->start = start;
+    part->step = start <= end ? (intmax_t)stride : -(intmax_t)stride;
+    part->values = steps >= SIZE_MAX ? SIZE_MAX : (size_t)steps + 1;
+    part->width = width;
+    part->letters = letters;
+    return 0;
+}
+
+/**
+ * @brief Parses an argument into text, list and range parts.
+ * 
+ * As in bash, a brace group without a top-level comma or a valid range
+ * is literal text, and so is "${".
+ */
+static void parse_brace_word(const char *s, size_t len, BraceWord *word) {
+    size_t text_start = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] != '{' || (i > 0 && s[i - 1] == '$')) continue;
+
+        // Find the matching brace and count the commas at this level
+        size_t close = len, commas = 0;
+        int depth = 0;
+        for (size_t j = i + 1; j < len && close == len; j++) {
+            if (s[j] == '{') {
+                depth++;
+            } else if (s[j] == '}') {
+                if (depth == 0) close = j;
+                depth--;
+            } else if (s[j] == ',' && depth == 0) {
+                commas++;
+            }
+        }
+        if (close == len) continue;
+
+        BracePart part;
+        if (commas > 0) {
+            memset(&part, 0, sizeof(part));
+            part.kind = BRACE_LIST;
+            part.alternatives = calloc(commas + 1, sizeof(BraceWord));
+            if (!part.alternatives) {
+                fprintf(stderr, "wsh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+            size_t from = i + 1;
+            depth = 0;
+            for (size_t j = i + 1; j <= close; j++) {
+                if (s[j] == '{') {
+                    depth++;
+                } else if (s[j] == '}' && depth > 0) {
+                    depth--;
+                } else if ((s[j] == ',' && depth == 0) || j == close) {
+                    parse_brace_word(s + from, j - from, &part.alternatives[part.count++]);
+                    from = j + 1;
+                }
+            }
+        } else if (parse_brace_range(s + i + 1, close - i - 1, &part) == -1) {
+            continue;
+        }
+
+        if (i > text_start) {
+            BracePart text = {.kind = BRACE_TEXT, .text = s + text_start, .len = i - text_start};
+            brace_add_part(word, text);
+        }
+        brace_add_part(word, part);
+        text_start = close + 1;
+        i = close;
+    }
+    if (len > text_start || word->count == 0) {
+        BracePart text = {.kind = BRACE_TEXT, .text = s + text_start, .len = len - text_start};
+        brace_add_part(word, text);
+    }
+}
+
+/**
+ * @brief Formats value k of a range part into buf (up to 32 bytes), like "%0*jd".
+ * 
+ * @return size_t The formatted length.
+ */
+static size_t brace_range_value(const BracePart *part, size_t k, char *buf) {
+    // Unsigned, so the product cannot overflow on the way back into range
+    intmax_t value = (intmax_t)((uintmax_t)part->start + (uintmax_t)k * (uintmax_t)part->step);
+    if (part->letters) {
+        buf[0] = (char)value;
+        return 1;
+    }
+    char digits[32];
+    int n = 0;
+    uintmax_t magnitude = value < 0 ? -(uintmax_t)value : (uintmax_t)value;
+    do {
+        digits[n++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude);
+    size_t len = 0;
+    if (value < 0) buf[len++] = '-';
+    for (int pad = n + (value < 0); pad < part->width; pad++) buf[len++] = '0';
+    while (n) buf[len++] = digits[--n];
+    return len;
+}
+
+/**
+ * @brief Tells whether a parsed word has anything to expand.
+ */
+static int brace_word_expands(const BraceWord *word) {
+    return word->count > 1 || (word->count == 1 && word->parts[0].kind != BRACE_TEXT);
+}
+
+/**
+ * @brief Sizes a brace word's expansion without generating it.
+ * 
+ * @param words Set to the number of words, saturating at SIZE_MAX.
+ * @param bytes Set to their total length without NULs, or NULL when only the
+ *              longest word matters. Saturates when a range exceeds BRACE_MAX_WORDS.
+ * @param longest Set to the length of the longest word.
+ */
+static void brace_size(const BraceWord *word, size_t *words, size_t *bytes, size_t *longest) {
+    size_t total = 0;
+    *words = 1;
+    *longest = 0;
+    for (size_t i = 0; i < word->count; i++) {
+        const BracePart *part = &word->parts[i];
+        size_t part_words = 1, part_bytes = 0, part_longest = 0;
+        if (part->kind == BRACE_TEXT) {
+            part_bytes = part_longest = part->len;
+        } else if (part->kind == BRACE_LIST) {
+            part_words = 0;
+            for (size_t j = 0; j < part->count; j++) {
+                size_t w, b = 0, l;
+                brace_size(&part->alternatives[j], &w, bytes ? &b : NULL, &l);
+                part_words = saturating_add(part_words, w);
+                part_bytes = saturating_add(part_bytes, b);
+                if (l > part_longest) part_longest = l;
+            }
+        } else {
+            // The extremes are the longest values; the sum is only needed for argv
+            char buf[32];
+            part_words = part->values;
+            size_t first = brace_range_value(part, 0, buf);
+            size_t last = brace_range_value(part, part->values - 1, buf);
+            part_longest = first > last ? first : last;
+            if (!bytes) {
+                // Streaming: the sum is not needed
+            } else if (part->values <= BRACE_MAX_WORDS) {
+                for (size_t k = 0; k < part->values; k++) {
+                    part_bytes += brace_range_value(part, k, buf);
+                }
+            } else {
+                part_bytes = SIZE_MAX;
+            }
+        }
+        // Every word of the product pairs each word so far with each of this part
+        total = saturating_add(saturating_mul(total, part_words), saturating_mul(part_bytes, *words));
+        *words = saturating_mul(*words, part_words);
+        *longest = saturating_add(*longest, part_longest);
+    }
+    if (bytes) *bytes = total;
+}
+
+/**
+ * @brief Hands one expanded word to a sink.
+ */
+static void brace_sink(BraceSink *sink, const char *word, size_t len) {
+    if (!sink->tokens) {
+        out_write(wsh_out, word, len);
+        out_write(wsh_out, "\n", 1);
+        return;
+    }
+    sink->tokens[sink->position++] = sink->storage;
+    memcpy(sink->storage, word, len);
+    sink->storage[len] = '\0';
+    sink->storage += len + 1;
+}
+
+/**
+ * @brief Generates the words of a brace word from one part onwards, in order.
+ * 
+ * buf holds the prefix built so far; ranges are formatted one value at a
+ * time, so nothing bigger than the longest word is ever held.
+ */
+static void brace_emit(const BraceWord *word, size_t part, const BraceRest *rest,
+                       char *buf, size_t len, BraceSink *sink) {
+    // Past the end of an alternative: carry on with the parts after its list
+    while (part == word->count) {
+        if (!rest) {
+            brace_sink(sink, buf, len);
+            return;
+        }
+        word = rest->word;
+        part = rest->part;
+        rest = rest->next;
+    }
+    const BracePart *p = &word->parts[part];
+    if (p->kind == BRACE_TEXT) {
+        memcpy(buf + len, p->text, p->len);
+        brace_emit(word, part + 1, rest, buf, len + p->len, sink);
+    } else if (p->kind == BRACE_LIST) {
+        BraceRest next = {word, part + 1, rest};
+        for (size_t i = 0; i < p->count; i++) {
+            brace_emit(&p->alternatives[i], 0, &next, buf, len, sink);
+        }
+    } else {
+        for (size_t k = 0; k < p->values; k++) {
+            size_t n = brace_range_value(p, k, buf + len);
+            brace_emit(word, part + 1, rest, buf, len + n, sink);
+        }
+    }
+}
+
+/**
+ * @brief Tells whether an argv would be refused by execve() with E2BIG.
+ */
+static int exceeds_arg_max(size_t words, size_t bytes) {
+    long limit = sysconf(_SC_ARG_MAX);
+    if (limit <= 0) return 0;
+    size_t size = saturating_add(bytes, saturating_mul(words + 1, sizeof(char *)));
+    for (char **env = environ; *env; env++) {
+        size = saturating_add(size, strlen(*env) + 1 + sizeof(char *));
+    }
+    return size > (size_t)limit;
+}
+
+/**
+ * @brief Tells whether a command name is a builtin.
+ */
+static int is_builtin(const char *name) {
+    for (int i = 0; i < num_builtins(); i++) {
+        if (strcmp(name, builtin_str[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Expands brace expressions in the words of a line as written.
+ * 
+ * Runs before variable and command substitution, so substituted values
+ * are never expanded. NAME=value prefixes, the arguments of local and
+ * export, words with a $(...) (expanded when it runs) and the words of
+ * `braces` (which streams its own) are kept literal, as in bash.
+ * 
+ * @param args The raw words of the line.
+ * @param expanded Set to a new token array, or NULL when nothing expands.
+ * @return int 0 on success, -1 if the expansion is too large (already reported).
+ */
+int expand_braces(char **args, char ***expanded) {
+    *expanded = NULL;
+    size_t count = 0, command = 0;
+    while (args[command] && is_assignment(args[command])) command++;
+    int literal_args = args[command] && (strcmp(args[command], "braces") == 0
+        || strcmp(args[command], "local") == 0 || strcmp(args[command], "export") == 0);
+    int candidates = 0;
+    for (; args[count]; count++) {
+        if (count < command || (literal_args && count > command) || strstr(args[count], "$(")) continue;
+        if (strchr(args[count], '{')) candidates = 1;
+    }
+    if (!candidates) return 0;
+
+    // Parse and size every word before generating any of them
+    BraceWord *words = calloc(count, sizeof(BraceWord));
+    if (!words) {
+        fprintf(stderr, "wsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t total_words = 0, total_bytes = 0, longest = 0;
+    int braced = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t w = 1, b = strlen(args[i]), l = b;
+        if (i < command || (literal_args && i > command) || strstr(args[i], "$(")) {
+            // Kept as written
+        } else if (strchr(args[i], '{')) {
+            parse_brace_word(args[i], b, &words[i]);
+            if (brace_word_expands(&words[i])) {
+                braced = 1;
+                brace_size(&words[i], &w, &b, &l);
+            }
+        }
+        total_words = saturating_add(total_words, w);
+        total_bytes = saturating_add(total_bytes, saturating_add(b, w));
+        if (l > longest) longest = l;
+    }
+
+    int status = 0;
+    if (!braced) {
+        // Only literal braces
+    } else if (total_words > BRACE_MAX_WORDS || total_bytes == SIZE_MAX) {
+        out_printf(wsh_err, "wsh: %s: brace expansion too large\n", args[0]);
+        status = -1;
+    } else if (args[command] && !is_builtin(args[command]) && exceeds_arg_max(total_words, total_bytes)) {
+        out_printf(wsh_err, "wsh: %s: Argument list too long\n", args[0]);
+        status = -1;
+    } else {
+        // One block like split_line(): pointers first, the words behind them
+        char **tokens = malloc((total_words + 1) * sizeof(char *) + total_bytes);
+        char *buf = malloc(longest + 1);
+        if (!tokens || !buf) {
+            fprintf(stderr, "wsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        BraceSink sink = {tokens, (char *)(tokens + total_words + 1), 0};
+        for (size_t i = 0; i < count; i++) {
+            if (brace_word_expands(&words[i])) {
+                brace_emit(&words[i], 0, NULL, buf, 0, &sink);
+            } else {
+                brace_sink(&sink, args[i], strlen(args[i]));
+            }
+        }
+        tokens[total_words] = NULL;
+        free(buf);
+        *expanded = tokens;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        brace_free(&words[i]);
+    }
+    free(words);
+    return status;
+}
+
+/**
+ * @brief Parses redirection tokens and sets up file descriptors.
+ * 
+ * @param args Array of arguments.
+ * @param input Redirected input file (if any).
+ * @param output Redirected output file (if any).
+ * @param append Whether to append to the output file.
+ * @param redirect_stderr Whether to redirect stderr.
+ * @return int Status of parsing (0 on success, -1 on error).
+ */
+int parse_redirection(char **args, char **input, char **output, int *append, int *redirect_stderr) {
+    *input = NULL;
+    *output = NULL;
+    *append = 0;
+    *redirect_stderr = 0;
+
+    int i = 0;
+    while (args[i] != NULL) {
         if (strncmp(args[i], ">>", 2) == 0) {
             *append = 1;
             *output = args[i] + 2;
             args[i] = NULL;
             break;
-        } else if (strncmp(args[i], ">", 1) == 0) {
-            *output = args[i] + 1;
-            args[i] = NULL;
+        } else if (strncmp(args[i], ">", 1) == 0) {
+            *output = args[i] + 1;
+            args[i] = NULL;
+            break;
+        } else if (strncmp(args[i], "<", 1) == 0) {
+            *input = args[i] + 1;
+            args[i] = NULL;
+            break;
+        } else if (strncmp(args[i], "&>>", 3) == 0) {
+            *output = args[i] + 3;
+            *append = 1;
+            *redirect_stderr = 1;
+            args[i] = NULL;
+            break;
+        } else if (strncmp(args[i], "&>", 2) == 0) {
+            *output = args[i] + 2;
+            *redirect_stderr = 1;
+            args[i] = NULL;
+            break;
+        }
+        i++;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Applies redirections by modifying file descriptors.
+ * 
+ * @param input Redirected input file (if any).
+ * @param output Redirected output file (if any).
+ * @param append Whether to append to the output file.
+ * @param redirect_stderr Whether to redirect stderr.
+ * @return int Status of applying redirections (0 on success, -1 on error).
+ */
+int apply_redirection(char *input, char *output, int append, int redirect_stderr) {
+    // Callers that need the original descriptors back save them first (see
+    // run_builtin), so nothing here is left open on an error return
+    // Handle input redirection
+    if (input) {
+        int fd = open(input, O_RDONLY);
+        if (fd == -1) {
+            perror("wsh: input redirection failed");
+            return -1;
+        }
+        if (dup2(fd, STDIN_FILENO) == -1) {
+            perror("wsh: dup2 for stdin failed");
+            close(fd);
+            return -1;
+        }
+        close(fd);
+    }
+
+    // Handle output redirection
+    if (output) {
+        int flags = O_WRONLY | O_CREAT;
+        if (append) {
+            flags |= O_APPEND; // Append to the file
+        } else {
+            flags |= O_TRUNC; // Truncate the file
+        }
+        int fd = open(output, flags, 0644);
+        if (fd == -1) {
+            perror("wsh: output redirection failed");
+            return -1;
+        }
+        if (dup2(fd, STDOUT_FILENO) == -1) {
+            perror("wsh: dup2 for stdout failed");
+            close(fd);
+            return -1;
+        }
+        close(fd);
+    }
+
+    // Handle stderr redirection
+    if (redirect_stderr) {
+        if (output) {
+            // Redirect stderr to stdout if output redirection is active
+            if (dup2(STDOUT_FILENO, STDERR_FILENO) == -1) {
+                perror("wsh: dup2 for stderr failed");
+                return -1;
+            }
+        } else {
+            // If no output file is specified, redirect stderr to /dev/null
+            int fd = open("/dev/null", O_WRONLY);
+            if (fd == -1) {
+                perror("wsh: opening /dev/null failed");
+                return -1;
+            }
+            if (dup2(fd, STDERR_FILENO) == -1) {
+                perror("wsh: dup2 for stderr failed");
+                close(fd);
+                return -1;
+            }
+            close(fd);
+        }
+    }
+
+    return 0;
+}
+/**
+ * @brief Resets file descriptors to their original state.
+ * 
+ * @param stdin_fd Original stdin file descriptor.
+ * @param stdout_fd Original stdout file descriptor.
+ * @param stderr_fd Original stderr file descriptor.
+ */
+void reset_redirection(int stdin_fd, int stdout_fd, int stderr_fd) {
+    dup2(stdin_fd, STDIN_FILENO);
+    dup2(stdout_fd, STDOUT_FILENO);
+    dup2(stderr_fd, STDERR_FILENO);
+    close(stdin_fd);
+    close(stdout_fd);
+    close(stderr_fd);
+}
+
+/**
+ * @brief Runs a builtin with its redirections applied, then flushes its output.
+ * 
+ * @param func The builtin to run.
+ * @param args Array of arguments; redirection tokens are removed.
+ * @return int Status returned by the builtin.
+ */
+static int run_builtin(int (*func)(char **), char **args) {
+    char *input = NULL;
+    char *output = NULL;
+    int append = 0;
+    int redirect_stderr = 0;
+    parse_redirection(args, &input, &output, &append, &redirect_stderr);
+
+    // Builtins change shell state, so background commands before them must finish
+    launcher_wait_all();
+
+    size_t errors = builtin_errors;
+    if (!input && !output && !redirect_stderr) {
+        int status = func(args);
+        out_flush_all();
+        last_status = builtin_errors != errors;
+        return status;
+    }
+
+    // Redirect the shell's own descriptors for the builtin and anything it runs
+    int stdin_fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+    int stdout_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+    int stderr_fd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+    if (stdin_fd == -1 || stdout_fd == -1 || stderr_fd == -1) {
+        perror("wsh");
+        if (stdin_fd != -1) close(stdin_fd);
+        if (stdout_fd != -1) close(stdout_fd);
+        if (stderr_fd != -1) close(stderr_fd);
+        return 1;
+    }
+
+    int status = 1;
+    last_status = 1;
+    if (apply_redirection(input, output, append, redirect_stderr) == 0) {
+        status = func(args);
+        last_status = builtin_errors != errors;
+    }
+    out_flush_all();
+    reset_redirection(stdin_fd, stdout_fd, stderr_fd);
+    return status;
+}
+
+/**
+ * @brief Tells whether a word is a NAME=value assignment.
+ */
+static int is_assignment(const char *word) {
+    if (!isalpha((unsigned char)*word) && *word != '_') return 0;
+    for (word++; *word != '='; word++) {
+        if (!isalnum((unsigned char)*word) && *word != '_') return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Sets shell variables from NAME=value words.
+ */
+static void assign_shell_variables(char **words, int count) {
+    for (int i = 0; i < count; i++) {
+        char *equal_sign = strchr(words[i], '=');
+        *equal_sign = '\0';
+        char *value = strdup(equal_sign + 1);
+        if (!value || set_shell_variable(words[i], value) == -1) {
+            fprintf(stderr, "wsh: allocation error for shell variable\n");
+        }
+        *equal_sign = '=';
+    }
+}
+
+/**
+ * @brief Runs a builtin with NAME=value prefixes in the environment, then restores it.
+ * 
+ * Builtins read the shell's own environment, so unlike a child's overlay
+ * the prefixes are set for the duration of the call.
+ */
+static int run_builtin_with_env(int (*func)(char **), char **args, char **assignments, int count) {
+    char **saved = calloc(count, sizeof(char *));
+    if (!saved) {
+        fprintf(stderr, "wsh: allocation error\n");
+        return 1;
+    }
+    for (int i = 0; i < count; i++) {
+        char *equal_sign = strchr(assignments[i], '=');
+        *equal_sign = '\0';
+        const char *old = getenv(assignments[i]);
+        saved[i] = old ? strdup(old) : NULL;
+        set_environment(assignments[i], equal_sign + 1);
+        *equal_sign = '=';
+    }
+    int status = run_builtin(func, args);
+
+    // Restore in reverse, so a name given twice gets its original value back
+    for (int i = count - 1; i >= 0; i--) {
+        char *equal_sign = strchr(assignments[i], '=');
+        *equal_sign = '\0';
+        if (saved[i]) {
+            set_environment(assignments[i], saved[i]);
+        } else {
+            unset_environment(assignments[i]);
+        }
+        *equal_sign = '=';
+        free(saved[i]);
+    }
+    free(saved);
+    return status;
+}
+
+/**
+ * @brief Runs a builtin or launches a program for the parsed command.
+ */
+static int dispatch_command(char **args) {
+
+    // Check if the command is a history execution
+    if (strcmp(args[0], "history") == 0 && args[1] != NULL) {
+        int num = atoi(args[1]);
+        if (num > 0) {
+            return execute_history_command(num);
+        }
+    }
+
+    return dispatch_assignments(args, 0);
+}
+
+/**
+ * @brief Applies leading NAME=value words and runs the command after them.
+ * 
+ * @param args The command, after any NAME=value words.
+ * @param done How many of those words were substituted already, by an
+ *             outer call that ratelimit returned through.
+ * @return int Status of execution.
+ */
+static int dispatch_assignments(char **args, int done) {
+    // Leading NAME=value words apply to this command only; alone they set shell variables
+    int assignments = done;
+    while (args[assignments] && is_assignment(args[assignments])) {
+        assignments++;
+    }
+    if (assignments == 0) {
+        return run_command(args, 0);
+    }
+
+    // A $NAME value is substituted, as local does
+    char **owned = NULL;
+    for (int i = done; i < assignments; i++) {
+        char *equal_sign = strchr(args[i], '=');
+        if (equal_sign[1] != '$') continue;
+        if (!owned) {
+            owned = calloc(assignments, sizeof(char *));
+        }
+        char *value = handle_variable_substitution(equal_sign + 1);
+        int name_len = equal_sign - args[i];
+        char *word = owned ? malloc(name_len + 1 + (value ? strlen(value) : 0) + 1) : NULL;
+        if (!word) {
+            fprintf(stderr, "wsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        sprintf(word, "%.*s=%s", name_len, args[i], value ? value : "");
+        free(value);
+        owned[i] = args[i] = word;
+    }
+
+    int status = 1;
+    if (!args[assignments]) {
+        assign_shell_variables(args, assignments);
+        last_status = 0;
+    } else {
+        status = run_command(args, assignments);
+    }
+    for (int i = 0; owned && i < assignments; i++) {
+        free(owned[i]);
+    }
+    free(owned);
+    return status;
+}
+
+/**
+ * @brief Runs a builtin or launches a program, with NAME=value words before it.
+ */
+static int run_command(char **args, int assignments) {
+    char **command = args + assignments;
+
+    // ratelimit passes the prefixes on to the command it runs
+    if (strcmp(command[0], "ratelimit") == 0) {
+        return rate_limit_command(args, assignments);
+    }
+
+    // Check for built-in commands
+    for (int i = 0; i < num_builtins(); i++) {
+        if (strcmp(command[0], builtin_str[i]) == 0) {
+            if (assignments == 0) {
+                return run_builtin(builtin_func[i], command);
+            }
+            return run_builtin_with_env(builtin_func[i], command, args, assignments);
+        }
+    }
+
+    // Not a built-in command; launch external program
+    // Add to history
+    // Reconstruct the command string
+    int len = 1; // an empty line still needs its terminator
+    for (int i = 0; args[i] != NULL; i++) {
+        len += strlen(args[i]) + 1; // +1 for the space after it
+    }
+    char *command_str = malloc(len);
+    if (!command_str) {
+        fprintf(stderr, "wsh: allocation error when adding to history\n");
+        return 1;
+    }
+    command_str[0] = '\0';
+    for (int i = 0; args[i] != NULL; i++) {
+        strcat(command_str, args[i]);
+        if (args[i+1] != NULL) {
+            strcat(command_str, " ");
+        }
+    }
+    add_history(command_str);
+    free(command_str);
+
+    return launch_process(command, args, assignments);
+}
+
+/**
+ * @brief Executes the parsed command.
+ * 
+ * @param args Array of arguments.
+ * @return int Status of execution.
+ */
+int execute_command(char **args) {
+    if (args[0] == NULL) {
+        // Empty command
+        return 1;
+    }
+
+    int status;
+    if (!audit.running) {
+        status = dispatch_command(args);
+    } else {
+        // Capture argv before redirection parsing and builtins modify it; a
+        // command started in the background under -j finishes its record when reaped
+        AuditRecord *outer = launcher.record;
+        launcher.record = audit_begin(args);
+        status = dispatch_command(args);
+        audit_finish(launcher.record, last_status);
+        launcher.record = outer;
+    }
+    return status;
+}
+
+/**
+ * @brief Looks a command up in a PATH string, without the cache.
+ * 
+ * @param out Receives the executable's path; PATH_MAX bytes.
+ * @return int 0 if found, -1 otherwise.
+ */
+static int search_path(const char *path_env, const char *name, char *out) {
+    const char *dir = path_env;
+    while (*dir) {
+        size_t dir_len = strcspn(dir, ":");
+        if (dir_len > 0) {
+            snprintf(out, PATH_MAX, "%.*s/%s", (int)dir_len, dir, name);
+            if (access(out, X_OK) == 0) {
+                return 0;
+            }
+        }
+        dir += dir_len;
+        if (*dir == ':') dir++;
+    }
+    return -1;
+}
+
+/**
+ * @brief Resolves a command name to an executable path using $PATH.
+ * 
+ * Successful lookups are cached until PATH changes; misses are not, so a
+ * program installed later in the run is still found.
+ * 
+ * @param name The command name.
+ * @return const char* The executable path, or NULL if not found.
+ */
+const char *resolve_command(const char *name) {
+    // Commands containing a slash are executed directly
+    if (strchr(name, '/')) {
+        return name;
+    }
+
+    char *path_env = getenv("PATH");
+    if (!path_env) {
+        return NULL;
+    }
+
+    // Drop the cache whenever PATH is changed
+    if (!path_cache_env || strcmp(path_cache_env, path_env) != 0) {
+        strmap_clear(&path_cache, free);
+        free(path_cache_env);
+        path_cache_env = strdup(path_env);
+        snapshot.paths_valid = snapshot.base
+            && strcmp(snapshot.base + snapshot.header->path_env, path_env) == 0;
+    }
+
+    void *cached;
+    if (strmap_get(&path_cache, name, &cached)) {
+        return cached;
+    }
+    if (snapshot.paths_valid) {
+        int64_t index = snapshot_find(snapshot.header->path_table, snapshot.header->path_slots,
+                                      snapshot.header->paths, name);
+        if (index >= 0) {
+            const SnapshotEntry *entries = (const SnapshotEntry *)(snapshot.base + snapshot.header->paths);
+            return snapshot.base + entries[index].value;
+        }
+    }
+
+    char executable_path[PATH_MAX];
+    if (search_path(path_env, name, executable_path) == 0) {
+        char *found = strdup(executable_path);
+        if (found && strmap_put(&path_cache, name, found) == -1) {
+            free(found);
+            return NULL;
+        }
+        return found;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Milliseconds elapsed from a to b.
+ */
+static double elapsed_ms(const struct timespec *a, const struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) * 1e3 + (b->tv_nsec - a->tv_nsec) / 1e6;
+}
+
+/**
+ * @brief Records a launcher decision for the pressure builtin.
+ */
+static void launcher_note(const char *format, ...) __attribute__((format(printf, 1, 2)));
+static void launcher_note(const char *format, ...) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    char *entry = launcher.log[launcher.log_count % LAUNCH_LOG_SIZE];
+    int len = snprintf(entry, LAUNCH_LOG_WIDTH, "+%.3fs ", elapsed_ms(&launcher.started, &now) / 1e3);
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(entry + len, LAUNCH_LOG_WIDTH - len, format, ap);
+    va_end(ap);
+    launcher.log_count++;
+}
+
+/**
+ * @brief Reads the "some avg10" percentage from a /proc/pressure file.
+ * 
+ * @return double The percentage, or -1 if the file is unavailable.
+ */
+static double psi_some_avg10(int fd) {
+    char buf[256];
+    ssize_t len = fd >= 0 ? pread(fd, buf, sizeof(buf) - 1, 0) : -1;
+    if (len <= 0) {
+        return -1;
+    }
+    buf[len] = '\0';
+    char *avg = strstr(buf, "some avg10=");
+    return avg ? strtod(avg + 11, NULL) : -1;
+}
+
+/**
+ * @brief Refreshes the pressure sample, at most once per LAUNCH_SAMPLE_MS.
+ */
+static void pressure_sample(void) {
+    struct timespec previous = launcher.sampled_at;
+    clock_gettime(CLOCK_MONOTONIC, &launcher.sampled_at);
+    if (previous.tv_sec && elapsed_ms(&previous, &launcher.sampled_at) < LAUNCH_SAMPLE_MS) {
+        launcher.sampled_at = previous;
+        return;
+    }
+    for (int i = 0; i < 3; i++) {
+        launcher.sample[i] = psi_some_avg10(launcher.fds[i]);
+    }
+
+    char buf[128];
+    ssize_t len = launcher.fds[3] >= 0 ? pread(launcher.fds[3], buf, sizeof(buf) - 1, 0) : -1;
+    if (len > 0) {
+        buf[len] = '\0';
+        launcher.sample[3] = strtod(buf, NULL) / launcher.cpus;
+    } else {
+        launcher.sample[3] = -1;
+    }
+}
+
+/**
+ * @brief Checks the last sample against the thresholds.
+ * 
+ * @param why Receives a description of the first metric over its limit.
+ * @return int 1 if the system is under pressure, 0 otherwise.
+ */
+static int pressure_exceeded(char *why, size_t size) {
+    for (int i = 0; i < 4; i++) {
+        if (launcher.sample[i] > launcher.limits[i]) {
+            snprintf(why, size, "%s %.2f > %.2f", pressure_names[i], launcher.sample[i],
+                     launcher.limits[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Halves the concurrency limit, at most once per cooldown period.
+ */
+static void launcher_decrease(const char *why) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!launcher.adaptive || launcher.limit <= launcher.min ||
+        (launcher.decreased_at.tv_sec && elapsed_ms(&launcher.decreased_at, &now) < LAUNCH_COOLDOWN_MS)) {
+        return;
+    }
+    int limit = launcher.limit / 2 < launcher.min ? launcher.min : launcher.limit / 2;
+    launcher_note("limit %d -> %d: %s", launcher.limit, limit, why);
+    launcher.limit = limit;
+    launcher.credit = 0;
+    launcher.decreased_at = now;
+    launcher.decreases++;
+}
+
+/**
+ * @brief Waits for one background command and records its status.
+ * 
+ * Each completion under the thresholds earns credit; a full window of
+ * completions raises the concurrency limit by one (additive increase).
+ * 
+ * @param block Whether to wait when no command has finished yet.
+ * @return int 1 if a command was reaped, 0 otherwise.
+ */
+static int launcher_reap(int block) {
+    int status;
+    pid_t pid;
+    do {
+        pid = waitpid(-1, &status, block ? 0 : WNOHANG);
+    } while (pid == -1 && errno == EINTR);
+    if (pid <= 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < launcher.count; i++) {
+        if (launcher.jobs[i].pid != pid) continue;
+        last_status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+        audit_finish(launcher.jobs[i].record, last_status);
+        free(launcher.jobs[i].paths);
+        launcher.jobs[i] = launcher.jobs[--launcher.count];
+        break;
+    }
+
+    if (launcher.adaptive) {
+        char why[64];
+        pressure_sample();
+        if (pressure_exceeded(why, sizeof(why))) {
+            launcher_decrease(why);
+        } else if (++launcher.credit >= launcher.limit && launcher.limit < launcher.max) {
+            launcher_note("limit %d -> %d: %d finished under the limits", launcher.limit,
+                          launcher.limit + 1, launcher.credit);
+            launcher.limit++;
+            launcher.credit = 0;
+            launcher.increases++;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Waits for every background command started with -j.
+ */
+void launcher_wait_all(void) {
+    while (launcher.count > 0 && launcher_reap(1)) {
+    }
+}
+
+/**
+ * @brief Holds back a spawn while the system is under pressure or -j slots are full.
+ * 
+ * Under pressure, running background commands are waited for first; with
+ * nothing to wait for the launcher sleeps with exponential backoff, and gives
+ * up waiting after LAUNCH_MAX_DELAY_MS so a permanently loaded host still
+ * makes progress.
+ */
+static void launcher_before_spawn(void) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long backoff = LAUNCH_BACKOFF_MIN_MS;
+    int delayed = 0;
+    char why[64] = "";
+
+    for (;;) {
+        while (launcher.async && launcher.count >= launcher.limit && launcher_reap(1)) {
+        }
+        if (!launcher.gating) {
+            break;
+        }
+        pressure_sample();
+        if (!pressure_exceeded(why, sizeof(why))) {
+            break;
+        }
+        launcher_decrease(why);
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (elapsed_ms(&start, &now) >= LAUNCH_MAX_DELAY_MS) {
+            launcher_note("spawned anyway after %.0fms: %s", elapsed_ms(&start, &now), why);
+            launcher.forced++;
+            break;
+        }
+        delayed = 1;
+        if (launcher.count > 0) {
+            launcher_reap(1);
+        } else {
+            struct timespec pause = {backoff / 1000, (backoff % 1000) * 1000000L};
+            nanosleep(&pause, NULL);
+            backoff = backoff * 2 > LAUNCH_BACKOFF_MAX_MS ? LAUNCH_BACKOFF_MAX_MS : backoff * 2;
+        }
+    }
+
+    if (delayed) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double ms = elapsed_ms(&start, &now);
+        launcher.delays++;
+        launcher.delay_ms += ms;
+        launcher_note("delayed %.0fms: %s", ms, why);
+    }
+    launcher.spawns++;
+}
+
+/**
+ * @brief Parses pressure thresholds such as "cpu=40,memory=10,io=40,load=1.5".
+ * 
+ * @return int 0 on success, -1 if spec is malformed.
+ */
+int launcher_set_limits(const char *spec) {
+    char *copy = strdup(spec);
+    if (!copy) {
+        return -1;
+    }
+    int result = 0;
+    char *save = NULL;
+    for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *equal = strchr(item, '=');
+        int i = 0;
+        if (equal) {
+            *equal = '\0';
+            while (i < 4 && strcmp(item, pressure_names[i]) != 0) i++;
+        }
+        char *end = NULL;
+        double value = equal ? strtod(equal + 1, &end) : 0;
+        if (!equal || i == 4 || end == equal + 1 || *end != '\0' || value < 0) {
+            result = -1;
+            break;
+        }
+        launcher.limits[i] = value;
+    }
+    free(copy);
+    launcher.gating = 1;
+    return result;
+}
+
+/**
+ * @brief Parses a -j argument: a fixed count, "auto" or "auto:MIN:MAX".
+ * 
+ * @return int 0 on success, -1 if spec is malformed.
+ */
+int launcher_set_jobs(const char *spec) {
+    int min = 1, max = 2 * launcher.cpus;
+    char *end;
+    if (strncmp(spec, "auto", 4) == 0) {
+        if (spec[4] == ':') {
+            min = (int)strtol(spec + 5, &end, 10);
+            if (*end != ':') return -1;
+            max = (int)strtol(end + 1, &end, 10);
+            if (*end != '\0') return -1;
+        } else if (spec[4] != '\0') {
+            return -1;
+        }
+        if (min < 1 || max < min) return -1;
+        launcher.adaptive = 1;
+        launcher.gating = 1;
+        launcher.limit = launcher.cpus < min ? min : launcher.cpus > max ? max : launcher.cpus;
+    } else {
+        long jobs = strtol(spec, &end, 10);
+        if (*end != '\0' || jobs < 1 || jobs > INT_MAX) return -1;
+        min = max = launcher.limit = (int)jobs;
+    }
+    launcher.min = min;
+    launcher.max = max;
+    launcher.async = 1;
+    return 0;
+}
+
+/**
+ * @brief Removes "//", "/./" and "/x/../" from an absolute path in place.
+ */
+static void collapse_path(char *path) {
+    char *out = path;
+    const char *p = path;
+    while (*p) {
+        while (*p == '/') p++;
+        size_t len = strcspn(p, "/");
+        if (len == 0 || (len == 1 && p[0] == '.')) {
+            p += len;
+        } else if (len == 2 && p[0] == '.' && p[1] == '.') {
+            while (out > path && *--out != '/') {
+            }
+            p += len;
+        } else {
+            *out++ = '/';
+            memmove(out, p, len);
+            out += len;
+            p += len;
+        }
+    }
+    if (out == path) *out++ = '/';
+    *out = '\0';
+}
+
+/**
+ * @brief Lists the files a command may touch, for the -j independence check.
+ * 
+ * Every operand and every --option=VALUE is taken as a path relative to the
+ * current directory, except numbers that do not name a file; other words that
+ * are not paths only cost a false conflict.
+ * 
+ * @param args The command with its redirections removed.
+ * @return char** A NULL-terminated list in one allocation, or NULL if out of memory.
+ */
+static char **launcher_paths(char **args) {
+    const char *cwd = current_directory();
+    size_t cwd_len = cwd ? strlen(cwd) : 0;
+    size_t words = 0, bytes = 0;
+    for (int i = 1; args[i]; i++) {
+        words++;
+        bytes += cwd_len + strlen(args[i]) + 2;
+    }
+    char **paths = malloc((words + 1) * sizeof(char *) + bytes);
+    if (!paths) {
+        return NULL;
+    }
+
+    char *buffer = (char *)(paths + words + 1);
+    size_t count = 0;
+    for (int i = 1; args[i]; i++) {
+        const char *word = args[i];
+        if (word[0] == '-') {
+            word = strchr(word, '=');
+            if (!word) continue;
+            word++;
+        }
+        if (*word == '\0') continue;
+        char *end;
+        strtod(word, &end);
+        if (*end == '\0' && access(word, F_OK) != 0) continue;
+        int len = sprintf(buffer, "%s/%s", word[0] == '/' || !cwd ? "" : cwd, word);
+        collapse_path(buffer);
+        paths[count++] = buffer;
+        buffer += len + 1;
+    }
+    paths[count] = NULL;
+    return paths;
+}
+
+/**
+ * @brief Tells whether one path is the other or lies inside it.
+ */
+static int path_overlaps(const char *a, const char *b) {
+    size_t la = strlen(a), lb = strlen(b);
+    const char *shorter = la < lb ? a : b, *longer = la < lb ? b : a;
+    size_t len = la < lb ? la : lb;
+    return strncmp(shorter, longer, len) == 0
+        && (longer[len] == '\0' || longer[len] == '/' || shorter[len - 1] == '/');
+}
+
+/**
+ * @brief Tells whether a command must wait for the background commands under -j.
+ * 
+ * A command is a barrier when it redirects (the files are shared through the
+ * shell) or names a path that a running command names, or one inside it.
+ * Builtins, cd among them, are barriers already; see run_builtin().
+ */
+static int launcher_is_barrier(char **paths, int redirected) {
+    if (redirected || !paths) {
+        return 1;
+    }
+    for (int i = 0; i < launcher.count; i++) {
+        for (char **a = launcher.jobs[i].paths; a && *a; a++) {
+            for (char **b = paths; *b; b++) {
+                if (path_overlaps(*a, *b)) return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Remembers a background command started under -j.
+ * 
+ * @param pid The command's process.
+ * @param paths Its launcher_paths(); the launcher takes ownership.
+ */
+static void launcher_add(pid_t pid, char **paths) {
+    if (launcher.count == launcher.capacity) {
+        int capacity = launcher.capacity ? launcher.capacity * 2 : 16;
+        Job *grown = realloc(launcher.jobs, capacity * sizeof(Job));
+        if (!grown) {
+            // Cannot track it: run it to completion instead
+            waitpid(pid, NULL, 0);
+            free(paths);
+            return;
+        }
+        launcher.jobs = grown;
+        launcher.capacity = capacity;
+    }
+    launcher.jobs[launcher.count].pid = pid;
+    launcher.jobs[launcher.count].record = launcher.record;
+    launcher.jobs[launcher.count].paths = paths;
+    launcher.record = NULL;
+    launcher.count++;
+}
+
+/**
+ * @brief Opens the pressure sources; called once at startup.
+ */
+static void launcher_init(void) {
+    static const char *sources[4] = {
+        "/proc/pressure/cpu", "/proc/pressure/memory", "/proc/pressure/io", "/proc/loadavg",
+    };
+    for (int i = 0; i < 4; i++) {
+        launcher.fds[i] = open(sources[i], O_RDONLY | O_CLOEXEC);
+        launcher.sample[i] = -1;
+    }
+    launcher.limits[0] = PRESSURE_CPU_LIMIT;
+    launcher.limits[1] = PRESSURE_MEMORY_LIMIT;
+    launcher.limits[2] = PRESSURE_IO_LIMIT;
+    launcher.limits[3] = PRESSURE_LOAD_LIMIT;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    launcher.cpus = cpus > 0 ? (int)cpus : 1;
+    launcher.limit = launcher.min = launcher.max = 1;
+    clock_gettime(CLOCK_MONOTONIC, &launcher.started);
+}
+
+/**
+ * @brief Closes the pressure sources and forgets background commands.
+ */
+static void launcher_close(void) {
+    launcher_wait_all();
+    for (int i = 0; i < 4; i++) {
+        if (launcher.fds[i] >= 0) close(launcher.fds[i]);
+        launcher.fds[i] = -1;
+    }
+    free(launcher.jobs);
+    launcher.jobs = NULL;
+    launcher.count = launcher.capacity = 0;
+}
+
+/**
+ * @brief Built-in command: show pressure readings and launcher decisions.
+ */
+int wsh_pressure(char **args) {
+    (void)args; // Mark as unused to prevent compiler warnings
+    launcher.sampled_at.tv_sec = 0;
+    pressure_sample();
+    for (int i = 0; i < 4; i++) {
+        if (launcher.sample[i] < 0) {
+            out_printf(wsh_out, "%s n/a (limit %.2f)\n", pressure_names[i], launcher.limits[i]);
+        } else {
+            out_printf(wsh_out, "%s %.2f (limit %.2f)\n", pressure_names[i], launcher.sample[i],
+                       launcher.limits[i]);
+        }
+    }
+    out_printf(wsh_out, "gating %s\n", launcher.gating ? "on" : "off");
+    if (launcher.async) {
+        out_printf(wsh_out, "jobs %d running, limit %d", launcher.count, launcher.limit);
+        if (launcher.adaptive) {
+            out_printf(wsh_out, " (auto %d-%d)", launcher.min, launcher.max);
+        }
+        out_printf(wsh_out, "\n");
+    }
+    out_printf(wsh_out, "spawns %zu, delayed %zu (%.0fms), forced %zu, increases %zu, decreases %zu\n",
+               launcher.spawns, launcher.delays, launcher.delay_ms, launcher.forced,
+               launcher.increases, launcher.decreases);
+    size_t first = launcher.log_count > LAUNCH_LOG_SIZE ? launcher.log_count - LAUNCH_LOG_SIZE : 0;
+    for (size_t i = first; i < launcher.log_count; i++) {
+        out_printf(wsh_out, "%s\n", launcher.log[i % LAUNCH_LOG_SIZE]);
+    }
+    return 1;
+}
+
+/**
+ * @brief Parses a rate, N/s, N/m or N/h with N possibly fractional, into time per token.
+ * 
+ * @return int 0 on success, -1 if malformed.
+ */
+static int parse_rate(const char *spec, int64_t *interval_ns) {
+    char *end;
+    errno = 0;
+    double count = strtod(spec, &end);
+    if (errno || end == spec || *end != '/' || !(count > 0)) return -1;
+    double seconds;
+    if (strcmp(end + 1, "s") == 0) {
+        seconds = 1;
+    } else if (strcmp(end + 1, "m") == 0) {
+        seconds = 60;
+    } else if (strcmp(end + 1, "h") == 0) {
+        seconds = 3600;
+    } else {
+        return -1;
+    }
+    double interval = seconds * 1e9 / count;
+    if (interval > 1e17) return -1;
+    *interval_ns = interval < 1 ? 1 : (int64_t)interval;
+    return 0;
+}
+
+/**
+ * @brief Parses `ratelimit [-b BURST] [-k NAME] RATE [--] COMMAND...`.
+ * 
+ * @return const char* NULL on success, otherwise what is wrong.
+ */
+static const char *parse_rate_limit(char **args, RateLimit *limit) {
+    limit->burst = 1;
+    limit->name = NULL;
+    int i = 1;
+    for (; args[i] && args[i][0] == '-' && args[i][1] != '\0'; i += 2) {
+        if (strcmp(args[i], "-b") == 0 && args[i + 1]) {
+            char *end;
+            errno = 0;
+            long long burst = strtoll(args[i + 1], &end, 10);
+            if (errno || *end != '\0' || burst < 1 || burst > INT32_MAX) return "invalid burst";
+            limit->burst = burst;
+        } else if (strcmp(args[i], "-k") == 0 && args[i + 1]) {
+            limit->name = args[i + 1];
+        } else {
+            return "usage: ratelimit [-b BURST] [-k NAME] RATE [--] COMMAND...";
+        }
+    }
+    if (!args[i]) return "usage: ratelimit [-b BURST] [-k NAME] RATE [--] COMMAND...";
+    if (parse_rate(args[i], &limit->interval_ns) == -1) return "invalid rate, expected N/s, N/m or N/h";
+    i++;
+    if (args[i] && strcmp(args[i], "--") == 0) i++;
+    if (!args[i]) return "missing command";
+    limit->command = args + i;
+
+    // VAR=x prefixes may follow; the bucket is named after the program
+    while (args[i] && is_assignment(args[i])) i++;
+    if (!args[i]) return "missing command";
+    if (!limit->name) {
+        char *slash = strrchr(args[i], '/');
+        limit->name = slash ? slash + 1 : args[i];
+    }
+    if (!*limit->name || strchr(limit->name, '/') ||
+        strlen(limit->name) + sizeof(RATE_SHM_PREFIX) > NAME_MAX) {
+        return "invalid bucket name";
+    }
+    return NULL;
+}
+
+/**
+ * @brief Maps a named bucket from /dev/shm, creating it on first use.
+ * 
+ * A new bucket is all zeroes, which reads as a full burst. Mappings are
+ * kept for the life of the shell so a loop does not reopen its bucket.
+ * 
+ * @return RateBucket* The bucket, or NULL with errno set.
+ */
+static RateBucket *rate_bucket_open(const char *name) {
+    void *bucket;
+    if (strmap_get(&rate_buckets, name, &bucket)) return bucket;
+
+    char path[NAME_MAX + 1];
+    snprintf(path, sizeof(path), "%s%s", RATE_SHM_PREFIX, name);
+    int fd = shm_open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) == -1 ||
+        (st.st_size < (off_t)sizeof(RateBucket) && ftruncate(fd, sizeof(RateBucket)) == -1)) {
+        close(fd);
+        return NULL;
+    }
+    bucket = mmap(NULL, sizeof(RateBucket), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (bucket == MAP_FAILED) return NULL;
+    if (strmap_put(&rate_buckets, name, bucket) == -1) {
+        munmap(bucket, sizeof(RateBucket));
+        errno = ENOMEM;
+        return NULL;
+    }
+    return bucket;
+}
+
+/**
+ * @brief strmap_clear() callback: unmaps one shared token bucket.
+ */
+static void rate_bucket_unmap(void *bucket) {
+    munmap(bucket, sizeof(RateBucket));
+}
+
+/**
+ * @brief Takes a token from a bucket, sleeping until it is due.
+ * 
+ * Each caller advances the shared arrival time by one interval with a
+ * compare-and-swap, which reserves its slot, then sleeps to an absolute
+ * CLOCK_MONOTONIC deadline. Concurrent shells therefore queue up in order
+ * without spinning or holding a lock while they wait.
+ */
+static void rate_acquire(RateBucket *bucket, const RateLimit *limit) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t now_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    int64_t tolerance = (limit->burst - 1) * limit->interval_ns;
+
+    int64_t tat = atomic_load(&bucket->tat_ns);
+    int64_t start;
+    do {
+        start = tat > now_ns ? tat : now_ns;
+    } while (!atomic_compare_exchange_weak(&bucket->tat_ns, &tat, start + limit->interval_ns));
+
+    int64_t due = start - tolerance;
+    if (due <= now_ns) return;
+    struct timespec deadline = {due / 1000000000, due % 1000000000};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR && !checkpoint_signal) {
+    }
+}
+
+/**
+ * @brief Runs a command once its ratelimit bucket has a token.
+ * 
+ * @param args NAME=value words, then `ratelimit`, its options and rate, then the command.
+ * @param assignments Number of NAME=value words, already substituted.
+ * @return int Status of the command.
+ */
+static int rate_limit_command(char **args, int assignments) {
+    RateLimit limit;
+    const char *error = parse_rate_limit(args + assignments, &limit);
+    if (error) {
+        out_printf(wsh_err, "wsh: ratelimit: %s\n", error);
+        out_flush_all();
+        last_status = 1;
+        return 1;
+    }
+    RateBucket *bucket = rate_bucket_open(limit.name);
+    if (!bucket) {
+        out_printf(wsh_err, "wsh: ratelimit: %s: %s\n", limit.name, strerror(errno));
+        out_flush_all();
+        last_status = 1;
+        return 1;
+    }
+    rate_acquire(bucket, &limit);
+
+    // Slide the command down next to the prefixes, which then apply to it
+    size_t words = 0;
+    while (limit.command[words]) words++;
+    memmove(args + assignments, limit.command, (words + 1) * sizeof(char *));
+    return dispatch_assignments(args, assignments);
+}
+
+/**
+ * @brief Builds a child's envp: environ's pointer array with assignments patched in.
+ * 
+ * The pointers are copied into a buffer kept across launches, and the
+ * NAME=value words themselves fill the changed slots, so neither environ
+ * nor any string in it is modified or copied.
+ * 
+ * @return char** The envp, valid until the next call, or NULL on allocation failure.
+ */
+static char **env_overlay_build(char **assignments, int count) {
+    size_t base = 0;
+    while (environ[base]) base++;
+    if (base + count + 1 > env_overlay.capacity) {
+        size_t capacity = (base + count + 1) * 2;
+        char **grown = realloc(env_overlay.envp, capacity * sizeof(char *));
+        if (!grown) return NULL;
+        env_overlay.envp = grown;
+        env_overlay.capacity = capacity;
+    }
+    memcpy(env_overlay.envp, environ, base * sizeof(char *));
+
+    size_t total = base;
+    for (int i = 0; i < count; i++) {
+        size_t prefix = strchr(assignments[i], '=') - assignments[i] + 1;
+        size_t slot = 0;
+        while (slot < total && strncmp(env_overlay.envp[slot], assignments[i], prefix) != 0) {
+            slot++;
+        }
+        env_overlay.envp[slot] = assignments[i];
+        if (slot == total) total++;
+    }
+    env_overlay.envp[total] = NULL;
+    return env_overlay.envp;
+}
+
+/**
+ * @brief Launches a program and waits for it to terminate.
+ * 
+ * @param args Array of arguments.
+ * @param assignments NAME=value words for the child's environment only.
+ * @param count Number of assignments.
+ * @return int Status of execution.
+ */
+int launch_process(char **args, char **assignments, int count) {
+    pid_t pid, wpid;
+    int status;
+
+    // Parse redirections
+    char *input = NULL;
+    char *output = NULL;
+    int append = 0;
+    int redirect_stderr = 0;
+    parse_redirection(args, &input, &output, &append, &redirect_stderr);
+
+    // Resolve in the parent so repeated commands hit the path cache; a
+    // PATH=... prefix is searched directly
+    const char *executable = resolve_command(args[0]);
+    char prefix_path[PATH_MAX];
+    for (int i = count - 1; i >= 0 && !strchr(args[0], '/'); i--) {
+        if (strncmp(assignments[i], "PATH=", 5) == 0) {
+            executable = search_path(assignments[i] + 5, args[0], prefix_path) == 0 ? prefix_path : NULL;
+            break;
+        }
+    }
+
+    char **envp = environ;
+    if (count > 0) {
+        envp = env_overlay_build(assignments, count);
+        if (!envp) {
+            fprintf(stderr, "wsh: allocation error\n");
+            last_status = 1;
+            return 1;
+        }
+    }
+
+    // -j: a command that may depend on a running one waits for all of them
+    // and then runs to completion, like a builtin
+    int background = launcher.async;
+    char **paths = NULL;
+    if (background) {
+        paths = launcher_paths(args);
+        if (launcher_is_barrier(paths, input || output || redirect_stderr)) {
+            launcher_wait_all();
+            background = 0;
+        }
+    }
+
+    // Wait for a -j slot and for system pressure to ease
+    if (launcher.gating || launcher.async) {
+        launcher_before_spawn();
+    }
+
+    // Nothing buffered may be copied into the child
+    out_flush_all();
+    pid = exec_in_place ? 0 : fork();
+    if (pid == 0) {
+        // Child process. It leaves with _exit(): exit() would close the
+        // shared script stream and seek its descriptor back, so the shell
+        // would read the rest of the script again
+
+        // Apply redirections
+        if (apply_redirection(input, output, append, redirect_stderr) == -1) {
+            _exit(EXIT_FAILURE);
+        }
+
+        // Handle variable substitution already done in parse_line()
+
+        if (!executable) {
+            if (!getenv("PATH")) {
+                fprintf(stderr, "wsh: PATH not set\n");
+            } else {
+                fprintf(stderr, "wsh: command not found: %s\n", args[0]);
+            }
+            _exit(EXIT_FAILURE);
+        }
+
+        execve(executable, args, envp);
+        // If execve returns, there was an error
+        if (errno == ENOENT && executable != args[0]) {
+            // The cached program has been removed since it was looked up
+            fprintf(stderr, "wsh: command not found: %s\n", args[0]);
+        } else {
+            perror("wsh");
+        }
+        _exit(EXIT_FAILURE);
+    } else if (pid < 0) {
+        // Error forking
+        perror("wsh");
+        last_status = 1;
+    } else if (background) {
+        // -j: keep reading the script while this runs
+        launcher_add(pid, paths);
+        paths = NULL;
+    } else {
+        // Parent process
+        do {
+            wpid = waitpid(pid, &status, WUNTRACED);
+            if (wpid == -1) {
+                perror("wsh");
+                status = 1 << 8;
+                break;
+            }
+        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+        last_status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+    }
+
+    free(paths);
+    return 1;
+}
+
+/**
+ * @brief Makes an open directory current and updates $PWD and $OLDPWD.
+ * 
+ * @param dir The directory to enter; the shell takes ownership.
+ * @param old Receives the previous directory when non-NULL, otherwise it is closed.
+ * @return int 0 on success, -1 on error (dir is left with the caller).
+ */
+static int enter_directory(DirEntry dir, DirEntry *old) {
+    if (fchdir(dir.fd) != 0) {
+        return -1;
+    }
+    if (current_dir.path) {
+        set_environment("OLDPWD", current_dir.path);
+    }
+    if (old) {
+        *old = current_dir;
+    } else {
+        if (current_dir.fd != -1) close(current_dir.fd);
+        free(current_dir.path);
+    }
+    current_dir = dir;
+    if (current_dir.path) {
+        set_environment("PWD", current_dir.path);
+    }
+    return 0;
+}
+
+/**
+ * @brief Opens a directory relative to the current one.
+ * 
+ * The canonical path comes from the new descriptor itself, so resolving
+ * `..` and symbolic links costs one readlink() instead of a getcwd() walk.
+ * 
+ * @param target The directory to open.
+ * @param dir Receives the open directory.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int open_directory(const char *target, DirEntry *dir) {
+    int fd = openat(current_dir.fd != -1 ? current_dir.fd : AT_FDCWD, target,
+                    O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+
+    char link[64];
+    char path[PATH_MAX];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t len = readlink(link, path, sizeof(path) - 1);
+    if (len > 0 && path[0] == '/') {
+        path[len] = '\0';
+        dir->path = strdup(path);
+    } else if (fchdir(fd) == 0) {
+        // No /proc: fall back to asking the kernel after entering it
+        dir->path = getcwd(NULL, 0);
+        if (current_dir.fd != -1 && fchdir(current_dir.fd) != 0) {
+            perror("wsh");
+        }
+    } else {
+        dir->path = NULL;
+    }
+    if (!dir->path) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    dir->fd = fd;
+    return 0;
+}
+
+/**
+ * @brief Changes the current directory, keeping the tracked descriptor in sync.
+ * 
+ * @param target The directory to change to.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+int change_directory(const char *target) {
+    DirEntry dir;
+    if (open_directory(target, &dir) == -1) {
+        return -1;
+    }
+    if (enter_directory(dir, NULL) == -1) {
+        int saved = errno;
+        close(dir.fd);
+        free(dir.path);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Returns the current directory without a system call.
+ * 
+ * @return const char* The canonical path, or NULL if it is unknown.
+ */
+const char *current_directory(void) {
+    return current_dir.path;
+}
+
+/**
+ * @brief Built-in command: change directory.
+ */
+int wsh_cd(char **args) {
+    if (args[1] == NULL) {
+        out_printf(wsh_err, "wsh: expected argument to \"cd\"\n");
+    } else {
+        if (change_directory(args[1]) != 0) {
+            out_perror("wsh");
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Built-in command: print the current directory.
+ */
+int wsh_pwd(char **args) {
+    (void)args; // Mark as unused to prevent compiler warnings
+    if (current_dir.path) {
+        out_printf(wsh_out, "%s\n", current_dir.path);
+    } else {
+        out_printf(wsh_err, "wsh: pwd: current directory unknown\n");
+    }
+    return 1;
+}
+
+/**
+ * @brief Prints the directory stack, current directory first.
+ */
+static void print_dir_stack(void) {
+    out_printf(wsh_out, "%s", current_dir.path ? current_dir.path : "?");
+    for (int i = dir_stack.count - 1; i >= 0; i--) {
+        out_printf(wsh_out, " %s", dir_stack.entries[i].path);
+    }
+    out_printf(wsh_out, "\n");
+}
+
+/**
+ * @brief Built-in command: push a directory and change to it.
+ * 
+ * Without an argument, swaps the current directory with the top of the stack.
+ */
+int wsh_pushd(char **args) {
+    if (dir_stack.count == dir_stack.capacity) {
+        int capacity = dir_stack.capacity ? dir_stack.capacity * 2 : 8;
+        DirEntry *grown = realloc(dir_stack.entries, capacity * sizeof(DirEntry));
+        if (!grown) {
+            out_printf(wsh_err, "wsh: allocation error for directory stack\n");
+            return 1;
+        }
+        dir_stack.entries = grown;
+        dir_stack.capacity = capacity;
+    }
+
+    DirEntry dir;
+    if (args[1] == NULL) {
+        if (dir_stack.count == 0) {
+            out_printf(wsh_err, "wsh: pushd: no other directory\n");
+            return 1;
+        }
+        dir = dir_stack.entries[--dir_stack.count];
+    } else if (open_directory(args[1], &dir) == -1) {
+        out_perror("wsh");
+        return 1;
+    }
+
+    // The directory being left stays open on the stack for popd
+    DirEntry old;
+    if (enter_directory(dir, &old) == -1) {
+        out_perror("wsh");
+        if (args[1] == NULL) {
+            dir_stack.count++;
+        } else {
+            close(dir.fd);
+            free(dir.path);
+        }
+        return 1;
+    }
+    dir_stack.entries[dir_stack.count++] = old;
+    print_dir_stack();
+    return 1;
+}
+
+/**
+ * @brief Built-in command: return to the directory on top of the stack.
+ */
+int wsh_popd(char **args) {
+    (void)args; // Mark as unused to prevent compiler warnings
+    if (dir_stack.count == 0) {
+        out_printf(wsh_err, "wsh: popd: directory stack empty\n");
+        return 1;
+    }
+    if (enter_directory(dir_stack.entries[dir_stack.count - 1], NULL) == -1) {
+        out_perror("wsh");
+        return 1;
+    }
+    dir_stack.count--;
+    print_dir_stack();
+    return 1;
+}
+
+
+
+/**
+ * @brief Built-in command: exit the shell.
+ */
+int wsh_exit_cmd(char **args) {
+    if (args[1] != NULL) {
+        out_printf(wsh_err, "wsh: exit takes no arguments\n");
+        return 1;
+    }
+    if (forked_child) {
+        // Only this job or substitution ends; the shell goes on after it
+        out_flush_all();
+        _exit(EXIT_SUCCESS);
+    }
+
+    // execute_command() never gets to finish this record
+    audit_finish(launcher.record, EXIT_SUCCESS);
+    launcher.record = NULL;
+    cleanup_shell();
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * @brief Built-in command: export environment variable.
+ */
+int wsh_export(char **args) {
+    if (args[1] == NULL) {
+        out_printf(wsh_err, "wsh: export requires an argument\n");
+        return 1;
+    }
+
+    char *arg = args[1];
+    char *equal_sign = strchr(arg, '=');
+    if (!equal_sign) {
+        out_printf(wsh_err, "wsh: export requires VAR=VALUE format\n");
+        return 1;
+    }
+
+    *equal_sign = '\0';
+    char *var = arg;
+    char *value = equal_sign + 1;
+
+    if (set_environment(var, value) != 0) {
+        out_perror("wsh");
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Built-in command: local shell variable.
+ */
+int wsh_local_cmd(char **args) {
+    if (args[1] == NULL) {
+        out_printf(wsh_err, "wsh: local requires an argument\n");
+        return 1;
+    }
+
+    char *arg = args[1];
+    char *equal_sign = strchr(arg, '=');
+    if (!equal_sign) {
+        out_printf(wsh_err, "wsh: local requires VAR=VALUE format\n");
+        return 1;
+    }
+
+    *equal_sign = '\0';
+    char *var = arg;
+    char *value = equal_sign + 1;
+
+    // Handle variable substitution in value
+    char *processed_value = handle_variable_substitution(value);
+    if (!processed_value) {
+        processed_value = strdup("");
+    }
+
+    if (!processed_value || set_shell_variable(var, processed_value) == -1) {
+        out_printf(wsh_err, "wsh: allocation error for shell variable\n");
+    }
+
+    return 1;
+}
+
+/**
+ * @brief for_each_variable() callback: prints one variable as NAME=value.
+ */
+static void print_variable(const char *name, const char *value, void *ctx) {
+    (void)ctx;
+    out_printf(wsh_out, "%s=%s\n", name, value);
+}
+
+/**
+ * @brief Built-in command: display shell variables.
+ */
+int wsh_vars(char **args) {
+    (void)args; // Mark as unused to prevent compiler warnings
+    for_each_variable(print_variable, NULL);
+    return 1;
+}
+
+/**
+ * @brief Reads one line of input for `read`, consuming nothing after it.
+ * 
+ * A regular file is read in blocks and its offset moved back to just past
+ * the newline, as bash does; other inputs are read a byte at a time.
+ * 
+ * @param len Set to the line's length, without the newline.
+ * @return char* The line (free with free()), or NULL at end of input or on error.
+ */
+static char *read_input_line(int fd, size_t *len) {
+    struct stat st;
+    int seekable = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    size_t capacity = 256, used = 0;
+    char *line = malloc(capacity);
+    while (line) {
+        if (capacity - used < 2) {
+            char *grown = realloc(line, capacity * 2);
+            if (!grown) break;
+            line = grown;
+            capacity *= 2;
+        }
+        size_t want = seekable ? capacity - used - 1 : 1;
+        ssize_t n = read(fd, line + used, want);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) break;
+        if (n == 0) {
+            if (used == 0) break;
+            *len = used;
+            line[used] = '\0';
+            return line;
+        }
+        char *newline = memchr(line + used, '\n', n);
+        if (newline) {
+            // Give back what was read past the line
+            size_t extra = line + used + n - (newline + 1);
+            if (extra > 0) lseek(fd, -(off_t)extra, SEEK_CUR);
+            *len = newline - line;
+            *newline = '\0';
+            return line;
+        }
+        used += n;
+    }
+    free(line);
+    return NULL;
+}
+
+/**
+ * @brief Tells whether a string is a valid variable name.
+ */
+static int is_variable_name(const char *name) {
+    if (!isalpha((unsigned char)*name) && *name != '_') return 0;
+    for (name++; *name; name++) {
+        if (!isalnum((unsigned char)*name) && *name != '_') return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Built-in command: read [-r] [NAME...].
+ * 
+ * Reads a line from stdin, usually a file given with `<file`, and splits
+ * it at blanks into the named shell variables, the last taking the rest
+ * (REPLY without names). Without -r a backslash escapes the next
+ * character and joins lines. The status is 1 at end of input.
+ */
+int wsh_read(char **args) {
+    int raw = 0, first = 1;
+    for (; args[first] && args[first][0] == '-' && args[first][1]; first++) {
+        if (strcmp(args[first], "-r") == 0) {
+            raw = 1;
+        } else if (strcmp(args[first], "--") == 0) {
+            first++;
+            break;
+        } else {
+            out_printf(wsh_err, "wsh: read: %s: invalid option\n", args[first]);
+            return 1;
+        }
+    }
+    for (int i = first; args[i]; i++) {
+        if (!is_variable_name(args[i])) {
+            out_printf(wsh_err, "wsh: read: `%s': not a valid identifier\n", args[i]);
+            return 1;
+        }
+    }
+
+    // Escaped bytes are kept and marked so they never split fields
+    size_t len = 0;
+    char *line = read_input_line(STDIN_FILENO, &len);
+    if (!line) {
+        // End of input is a failure without a message, as in bash
+        builtin_errors++;
+        return 1;
+    }
+    char *escaped = calloc(len + 1, 1);
+    if (!escaped) {
+        out_printf(wsh_err, "wsh: read: allocation error\n");
+        free(line);
+        return 1;
+    }
+    if (!raw) {
+        size_t out = 0;
+        for (size_t in = 0; in < len; in++) {
+            if (line[in] != '\\') {
+                line[out++] = line[in];
+            } else if (in + 1 < len) {
+                escaped[out] = 1;
+                line[out++] = line[++in];
+            } else {
+                // A trailing backslash continues on the next line
+                size_t more_len;
+                char *more = read_input_line(STDIN_FILENO, &more_len);
+                char *grown_line = more ? realloc(line, out + more_len + 1) : NULL;
+                char *grown_escaped = grown_line ? realloc(escaped, out + more_len + 1) : NULL;
+                if (grown_line) line = grown_line;
+                if (!grown_escaped) {
+                    free(more);
+                    break;
+                }
+                escaped = grown_escaped;
+                memset(escaped + out, 0, more_len + 1);
+                memcpy(line + out, more, more_len);
+                free(more);
+                len = out + more_len;
+                in = out - 1;
+            }
+        }
+        len = out;
+        line[len] = '\0';
+    }
+
+    const char *reply[] = {"REPLY", NULL};
+    char **names = args[first] ? &args[first] : (char **)reply;
+    size_t pos = 0;
+    for (int i = 0; names[i]; i++) {
+        while (pos < len && (line[pos] == ' ' || line[pos] == '\t') && !escaped[pos]) pos++;
+        size_t end = pos;
+        if (names[i + 1]) {
+            while (end < len && !((line[end] == ' ' || line[end] == '\t') && !escaped[end])) end++;
+        } else {
+            // The last name takes the rest of the line, less trailing blanks
+            end = len;
+            while (end > pos && (line[end - 1] == ' ' || line[end - 1] == '\t') && !escaped[end - 1]) end--;
+        }
+        char *value = strndup(line + pos, end - pos);
+        if (!value || set_shell_variable(names[i], value) == -1) {
+            out_printf(wsh_err, "wsh: allocation error for shell variable\n");
+            break;
+        }
+        pos = end;
+    }
+    free(escaped);
+    free(line);
+    return 1;
+}
+
+/**
+ * @brief Built-in command: date [-u] [+FORMAT].
+ *
+ * Prints the time with strftime(), defaulting to the C locale's `date`
+ * format. As in GNU date, %N is the nanoseconds and %1N to %9N keep that
+ * many leading digits.
+ */
+int wsh_date(char **args) {
+    int utc = 0;
+    const char *format = NULL;
+    for (int i = 1; args[i]; i++) {
+        if (strcmp(args[i], "-u") == 0) {
+            utc = 1;
+        } else if (args[i][0] == '+' && !format) {
+            // The +FORMAT operand may come before or after -u, but only once
+            format = args[i] + 1;
+        } else if (args[i][0] == '+') {
+            out_printf(wsh_err, "wsh: date: extra operand `%s'\n", args[i]);
+            return 1;
+        } else {
+            out_printf(wsh_err, "wsh: date: %s: invalid argument\n", args[i]);
+            return 1;
+        }
+    }
+    if (!format) {
+        format = "%a %b %e %H:%M:%S %Z %Y";
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    struct tm tm;
+    if (!(utc ? gmtime_r(&ts.tv_sec, &tm) : localtime_r(&ts.tv_sec, &tm))) {
+        out_printf(wsh_err, "wsh: date: time out of range\n");
+        return 1;
+    }
+    if (utc) {
+        // gmtime_r names the zone GMT; GNU date -u says UTC
+        tm.tm_zone = "UTC";
+    }
+
+    // strftime has no %N, so the digits are put into the format first. The
+    // leading x keeps an empty result apart from one that does not fit.
+    char nanos[10];
+    snprintf(nanos, sizeof(nanos), "%09ld", ts.tv_nsec);
+    char expanded[1024], text[4096];
+    size_t used = 0;
+    expanded[used++] = 'x';
+    for (const char *p = format; *p && used < sizeof(expanded) - 10; p++) {
+        if (p[0] == '%' && p[1] == 'N') {
+            memcpy(expanded + used, nanos, 9);
+            used += 9;
+            p++;
+        } else if (p[0] == '%' && p[1] >= '1' && p[1] <= '9' && p[2] == 'N') {
+            memcpy(expanded + used, nanos, p[1] - '0');
+            used += p[1] - '0';
+            p += 2;
+        } else if (p[0] == '%' && p[1]) {
+            // Other conversions, %% included, are left for strftime
+            expanded[used++] = *p++;
+            expanded[used++] = *p;
+        } else {
+            expanded[used++] = *p;
+        }
+    }
+    expanded[used] = '\0';
+
+    if (strftime(text, sizeof(text), expanded, &tm) == 0) {
+        out_printf(wsh_err, "wsh: date: format too long\n");
+        return 1;
+    }
+    out_printf(wsh_out, "%s\n", text + 1);
+    return 1;
+}
+
+/**
+ * @brief Built-in command: sleep NUMBER[smhd]....
+ *
+ * Sleeps for the sum of the durations, which may be fractional, until an
+ * absolute CLOCK_MONOTONIC deadline so a late wakeup is not compounded.
+ * A signal that is handled (as with --checkpoint) ends the sleep early
+ * with status 1.
+ */
+int wsh_sleep(char **args) {
+    if (!args[1]) {
+        out_printf(wsh_err, "wsh: sleep: missing operand\n");
+        return 1;
+    }
+    double total = 0;
+    for (int i = 1; args[i]; i++) {
+        char *end;
+        errno = 0;
+        double seconds = strtod(args[i], &end);
+        double unit = 1;
+        switch (*end) {
+        case 'd': unit *= 24; // fall through
+        case 'h': unit *= 60; // fall through
+        case 'm': unit *= 60; // fall through
+        case 's': end++; break;
+        }
+        int numeric = isdigit((unsigned char)args[i][0]) || args[i][0] == '.';
+        if (!numeric || *end || errno == ERANGE || !(seconds >= 0) || isinf(seconds)) {
+            out_printf(wsh_err, "wsh: sleep: invalid time interval `%s'\n", args[i]);
+            return 1;
+        }
+        total += seconds * unit;
+    }
+
+    // Clamp to a deadline time_t can hold
+    if (total > (double)INT32_MAX) total = INT32_MAX;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    time_t whole = (time_t)total;
+    deadline.tv_sec += whole;
+    deadline.tv_nsec += (long)((total - whole) * 1e9);
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) != 0) {
+        builtin_errors++;
+    }
+    return 1;
+}
+
+/**
+ * @brief Built-in command: history management.
+ */
+int wsh_history_cmd(char **args) {
+    if (args[1] == NULL) {
+        // Display history
+        show_history();
+    } else if (strcmp(args[1], "set") == 0) {
+        if (args[2] == NULL) {
+            out_printf(wsh_err, "wsh: history set requires a number\n");
+            return 1;
+        }
+        int new_capacity = atoi(args[2]);
+        if (new_capacity <= 0) {
+            out_printf(wsh_err, "wsh: history set requires a positive integer\n");
+            return 1;
+        }
+        set_history_capacity(new_capacity);
+    } else {
+        // Attempt to execute a history command
+        int num = atoi(args[1]);
+        if (num > 0) {
+            return execute_history_command(num);
+        }
+    }
+    return 1;
+}
+
+#ifdef WSH_HAVE_IO_URING
+/**
+ * @brief Maps the rings of a freshly created io_uring instance.
+ * 
+ * @return int 0 on success, -1 if io_uring cannot be used.
+ */
+static int stat_ring_setup(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, LS_RING_ENTRIES, &params);
+    if (fd < 0) {
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && cq_size > sq_size) {
+        sq_size = cq_size;
+    }
+
+    void *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    void *cq = sq;
+    if (!single) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            munmap(sq, sq_size);
+            close(fd);
+            return -1;
+        }
+    }
+    size_t sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        if (!single) munmap(cq, cq_size);
+        munmap(sq, sq_size);
+        close(fd);
+        return -1;
+    }
+
+    stat_ring.fd = fd;
+    stat_ring.entries = params.sq_entries;
+    stat_ring.sq_ring = sq;
+    stat_ring.sq_ring_size = sq_size;
+    stat_ring.cq_ring = cq;
+    stat_ring.cq_ring_size = single ? 0 : cq_size;
+    stat_ring.sqes = sqes;
+    stat_ring.sqes_size = sqes_size;
+    stat_ring.sq_head = (unsigned *)((char *)sq + params.sq_off.head);
+    stat_ring.sq_tail = (unsigned *)((char *)sq + params.sq_off.tail);
+    stat_ring.sq_mask = *(unsigned *)((char *)sq + params.sq_off.ring_mask);
+    stat_ring.sq_array = (unsigned *)((char *)sq + params.sq_off.array);
+    stat_ring.cq_head = (unsigned *)((char *)cq + params.cq_off.head);
+    stat_ring.cq_tail = (unsigned *)((char *)cq + params.cq_off.tail);
+    stat_ring.cq_mask = *(unsigned *)((char *)cq + params.cq_off.ring_mask);
+    stat_ring.cqes = (struct io_uring_cqe *)((char *)cq + params.cq_off.cqes);
+    return 0;
+}
+
+/**
+ * @brief Collects the completions the kernel has posted for a statx batch.
+ * 
+ * @return size_t The number of completions collected.
+ */
+static size_t stat_ring_reap(StatBatch *batch) {
+    size_t reaped = 0;
+    unsigned cq_head = *stat_ring.cq_head;
+    unsigned cq_tail = __atomic_load_n(stat_ring.cq_tail, __ATOMIC_ACQUIRE);
+    while (cq_head != cq_tail) {
+        struct io_uring_cqe *cqe = &stat_ring.cqes[cq_head & stat_ring.cq_mask];
+        size_t i = (size_t)cqe->user_data;
+        if (cqe->res == -EINVAL) {
+            // Kernel without IORING_OP_STATX: stat this one directly
+            batch->errors[i] = statx(batch->dirfd, batch->names[i], batch->flags,
+                                     STATX_BASIC_STATS, &batch->out[i]) == 0 ? 0 : errno;
+        } else {
+            batch->errors[i] = cqe->res < 0 ? -cqe->res : 0;
+        }
+        cq_head++;
+        reaped++;
+    }
+    __atomic_store_n(stat_ring.cq_head, cq_head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+/**
+ * @brief Runs a statx batch through io_uring, keeping the ring full.
+ * 
+ * Gives up on the ring after a hard error or LS_RING_RETRIES failed submissions
+ * in a row; entries the kernel never took are withdrawn and those it did are
+ * waited for, so the caller can stat the whole batch again without a race.
+ * 
+ * @return int 0 on success, -1 if the ring is unusable and nothing is in flight.
+ */
+static int stat_batch_ring(StatBatch *batch) {
+    size_t submitted = 0, completed = 0;
+    int failures = 0;
+    while (completed < batch->count) {
+        unsigned tail = *stat_ring.sq_tail;
+        unsigned head = __atomic_load_n(stat_ring.sq_head, __ATOMIC_ACQUIRE);
+        while (submitted < batch->count && submitted - completed < stat_ring.entries &&
+               tail - head < stat_ring.entries) {
+            unsigned index = tail & stat_ring.sq_mask;
+            struct io_uring_sqe *sqe = &stat_ring.sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = batch->dirfd;
+            sqe->addr = (uint64_t)(uintptr_t)batch->names[submitted];
+            sqe->len = STATX_BASIC_STATS;
+            sqe->off = (uint64_t)(uintptr_t)&batch->out[submitted];
+            sqe->statx_flags = batch->flags;
+            sqe->user_data = submitted;
+            stat_ring.sq_array[index] = index;
+            tail++;
+            submitted++;
+        }
+        __atomic_store_n(stat_ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+        // Everything queued and not yet taken, including entries a failed call left behind
+        int ret = (int)syscall(__NR_io_uring_enter, stat_ring.fd, tail - head, 1,
+                               IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret >= 0 || errno == EINTR) {
+            failures = 0;
+        } else if ((errno != EAGAIN && errno != EBUSY) || ++failures >= LS_RING_RETRIES) {
+            // The kernel only takes entries inside io_uring_enter, so the rest can be withdrawn
+            head = __atomic_load_n(stat_ring.sq_head, __ATOMIC_ACQUIRE);
+            __atomic_store_n(stat_ring.sq_tail, head, __ATOMIC_RELEASE);
+            submitted -= tail - head;
+            while (completed < submitted) {
+                size_t reaped = stat_ring_reap(batch);
+                completed += reaped;
+                if (!reaped && completed < submitted &&
+                    syscall(__NR_io_uring_enter, stat_ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+                    struct timespec pause = {0, 1000000L};
+                    nanosleep(&pause, NULL);
+                }
+            }
+            return -1;
+        }
+        completed += stat_ring_reap(batch);
+    }
+    return 0;
+}
+#endif // WSH_HAVE_IO_URING
+
+/**
+ * @brief Releases the io_uring instance used by ls.
+ */
+void stat_ring_close(void) {
+#ifdef WSH_HAVE_IO_URING
+    if (stat_ring.fd >= 0) {
+        munmap(stat_ring.sqes, stat_ring.sqes_size);
+        if (stat_ring.cq_ring_size) munmap(stat_ring.cq_ring, stat_ring.cq_ring_size);
+        munmap(stat_ring.sq_ring, stat_ring.sq_ring_size);
+        close(stat_ring.fd);
+    }
+#endif
+    stat_ring.fd = -2;
+}
+
+/**
+ * @brief Thread-pool worker: claims entries of a batch until none are left.
+ */
+static void *stat_batch_worker(void *arg) {
+    StatBatch *batch = arg;
+    size_t i;
+    while ((i = atomic_fetch_add(&batch->next, 1)) < batch->count) {
+        batch->errors[i] = statx(batch->dirfd, batch->names[i], batch->flags,
+                                 STATX_BASIC_STATS, &batch->out[i]) == 0 ? 0 : errno;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Stats every name of a batch, overlapping the metadata reads.
+ * 
+ * Uses IORING_OP_STATX when the kernel allows it and a small thread pool otherwise,
+ * so a directory on slow storage costs about one round trip per batch, not per file.
+ */
+static void stat_batch_run(StatBatch *batch) {
+    atomic_init(&batch->next, 0);
+#ifdef WSH_HAVE_IO_URING
+    if (stat_ring.fd == -2 && stat_ring_setup() != 0) {
+        stat_ring.fd = -1;
+    }
+    if (stat_ring.fd >= 0 && batch->count > 1) {
+        if (stat_batch_ring(batch) == 0) {
+            return;
+        }
+        stat_ring_close();
+        stat_ring.fd = -1;
+    }
+#endif
+
+    pthread_t threads[LS_STAT_THREADS];
+    int started = 0;
+    if (batch->count >= 2 * LS_STAT_THREADS) {
+        for (; started < LS_STAT_THREADS - 1; started++) {
+            if (pthread_create(&threads[started], NULL, stat_batch_worker, batch) != 0) {
+                break;
+            }
+        }
+    }
+    stat_batch_worker(batch);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/**
+ * @brief Returns the cached name for a uid or gid, looking it up once.
+ */
+static const char *ls_id_name(LsIdCache *cache, unsigned id, int group) {
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->ids[i] == id) return cache->names[i];
+    }
+    if (cache->count == LS_ID_CACHE) {
+        cache->count--;
+        free(cache->names[cache->count]);
+    }
+
+    char *name = NULL;
+    if (group) {
+        struct group *gr = getgrgid(id);
+        if (gr) name = strdup(gr->gr_name);
+    } else {
+        struct passwd *pw = getpwuid(id);
+        if (pw) name = strdup(pw->pw_name);
+    }
+    if (!name) {
+        char number[16];
+        snprintf(number, sizeof(number), "%u", id);
+        name = strdup(number);
+    }
+    cache->ids[cache->count] = id;
+    cache->names[cache->count++] = name;
+    return name ? name : "?";
+}
+
+/**
+ * @brief Formats a mode the way `ls -l` does, e.g. "drwxr-xr-x".
+ */
+static void ls_mode_string(unsigned mode, char *out) {
+    out[0] = S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : S_ISCHR(mode) ? 'c' :
+             S_ISBLK(mode) ? 'b' : S_ISFIFO(mode) ? 'p' : S_ISSOCK(mode) ? 's' :
+             S_ISREG(mode) ? '-' : '?';
+    out[1] = mode & S_IRUSR ? 'r' : '-';
+    out[2] = mode & S_IWUSR ? 'w' : '-';
+    out[3] = mode & S_ISUID ? (mode & S_IXUSR ? 's' : 'S') : (mode & S_IXUSR ? 'x' : '-');
+    out[4] = mode & S_IRGRP ? 'r' : '-';
+    out[5] = mode & S_IWGRP ? 'w' : '-';
+    out[6] = mode & S_ISGID ? (mode & S_IXGRP ? 's' : 'S') : (mode & S_IXGRP ? 'x' : '-');
+    out[7] = mode & S_IROTH ? 'r' : '-';
+    out[8] = mode & S_IWOTH ? 'w' : '-';
+    out[9] = mode & S_ISVTX ? (mode & S_IXOTH ? 't' : 'T') : (mode & S_IXOTH ? 'x' : '-');
+    out[10] = '\0';
+}
+
+/**
+ * @brief Orders listing entries by name (C locale collation).
+ */
+static int ls_compare(const void *a, const void *b) {
+    return strcmp(((const LsEntry *)a)->name, ((const LsEntry *)b)->name);
+}
+
+/**
+ * @brief Prints entries in long format with GNU column widths.
+ * 
+ * @param dirfd Directory the names are relative to (for symlink targets).
+ * @param operands Whether these are command-line operands: no "total" line, and
+ *        directories only contribute to the column widths.
+ */
+static void ls_print_long(LsState *ls, int dirfd, LsEntry *entries, size_t count, int operands) {
+    int nlink_width = 0, owner_width = 0, group_width = 0, size_width = 0;
+    int major_width = 0, minor_width = 0;
+    uint64_t blocks = 0;
+    char number[32];
+
+    for (size_t i = 0; i < count; i++) {
+        struct statx *st = entries[i].st;
+        if (!st) continue;
+        blocks += st->stx_blocks;
+        int len = snprintf(number, sizeof(number), "%u", st->stx_nlink);
+        if (len > nlink_width) nlink_width = len;
+        len = (int)strlen(ls_id_name(&ls->users, st->stx_uid, 0));
+        if (len > owner_width) owner_width = len;
+        len = (int)strlen(ls_id_name(&ls->groups, st->stx_gid, 1));
+        if (len > group_width) group_width = len;
+        if (S_ISCHR(st->stx_mode) || S_ISBLK(st->stx_mode)) {
+            len = snprintf(number, sizeof(number), "%u", st->stx_rdev_major);
+            if (len > major_width) major_width = len;
+            len = snprintf(number, sizeof(number), "%u", st->stx_rdev_minor);
+            if (len > minor_width) minor_width = len;
+            len = major_width + 2 + minor_width;
+        } else {
+            len = snprintf(number, sizeof(number), "%llu", (unsigned long long)st->stx_size);
+        }
+        if (len > size_width) size_width = len;
+    }
+
+    if (!operands) {
+        // st_blocks counts 512-byte units; ls reports 1K blocks rounded up
+        out_printf(wsh_out, "total %llu\n", (unsigned long long)((blocks + 1) / 2));
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    time_t six_months_ago = now.tv_sec - LS_RECENT_SECONDS;
+
+    for (size_t i = 0; i < count; i++) {
+        struct statx *st = entries[i].st;
+        if (!st || (operands && S_ISDIR(st->stx_mode))) continue;
+
+        char mode[11];
+        ls_mode_string(st->stx_mode, mode);
+
+        char date[64];
+        time_t when = (time_t)st->stx_mtime.tv_sec;
+        struct tm tm;
+        localtime_r(&when, &tm);
+        int recent = when > six_months_ago && when <= now.tv_sec;
+        if (!strftime(date, sizeof(date), recent ? "%b %e %H:%M" : "%b %e  %Y", &tm)) {
+            snprintf(date, sizeof(date), "%lld", (long long)when);
+        }
+
+        out_printf(wsh_out, "%s %*u %-*s %-*s ", mode, nlink_width, st->stx_nlink,
+               owner_width, ls_id_name(&ls->users, st->stx_uid, 0),
+               group_width, ls_id_name(&ls->groups, st->stx_gid, 1));
+        if (S_ISCHR(st->stx_mode) || S_ISBLK(st->stx_mode)) {
+            int blanks = size_width - (major_width + 2 + minor_width);
+            out_printf(wsh_out, "%*u, %*u ", major_width + (blanks > 0 ? blanks : 0),
+                       st->stx_rdev_major, minor_width, st->stx_rdev_minor);
+        } else {
+            out_printf(wsh_out, "%*llu ", size_width, (unsigned long long)st->stx_size);
+        }
+        out_printf(wsh_out, "%s %s", date, entries[i].name);
+
+        if (S_ISLNK(st->stx_mode)) {
+            char target[PATH_MAX];
+            ssize_t len = readlinkat(dirfd, entries[i].name, target, sizeof(target) - 1);
+            if (len >= 0) {
+                target[len] = '\0';
+                out_printf(wsh_out, " -> %s", target);
+            }
+        }
+        out_printf(wsh_out, "\n");
+    }
+}
+
+/**
+ * @brief Lists one directory, then recurses into its subdirectories for -R.
+ * 
+ * @param parent Directory fd that path is opened relative to.
+ * @param name Name to open relative to parent.
+ * @param path Path as the user should see it in headings and errors.
+ */
+static void ls_directory(LsState *ls, int parent, const char *name, const char *path) {
+    int fd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        out_printf(wsh_err, "wsh: ls: cannot open directory '%s': %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return;
+    }
+
+    // Names go into one arena; entries keep offsets until reading is done
+    size_t count = 0, capacity = 64, arena_used = 0, arena_size = 4096;
+    LsEntry *entries = malloc(capacity * sizeof(LsEntry));
+    char *arena = malloc(arena_size);
+    size_t need_stat = 0;
+    struct dirent *d;
+    while (entries && arena && (d = readdir(dir)) != NULL) {
+        if (d->d_name[0] == '.' && !ls->all) continue;
+        size_t len = strlen(d->d_name) + 1;
+        if (count == capacity) {
+            LsEntry *grown = realloc(entries, capacity * 2 * sizeof(LsEntry));
+            if (!grown) break;
+            entries = grown;
+            capacity *= 2;
+        }
+        if (arena_used + len > arena_size) {
+            while (arena_used + len > arena_size) arena_size *= 2;
+            char *grown = realloc(arena, arena_size);
+            if (!grown) break;
+            arena = grown;
+        }
+        memcpy(arena + arena_used, d->d_name, len);
+        entries[count].offset = arena_used;
+        entries[count].type = d->d_type;
+        entries[count].st = NULL;
+        arena_used += len;
+        if (ls->long_format || (ls->recursive && d->d_type == DT_UNKNOWN)) need_stat++;
+        count++;
+    }
+    if (!entries || !arena) {
+        out_printf(wsh_err, "wsh: allocation error in ls\n");
+        free(entries);
+        free(arena);
+        closedir(dir);
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        entries[i].name = arena + entries[i].offset;
+    }
+    qsort(entries, count, sizeof(LsEntry), ls_compare);
+
+    // Stat everything that needs it in one overlapped batch
+    struct statx *stats = NULL;
+    if (need_stat) {
+        StatBatch batch;
+        batch.dirfd = dirfd(dir);
+        batch.flags = AT_SYMLINK_NOFOLLOW;
+        batch.count = 0;
+        batch.names = malloc(need_stat * sizeof(char *));
+        batch.errors = malloc(need_stat * sizeof(int));
+        stats = batch.out = malloc(need_stat * sizeof(struct statx));
+        size_t *index = malloc(need_stat * sizeof(size_t));
+        if (batch.names && batch.errors && batch.out && index) {
+            for (size_t i = 0; i < count; i++) {
+                if (ls->long_format || entries[i].type == DT_UNKNOWN) {
+                    index[batch.count] = i;
+                    batch.names[batch.count++] = entries[i].name;
+                }
+            }
+            stat_batch_run(&batch);
+            for (size_t j = 0; j < batch.count; j++) {
+                LsEntry *entry = &entries[index[j]];
+                if (batch.errors[j]) {
+                    out_printf(wsh_err, "wsh: ls: cannot access '%s/%s': %s\n", path, entry->name,
+                            strerror(batch.errors[j]));
+                    continue;
+                }
+                entry->st = &stats[j];
+                entry->type = S_ISDIR(stats[j].stx_mode) ? DT_DIR : DT_REG;
+            }
+        } else {
+            out_printf(wsh_err, "wsh: allocation error in ls\n");
+        }
+        free(batch.names);
+        free(batch.errors);
+        free(index);
+    }
+
+    if (ls->recursive || ls->headings) {
+        out_printf(wsh_out, "%s%s:\n", ls->printed ? "\n" : "", path);
+    }
+    ls->printed = 1;
+    if (ls->long_format) {
+        ls_print_long(ls, dirfd(dir), entries, count, 0);
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            out_printf(wsh_out, "%s\n", entries[i].name);
+        }
+    }
+
+    if (ls->recursive) {
+        for (size_t i = 0; i < count; i++) {
+            const char *entry = entries[i].name;
+            if (entries[i].type != DT_DIR || !strcmp(entry, ".") || !strcmp(entry, "..")) {
+                continue;
+            }
+            size_t len = strlen(path) + strlen(entry) + 2;
+            char *child = malloc(len);
+            if (!child) continue;
+            snprintf(child, len, "%s%s%s", path,
+                     path[strlen(path) - 1] == '/' ? "" : "/", entry);
+            ls_directory(ls, dirfd(dir), entry, child);
+            free(child);
+        }
+    }
+
+    free(stats);
+    free(arena);
+    free(entries);
+    closedir(dir);
+}
+
+/**
+ * @brief Built-in command: ls [-1alR] [FILE...].
+ * 
+ * Lists in-process in the C locale, one name per line as `ls -1` would. `-l` and `-R`
+ * stat each directory's entries as a batch (see stat_batch_run) and print in GNU format.
+ */
+int wsh_ls(char **args) {
+    LsState ls;
+    memset(&ls, 0, sizeof(ls));
+
+    int first = 1;
+    for (; args[first] && args[first][0] == '-' && args[first][1]; first++) {
+        if (!strcmp(args[first], "--")) {
+            first++;
+            break;
+        }
+        for (const char *flag = args[first] + 1; *flag; flag++) {
+            switch (*flag) {
+            case 'l': ls.long_format = 1; break;
+            case 'R': ls.recursive = 1; break;
+            case 'a': ls.all = 1; break;
+            case '1': break;
+            default:
+                out_printf(wsh_err, "wsh: ls: invalid option -- '%c'\n", *flag);
+                return 1;
+            }
+        }
+    }
+
+    char *dot[] = {".", NULL};
+    char **operands = args[first] ? &args[first] : dot;
+    int operand_count = 0;
+    while (operands[operand_count]) operand_count++;
+    ls.headings = operand_count > 1;
+
+    // Operands are classified first: files are listed together, then directories
+    StatBatch batch;
+    batch.dirfd = AT_FDCWD;
+    batch.flags = ls.long_format ? AT_SYMLINK_NOFOLLOW : 0;
+    batch.count = operand_count;
+    batch.names = operands;
+    batch.errors = calloc(operand_count, sizeof(int));
+    batch.out = calloc(operand_count, sizeof(struct statx));
+    LsEntry *files = calloc(operand_count, sizeof(LsEntry));
+    if (!batch.errors || !batch.out || !files) {
+        out_printf(wsh_err, "wsh: allocation error in ls\n");
+        free(batch.errors);
+        free(batch.out);
+        free(files);
+        return 1;
+    }
+    stat_batch_run(&batch);
+
+    size_t file_count = 0;
+    for (int i = 0; i < operand_count; i++) {
+        if (batch.errors[i] == ENOENT && !ls.long_format &&
+            statx(AT_FDCWD, operands[i], AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS,
+                  &batch.out[i]) == 0) {
+            batch.errors[i] = 0; // Dangling symlink: list the link itself
+        }
+        if (batch.errors[i]) {
+            out_printf(wsh_err, "wsh: ls: cannot access '%s': %s\n", operands[i],
+                    strerror(batch.errors[i]));
+        } else {
+            files[file_count].name = operands[i];
+            files[file_count].st = &batch.out[i];
+            file_count++;
+        }
+    }
+    qsort(files, file_count, sizeof(LsEntry), ls_compare);
+
+    // Directory operands count towards the widths GNU ls gives the file operands
+    size_t dir_count = 0;
+    for (size_t i = 0; i < file_count; i++) {
+        if (S_ISDIR(files[i].st->stx_mode)) dir_count++;
+    }
+    if (dir_count < file_count) {
+        if (ls.long_format) {
+            ls_print_long(&ls, AT_FDCWD, files, file_count, 1);
+        } else {
+            for (size_t i = 0; i < file_count; i++) {
+                if (!S_ISDIR(files[i].st->stx_mode)) out_printf(wsh_out, "%s\n", files[i].name);
+            }
+        }
+        ls.printed = 1;
+        ls.headings = 1;
+    }
+    for (size_t i = 0; i < file_count; i++) {
+        if (S_ISDIR(files[i].st->stx_mode)) {
+            ls_directory(&ls, AT_FDCWD, files[i].name, files[i].name);
+        }
+    }
+
+    for (int i = 0; i < LS_ID_CACHE; i++) {
+        free(i < ls.users.count ? ls.users.names[i] : NULL);
+        free(i < ls.groups.count ? ls.groups.names[i] : NULL);
+    }
+    free(batch.errors);
+    free(batch.out);
+    free(files);
+    return 1;
+}
+
+/**
+ * @brief Writes all of len bytes, retrying short writes.
+ * 
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reports a failed output once and stops writing to it.
+ */
+static void tee_output_failed(TeeOutput *output) {
+    out_printf(wsh_err, "wsh: tee: %s: %s\n", output->name, strerror(errno));
+    output->failed = 1;
+}
+
+/**
+ * @brief Copies stdin to every output through one large user-space buffer.
+ * 
+ * Used when stdin or an output cannot be spliced (a terminal, for example).
+ * 
+ * @param buffer Data already taken from stdin, written out first.
+ * @param pending Number of bytes in buffer.
+ */
+static void tee_copy(TeeOutput *outputs, int count, char *buffer, size_t pending) {
+    for (;;) {
+        for (int i = 0; i < count; i++) {
+            if (!outputs[i].failed && write_all(outputs[i].fd, buffer, pending) == -1) {
+                tee_output_failed(&outputs[i]);
+            }
+        }
+        ssize_t n;
+        do {
+            n = read(STDIN_FILENO, buffer, TEE_BUFFER_SIZE);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            out_perror("wsh: tee");
+        }
+        if (n <= 0) {
+            return;
+        }
+        pending = n;
+    }
+}
+
+/**
+ * @brief Moves len bytes from a pipe to an output, consuming them from the pipe.
+ * 
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int tee_splice_all(int from, int to, size_t len) {
+    while (len > 0) {
+        ssize_t n = splice(from, NULL, to, NULL, len, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Fans stdin out to every output without copying it through user space.
+ * 
+ * Each chunk is spliced from stdin into a private staging pipe. tee(2)
+ * duplicates it into each output pipe, and through a second private pipe
+ * into each file but the last. The final output consumes the staged pages
+ * with splice(2). If an output pipe only takes part of a chunk, that chunk is
+ * finished with an ordinary copy.
+ * 
+ * @return int 0 when stdin is drained, -1 if splicing is unsupported here.
+ */
+static int tee_splice(TeeOutput *outputs, int count, char *buffer) {
+    int stage[2], spare[2];
+    if (pipe2(stage, O_CLOEXEC) == -1) {
+        return -1;
+    }
+    if (pipe2(spare, O_CLOEXEC) == -1) {
+        close(stage[0]);
+        close(stage[1]);
+        return -1;
+    }
+    int size = fcntl(stage[1], F_SETPIPE_SZ, TEE_BUFFER_SIZE);
+    if (size <= 0 || fcntl(spare[1], F_SETPIPE_SZ, size) != size) {
+        size = fcntl(stage[1], F_GETPIPE_SZ);
+        int spare_size = fcntl(spare[1], F_GETPIPE_SZ);
+        if (spare_size < size) size = spare_size;
+    }
+
+    int result = 0;
+    size_t moved = 0;
+    for (;;) {
+        ssize_t n = splice(STDIN_FILENO, NULL, stage[1], NULL, size, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            if (moved == 0 && errno == EINVAL) result = -1;
+            else out_perror("wsh: tee");
+            break;
+        }
+        if (n == 0) break;
+        moved += n;
+
+        // Find the output that will consume the staged chunk
+        int last = count - 1;
+        while (last >= 0 && outputs[last].failed) last--;
+        if (last < 0) {
+            // Every output failed; keep draining stdin like tee does
+            tee_splice_all(stage[0], spare[1], n);
+            if (read(spare[0], buffer, n) < 0) break;
+            continue;
+        }
+
+        ssize_t taken[TEE_MAX_OUTPUTS];
+        int short_write = 0;
+        for (int i = 0; i < last; i++) {
+            taken[i] = n;
+            if (outputs[i].failed) continue;
+            if (outputs[i].is_pipe) {
+                ssize_t k;
+                do {
+                    k = tee(stage[0], outputs[i].fd, n, 0);
+                } while (k < 0 && errno == EINTR);
+                if (k < 0) {
+                    tee_output_failed(&outputs[i]);
+                } else if (k < n) {
+                    taken[i] = k;
+                    short_write = 1;
+                }
+            } else {
+                ssize_t k;
+                do {
+                    k = tee(stage[0], spare[1], n, 0);
+                } while (k < 0 && errno == EINTR);
+                if (k != n || tee_splice_all(spare[0], outputs[i].fd, n) == -1) {
+                    tee_output_failed(&outputs[i]);
+                    // Discard whatever the failed splice left behind
+                    while (k > 0) {
+                        ssize_t r = read(spare[0], buffer, k);
+                        if (r <= 0) break;
+                        k -= r;
+                    }
+                }
+            }
+        }
+
+        if (!short_write) {
+            if (tee_splice_all(stage[0], outputs[last].fd, n) == -1) {
+                tee_output_failed(&outputs[last]);
+                while (n > 0) {
+                    ssize_t r = read(stage[0], buffer, n);
+                    if (r <= 0) break;
+                    n -= r;
+                }
+            }
+            continue;
+        }
+
+        // Rare: a reader's pipe was nearly full, so finish this chunk by copying
+        size_t have = 0;
+        while ((ssize_t)have < n) {
+            ssize_t r = read(stage[0], buffer + have, n - have);
+            if (r <= 0) break;
+            have += r;
+        }
+        for (int i = 0; i <= last; i++) {
+            size_t from = i < last ? (size_t)taken[i] : 0;
+            if (!outputs[i].failed && from < have &&
+                write_all(outputs[i].fd, buffer + from, have - from) == -1) {
+                tee_output_failed(&outputs[i]);
+            }
+        }
+    }
+
+    close(stage[0]);
+    close(stage[1]);
+    close(spare[0]);
+    close(spare[1]);
+    return result;
+}
+
+/**
+ * @brief Built-in command: tee [-a] [FILE...].
+ * 
+ * Copies stdin to stdout and to each FILE. Pipes and regular files are fed
+ * with tee(2)/splice(2); anything else falls back to a buffered copy.
+ */
+int wsh_tee(char **args) {
+    int append = 0;
+    int first = 1;
+    for (; args[first] && args[first][0] == '-' && args[first][1]; first++) {
+        if (strcmp(args[first], "-a") == 0) {
+            append = 1;
+        } else {
+            out_printf(wsh_err, "wsh: tee: invalid option %s\n", args[first]);
+            return 1;
+        }
+    }
+
+    TeeOutput outputs[TEE_MAX_OUTPUTS];
+    int count = 0;
+    outputs[count++] = (TeeOutput){STDOUT_FILENO, "standard output", 0, 0};
+    for (int i = first; args[i]; i++) {
+        if (count == TEE_MAX_OUTPUTS) {
+            out_printf(wsh_err, "wsh: tee: too many files\n");
             break;
-        } else if (strncmp(args[i], "<", 1) == 0) {
-            *input = args[i] + 1;
-            args[i] = NULL;
+        }
+        int fd = open(args[i], O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0644);
+        if (fd == -1) {
+            out_printf(wsh_err, "wsh: tee: %s: %s\n", args[i], strerror(errno));
+            continue;
+        }
+        outputs[count++] = (TeeOutput){fd, args[i], 0, 0};
+    }
+
+    // Zero-copy needs stdin to be a pipe and every output a pipe or a regular file
+    struct stat st;
+    int spliceable = fstat(STDIN_FILENO, &st) == 0 && S_ISFIFO(st.st_mode);
+    for (int i = 0; i < count; i++) {
+        if (fstat(outputs[i].fd, &st) != 0) {
+            spliceable = 0;
+            continue;
+        }
+        outputs[i].is_pipe = S_ISFIFO(st.st_mode);
+        if (!S_ISFIFO(st.st_mode) && !S_ISREG(st.st_mode)) spliceable = 0;
+        // splice(2) ignores O_APPEND on the target, so appended files are copied
+        if (S_ISREG(st.st_mode) && (fcntl(outputs[i].fd, F_GETFL) & O_APPEND)) spliceable = 0;
+    }
+
+    char *buffer = malloc(TEE_BUFFER_SIZE);
+    if (!buffer) {
+        out_printf(wsh_err, "wsh: allocation error in tee\n");
+    } else if (!spliceable || tee_splice(outputs, count, buffer) == -1) {
+        tee_copy(outputs, count, buffer, 0);
+    }
+    free(buffer);
+
+    for (int i = 1; i < count; i++) {
+        close(outputs[i].fd);
+    }
+    return 1;
+}
+
+/**
+ * @brief Opens a head/tail/wc/match operand; "-" and NULL mean stdin.
+ * 
+ * @return int The descriptor, or -1 on error (already reported).
+ */
+static int open_text_input(const char *cmd, const char *name) {
+    if (!name || strcmp(name, "-") == 0) {
+        return STDIN_FILENO;
+    }
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (strcmp(cmd, "wc") == 0 || strcmp(cmd, "match") == 0) {
+            out_printf(wsh_err, "wsh: %s: %s: %s\n", cmd, name, strerror(errno));
+        } else {
+            out_printf(wsh_err, "wsh: %s: cannot open '%s' for reading: %s\n", cmd, name, strerror(errno));
+        }
+    }
+    return fd;
+}
+
+/**
+ * @brief Closes an input from open_text_input().
+ */
+static void close_text_input(int fd) {
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+}
+
+/**
+ * @brief Reads a whole non-seekable input into memory.
+ * 
+ * @return char* The data (free with free()), or NULL on error.
+ */
+static char *read_all(int fd, size_t *len) {
+    size_t capacity = TEXT_BLOCK, used = 0;
+    char *data = malloc(capacity);
+    while (data) {
+        if (used == capacity) {
+            char *grown = realloc(data, capacity * 2);
+            if (!grown) break;
+            data = grown;
+            capacity *= 2;
+        }
+        ssize_t n = read(fd, data + used, capacity - used);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) break;
+        if (n == 0) {
+            *len = used;
+            return data;
+        }
+        used += n;
+    }
+    free(data);
+    return NULL;
+}
+
+/**
+ * @brief Writes bytes [start, end) of a regular file to stdout, with sendfile when possible.
+ */
+static void send_file_range(int fd, off_t start, off_t end) {
+    out_flush_all();
+    off_t offset = start;
+    while (offset < end) {
+        ssize_t n = sendfile(STDOUT_FILENO, fd, &offset, end - offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+    }
+    // Descriptors sendfile cannot write to are copied by hand
+    char buffer[TEXT_BLOCK];
+    while (offset < end) {
+        size_t want = end - offset < (off_t)sizeof(buffer) ? (size_t)(end - offset) : sizeof(buffer);
+        ssize_t n = pread(fd, buffer, want, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || write_all(STDOUT_FILENO, buffer, n) == -1) break;
+        offset += n;
+    }
+}
+
+/**
+ * @brief Offset just past the nth newline of a buffer, or len if there are fewer.
+ */
+static size_t first_lines_end(const char *data, size_t len, uintmax_t lines) {
+    size_t pos = 0;
+    while (lines > 0 && pos < len) {
+        const char *nl = memchr(data + pos, '\n', len - pos);
+        if (!nl) return len;
+        pos = nl - data + 1;
+        lines--;
+    }
+    return pos;
+}
+
+/**
+ * @brief Offset where the last n lines of a buffer start; a final unterminated line counts.
+ */
+static size_t last_lines_start(const char *data, size_t len, uintmax_t lines) {
+    if (lines == 0) return len;
+    size_t end = len;
+    if (end > 0 && data[end - 1] == '\n') end--;
+    while (lines-- > 0) {
+        const char *nl = memrchr(data, '\n', end);
+        if (!nl) return 0;
+        end = nl - data;
+    }
+    return end + 1;
+}
+
+/**
+ * @brief Like last_lines_start(), reading a regular file backwards from its end in blocks.
+ */
+static off_t last_lines_start_fd(int fd, off_t size, uintmax_t lines) {
+    if (lines == 0 || size == 0) return size;
+    char buffer[TEXT_BLOCK];
+    off_t end = size;
+    if (pread(fd, buffer, 1, size - 1) == 1 && buffer[0] == '\n') end--;
+    while (end > 0) {
+        off_t start = end > (off_t)sizeof(buffer) ? end - (off_t)sizeof(buffer) : 0;
+        size_t len = end - start, got = 0;
+        while (got < len) {
+            ssize_t n = pread(fd, buffer + got, len - got, start + got);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return 0;
+            got += n;
+        }
+        while (len > 0) {
+            const char *nl = memrchr(buffer, '\n', len);
+            if (!nl) break;
+            if (--lines == 0) return start + (nl - buffer) + 1;
+            len = nl - buffer;
+        }
+        end = start;
+    }
+    return 0;
+}
+
+/**
+ * @brief Parses the count of -n/-c for head and tail.
+ * 
+ * @param sign Receives '+' or '-' if the count had one, otherwise 0.
+ * @return int 0 on success, -1 if text is not a count.
+ */
+static int parse_text_count(const char *text, uintmax_t *count, char *sign) {
+    *sign = (*text == '+' || *text == '-') ? *text++ : 0;
+    if (*text < '0' || *text > '9') return -1;
+    char *end;
+    errno = 0;
+    *count = strtoumax(text, &end, 10);
+    return *end == '\0' && errno == 0 ? 0 : -1;
+}
+
+/**
+ * @brief Shared option parsing for head and tail: [-n N|-c N|-N] [FILE...].
+ * 
+ * @return int Index of the first operand, or -1 after reporting a bad option.
+ */
+static int parse_head_tail(char **args, uintmax_t *count, char *sign, int *bytes) {
+    *count = 10;
+    *sign = 0;
+    *bytes = 0;
+    int i = 1;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        const char *arg = args[i];
+        if (strcmp(arg, "--") == 0) {
+            return i + 1;
+        }
+        if ((arg[1] == 'n' || arg[1] == 'c')) {
+            *bytes = arg[1] == 'c';
+            const char *value = arg[2] ? arg + 2 : args[i + 1];
+            if (!arg[2] && value) i++;
+            if (!value || parse_text_count(value, count, sign) == -1) {
+                out_printf(wsh_err, "wsh: %s: invalid number of %s: '%s'\n", args[0],
+                           *bytes ? "bytes" : "lines", value ? value : "");
+                return -1;
+            }
+        } else if (parse_text_count(arg + 1, count, sign) == 0 && *sign == 0) {
+            *bytes = 0;
+        } else {
+            out_printf(wsh_err, "wsh: %s: invalid option -- '%c'\n", args[0], arg[1]);
+            return -1;
+        }
+    }
+    return i;
+}
+
+/**
+ * @brief Prints the "==> name <==" header head and tail use for several files.
+ */
+static void print_text_header(const char *name, int *first) {
+    out_printf(wsh_out, "%s==> %s <==\n", *first ? "" : "\n",
+               strcmp(name, "-") == 0 ? "standard input" : name);
+    *first = 0;
+}
+
+/**
+ * @brief Built-in command: head [-n [-]N|-c [-]N] [FILE...].
+ */
+int wsh_head(char **args) {
+    uintmax_t count;
+    char sign;
+    int bytes;
+    int first = parse_head_tail(args, &count, &sign, &bytes);
+    if (first < 0) return 1;
+
+    char *stdin_only[] = {"-", NULL};
+    char **files = args[first] ? &args[first] : stdin_only;
+    int headers = files[1] != NULL, first_header = 1;
+    char buffer[TEXT_BLOCK];
+
+    for (int f = 0; files[f]; f++) {
+        int fd = open_text_input("head", files[f]);
+        if (fd == -1) continue;
+        if (headers) print_text_header(files[f], &first_header);
+
+        struct stat st;
+        int regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0;
+        if (sign == '-') {
+            // Everything but the last N lines or bytes
+            if (regular) {
+                off_t cut = bytes ? (count < (uintmax_t)st.st_size ? st.st_size - (off_t)count : 0)
+                                  : last_lines_start_fd(fd, st.st_size, count);
+                send_file_range(fd, 0, cut);
+            } else {
+                size_t len;
+                char *data = read_all(fd, &len);
+                if (data) {
+                    size_t cut = bytes ? (count < len ? len - count : 0) : last_lines_start(data, len, count);
+                    out_write(wsh_out, data, cut);
+                    free(data);
+                }
+            }
+            close_text_input(fd);
+            continue;
+        }
+
+        uintmax_t left = count;
+        while (left > 0) {
+            ssize_t n = read(fd, buffer, bytes && left < sizeof(buffer) ? left : sizeof(buffer));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            size_t take = n;
+            if (bytes) {
+                left -= take;
+            } else {
+                size_t pos = 0;
+                while (left > 0 && pos < take) {
+                    const char *nl = memchr(buffer + pos, '\n', take - pos);
+                    if (!nl) {
+                        pos = take;
+                        break;
+                    }
+                    pos = nl - buffer + 1;
+                    left--;
+                }
+                take = pos;
+            }
+            out_write(wsh_out, buffer, take);
+            if (regular && left == 0 && take < (size_t)n) {
+                // Leave a shared seekable stdin just past what was printed, like coreutils
+                lseek(fd, (off_t)take - n, SEEK_CUR);
+            }
+        }
+        close_text_input(fd);
+    }
+    return 1;
+}
+
+/**
+ * @brief Built-in command: tail [-n [+]N|-c [+]N] [FILE...].
+ * 
+ * Regular files are read backwards from the end, so only the blocks holding
+ * the last N lines are touched however large the file is.
+ */
+int wsh_tail(char **args) {
+    uintmax_t count;
+    char sign;
+    int bytes;
+    int first = parse_head_tail(args, &count, &sign, &bytes);
+    if (first < 0) return 1;
+
+    char *stdin_only[] = {"-", NULL};
+    char **files = args[first] ? &args[first] : stdin_only;
+    int headers = files[1] != NULL, first_header = 1;
+
+    for (int f = 0; files[f]; f++) {
+        int fd = open_text_input("tail", files[f]);
+        if (fd == -1) continue;
+        if (headers) print_text_header(files[f], &first_header);
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            off_t start;
+            if (sign == '+') {
+                // From line or byte N onwards (1-based)
+                if (bytes) {
+                    start = count > 1 ? (off_t)(count - 1) : 0;
+                } else {
+                    start = 0;
+                    char buffer[TEXT_BLOCK];
+                    uintmax_t skip = count > 1 ? count - 1 : 0;
+                    while (skip > 0 && start < st.st_size) {
+                        ssize_t n = pread(fd, buffer, sizeof(buffer), start);
+                        if (n <= 0) break;
+                        size_t end = first_lines_end(buffer, n, skip);
+                        skip -= newline_counter(buffer, end);
+                        start += end;
+                    }
+                }
+            } else if (bytes) {
+                start = count < (uintmax_t)st.st_size ? st.st_size - (off_t)count : 0;
+            } else {
+                start = last_lines_start_fd(fd, st.st_size, count);
+            }
+            if (start < st.st_size) {
+                send_file_range(fd, start, st.st_size);
+            }
+        } else {
+            size_t len;
+            char *data = read_all(fd, &len);
+            if (data) {
+                size_t start;
+                if (sign == '+') {
+                    start = bytes ? (count > 1 ? count - 1 : 0) : first_lines_end(data, len, count > 1 ? count - 1 : 0);
+                } else {
+                    start = bytes ? (count < len ? len - count : 0) : last_lines_start(data, len, count);
+                }
+                if (start < len) out_write(wsh_out, data + start, len - start);
+                free(data);
+            }
+        }
+        close_text_input(fd);
+    }
+    return 1;
+}
+
+/**
+ * @brief Counts one input for wc: mmap for regular files, block reads otherwise.
+ * 
+ * @return int 0 on success, -1 on a read error.
+ */
+static int wc_count(int fd, int need_words, WcCounts *counts) {
+    struct stat st;
+    TextCounts text = {0, 0, 0};
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        if (!need_words && counts->bytes_only) {
+            counts->bytes = st.st_size;
+            return 0;
+        }
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            if (need_words) {
+                text_counter(map, st.st_size, &text);
+            } else {
+                text.lines = newline_counter(map, st.st_size);
+            }
+            munmap(map, st.st_size);
+            counts->lines = text.lines;
+            counts->words = text.words;
+            counts->bytes = st.st_size;
+            return 0;
+        }
+    }
+
+    char buffer[TEXT_BLOCK];
+    counts->bytes = 0;
+    for (;;) {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        if (need_words) {
+            text_counter(buffer, n, &text);
+        } else {
+            text.lines += newline_counter(buffer, n);
+        }
+        counts->bytes += n;
+    }
+    counts->lines = text.lines;
+    counts->words = text.words;
+    return 0;
+}
+
+/**
+ * @brief Prints one wc line in coreutils column order: lines, words, chars, bytes.
+ */
+static void wc_print(const WcCounts *counts, int show[4], int width, const char *name) {
+    uintmax_t values[4] = {counts->lines, counts->words, counts->bytes, counts->bytes};
+    const char *separator = "";
+    for (int i = 0; i < 4; i++) {
+        if (!show[i]) continue;
+        out_printf(wsh_out, "%s%*ju", separator, width, values[i]);
+        separator = " ";
+    }
+    if (name) out_printf(wsh_out, " %s", name);
+    out_printf(wsh_out, "\n");
+}
+
+/**
+ * @brief Built-in command: wc [-lwmc] [FILE...].
+ * 
+ * `wc -l` counts newlines with the SSE2/AVX2 loop chosen at startup over an
+ * mmap of the file; column widths follow coreutils.
+ */
+int wsh_wc(char **args) {
+    int show[4] = {0, 0, 0, 0}; // lines, words, chars, bytes
+    int first = 1;
+    for (; args[first] && args[first][0] == '-' && args[first][1]; first++) {
+        if (strcmp(args[first], "--") == 0) {
+            first++;
             break;
-        } else if (strncmp(args[i], "&>", 2) == 0) {
-            *output = args[i] + 2;
-            *redirect_stderr = 1;
-            args[i] = NULL;
+        }
+        for (const char *flag = args[first] + 1; *flag; flag++) {
+            const char *flags = "lwmc";
+            const char *which = strchr(flags, *flag);
+            if (!which) {
+                out_printf(wsh_err, "wsh: wc: invalid option -- '%c'\n", *flag);
+                return 1;
+            }
+            show[which - flags] = 1;
+        }
+    }
+    if (!show[0] && !show[1] && !show[2] && !show[3]) {
+        show[0] = show[1] = show[3] = 1;
+    }
+    int shown = show[0] + show[1] + show[2] + show[3];
+
+    char **files = &args[first];
+    int nfiles = 0;
+    while (files[nfiles]) nfiles++;
+
+    // coreutils sizes columns from the total size of regular files, and
+    // uses at least 7 for anything else; one count of one file is unpadded
+    int width = 1;
+    if (!(nfiles <= 1 && shown == 1)) {
+        struct stat st;
+        uintmax_t total_size = 0;
+        int minimum = 1;
+        int first_ok = nfiles == 0 ? fstat(STDIN_FILENO, &st) == 0 : stat(files[0], &st) == 0;
+        for (int i = 0; first_ok && i < (nfiles ? nfiles : 1); i++) {
+            if ((nfiles ? stat(files[i], &st) : fstat(STDIN_FILENO, &st)) != 0) continue;
+            if (S_ISREG(st.st_mode)) total_size += st.st_size;
+            else minimum = 7;
+        }
+        for (; first_ok && total_size >= 10; total_size /= 10) width++;
+        if (first_ok && width < minimum) width = minimum;
+    }
+
+    WcCounts total = {0, 0, 0, 0};
+    int need_words = show[1];
+    for (int i = 0; i < (nfiles ? nfiles : 1); i++) {
+        const char *name = nfiles ? files[i] : NULL;
+        int fd = open_text_input("wc", name);
+        if (fd == -1) continue;
+        WcCounts counts = {0, 0, 0, !show[0] && !show[1]};
+        if (wc_count(fd, need_words, &counts) == -1) {
+            out_printf(wsh_err, "wsh: wc: %s: %s\n", name ? name : "standard input", strerror(errno));
+        }
+        close_text_input(fd);
+        wc_print(&counts, show, width, name);
+        total.lines += counts.lines;
+        total.words += counts.words;
+        total.bytes += counts.bytes;
+    }
+    if (nfiles > 1) {
+        wc_print(&total, show, width, "total");
+    }
+    return 1;
+}
+
+/**
+ * @brief Builds the Aho-Corasick automaton for a set of patterns.
+ * 
+ * Missing transitions are filled in from the fail links, so the search
+ * loop is one table lookup per byte.
+ * 
+ * @return int 0 on success, -1 on allocation failure.
+ */
+static int ac_build(AhoCorasick *ac, const char **patterns, const size_t *lengths, size_t count) {
+    size_t capacity = 1;
+    for (size_t i = 0; i < count; i++) capacity += lengths[i];
+    ac->next = malloc(capacity * 256 * sizeof(int32_t));
+    ac->accept = calloc(capacity, 1);
+    int32_t *fail = malloc(capacity * sizeof(int32_t));
+    int32_t *queue = malloc(capacity * sizeof(int32_t));
+    if (!ac->next || !ac->accept || !fail || !queue) {
+        free(ac->next);
+        free(ac->accept);
+        free(fail);
+        free(queue);
+        ac->next = NULL;
+        ac->accept = NULL;
+        return -1;
+    }
+    memset(ac->next, 0xff, capacity * 256 * sizeof(int32_t));
+
+    // Trie of the patterns
+    ac->states = 1;
+    for (size_t i = 0; i < count; i++) {
+        size_t state = 0;
+        for (size_t j = 0; j < lengths[i]; j++) {
+            int32_t *slot = &ac->next[state * 256 + (unsigned char)patterns[i][j]];
+            if (*slot < 0) *slot = ac->states++;
+            state = *slot;
+        }
+        ac->accept[state] = 1;
+    }
+
+    // Breadth-first, so a state's fail target is complete before the state
+    size_t head = 0, tail = 0;
+    for (int c = 0; c < 256; c++) {
+        if (ac->next[c] < 0) {
+            ac->next[c] = 0;
+        } else {
+            fail[ac->next[c]] = 0;
+            queue[tail++] = ac->next[c];
+        }
+    }
+    while (head < tail) {
+        int32_t state = queue[head++];
+        int32_t *row = &ac->next[(size_t)state * 256];
+        const int32_t *fallback = &ac->next[(size_t)fail[state] * 256];
+        ac->accept[state] |= ac->accept[fail[state]];
+        for (int c = 0; c < 256; c++) {
+            if (row[c] < 0) {
+                row[c] = fallback[c];
+            } else {
+                fail[row[c]] = fallback[c];
+                queue[tail++] = row[c];
+            }
+        }
+    }
+    free(fail);
+    free(queue);
+    return 0;
+}
+
+/**
+ * @brief Finds the first pattern of the automaton in a buffer.
+ * 
+ * @return const char* The last byte of the first match, or NULL.
+ */
+static const char *ac_find(const AhoCorasick *ac, const char *s, size_t len) {
+    int32_t state = 0;
+    for (size_t i = 0; i < len; i++) {
+        state = ac->next[(size_t)state * 256 + (unsigned char)s[i]];
+        if (ac->accept[state]) return s + i;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Searches for one pattern from pos; the offset of its match, or SIZE_MAX.
+ */
+static size_t matcher_search(const Matcher *m, size_t i, const char *data, size_t len, size_t pos) {
+    const char *hit = substring_finder(data + pos, len - pos, m->patterns[i], m->lengths[i]);
+    return hit ? (size_t)(hit - data) : SIZE_MAX;
+}
+
+/**
+ * @brief Offset of a byte inside the first match at or after pos, or SIZE_MAX.
+ * 
+ * A few patterns are each searched with the SIMD finder, remembering each
+ * one's next match so a buffer is scanned once per pattern; more than
+ * MATCH_SIMD_PATTERNS go through the Aho-Corasick automaton.
+ */
+static size_t matcher_find(Matcher *m, const char *data, size_t len, size_t pos) {
+    if (m->match_all) return pos;
+    if (m->count > MATCH_SIMD_PATTERNS) {
+        const char *hit = ac_find(&m->ac, data + pos, len - pos);
+        return hit ? (size_t)(hit - data) : SIZE_MAX;
+    }
+    size_t first = SIZE_MAX;
+    for (size_t i = 0; i < m->count; i++) {
+        if (m->hits[i] < pos) m->hits[i] = matcher_search(m, i, data, len, pos);
+        if (m->hits[i] < first) first = m->hits[i];
+    }
+    return first;
+}
+
+/**
+ * @brief Prints whole lines [data, data + len), prefixed with the file name if needed.
+ */
+static void match_print(const Matcher *m, const char *name, const char *data, size_t len) {
+    if (!m->show_names) {
+        out_write(wsh_out, data, len);
+        if (data[len - 1] != '\n') out_write(wsh_out, "\n", 1);
+        return;
+    }
+    const char *end = data + len;
+    while (data < end) {
+        const char *newline = memchr(data, '\n', end - data);
+        const char *line_end = newline ? newline + 1 : end;
+        out_printf(wsh_out, "%s:", name);
+        out_write(wsh_out, data, line_end - data);
+        if (!newline) out_write(wsh_out, "\n", 1);
+        data = line_end;
+    }
+}
+
+/**
+ * @brief Selects and prints the lines of one buffer.
+ * 
+ * The search runs over the whole buffer rather than line by line: each
+ * hit is widened to its line, and the lines between hits are handled as
+ * one block. Patterns never contain a newline, so a hit never spans lines.
+ * 
+ * @return uintmax_t The number of selected lines (at most 1 with -l).
+ */
+static uintmax_t match_buffer(Matcher *m, const char *name, const char *data, size_t len) {
+    uintmax_t selected = 0;
+    size_t pos = 0;
+    if (!m->match_all && m->count <= MATCH_SIMD_PATTERNS) {
+        for (size_t i = 0; i < m->count; i++) m->hits[i] = matcher_search(m, i, data, len, 0);
+    }
+    while (pos < len) {
+        size_t hit = matcher_find(m, data, len, pos);
+        size_t start = len, end = len;
+        if (hit != SIZE_MAX) {
+            const char *newline = memrchr(data + pos, '\n', hit - pos);
+            start = newline ? (size_t)(newline - data) + 1 : pos;
+            newline = memchr(data + hit, '\n', len - hit);
+            end = newline ? (size_t)(newline - data) + 1 : len;
+        }
+        if (m->invert && start > pos) {
+            selected += newline_counter(data + pos, start - pos) + (data[start - 1] != '\n');
+            if (m->list_only) return selected;
+            if (!m->count_only) match_print(m, name, data + pos, start - pos);
+        }
+        if (hit == SIZE_MAX) break;
+        if (!m->invert) {
+            selected++;
+            if (m->list_only) return selected;
+            if (!m->count_only) match_print(m, name, data + start, end - start);
+        }
+        pos = end;
+    }
+    return selected;
+}
+
+/**
+ * @brief Runs the matcher over one input: mmap for regular files, read otherwise.
+ * 
+ * @return int 0 on success, -1 on a read error.
+ */
+static int match_input(Matcher *m, int fd, const char *name, uintmax_t *selected) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            *selected = match_buffer(m, name, map, st.st_size);
+            munmap(map, st.st_size);
+            return 0;
+        }
+    }
+    size_t len = 0;
+    char *data = read_all(fd, &len);
+    if (!data) return -1;
+    *selected = match_buffer(m, name, data, len);
+    free(data);
+    return 0;
+}
+
+/**
+ * @brief Adds a pattern, split at newlines the way grep -F does.
+ */
+static void match_add_pattern(Matcher *m, const char *pattern) {
+    for (;;) {
+        const char *newline = strchr(pattern, '\n');
+        size_t len = newline ? (size_t)(newline - pattern) : strlen(pattern);
+        m->patterns[m->count] = pattern;
+        m->lengths[m->count++] = len;
+        if (len == 0) m->match_all = 1;
+        if (!newline) break;
+        pattern = newline + 1;
+    }
+}
+
+/**
+ * @brief Built-in command: match [-cvl] [-e PATTERN]... [PATTERN] [FILE...].
+ * 
+ * Like grep -F: a few patterns are found with a SIMD first/last byte
+ * filter, many with an Aho-Corasick automaton, over an mmap of each file.
+ * The status is 1 when no line is selected.
+ */
+int wsh_match(char **args) {
+    Matcher m;
+    memset(&m, 0, sizeof(m));
+
+    // Every pattern piece starts after a newline or an argument boundary
+    size_t capacity = 0;
+    for (int i = 1; args[i]; i++) {
+        capacity++;
+        for (const char *c = args[i]; *c; c++) capacity += *c == '\n';
+    }
+    m.patterns = malloc((capacity + 1) * sizeof(char *));
+    m.lengths = malloc((capacity + 1) * sizeof(size_t));
+    m.hits = malloc((capacity + 1) * sizeof(size_t));
+    if (!m.patterns || !m.lengths || !m.hits) {
+        out_printf(wsh_err, "wsh: match: allocation error\n");
+        free(m.patterns);
+        free(m.lengths);
+        free(m.hits);
+        return 1;
+    }
+
+    int first = 1, explicit_patterns = 0, usage = 0;
+    for (; args[first] && args[first][0] == '-' && args[first][1]; first++) {
+        if (strcmp(args[first], "--") == 0) {
+            first++;
             break;
-        } else if (strncmp(args[i], "&>>", 3) == 0) {
-            *output = args[i] + 3;
-            *append = 1;
-            *redirect_stderr = 1;
-            args[i] = NULL;
+        }
+        for (const char *flag = args[first] + 1; *flag && !usage; flag++) {
+            if (*flag == 'c') {
+                m.count_only = 1;
+            } else if (*flag == 'v') {
+                m.invert = 1;
+            } else if (*flag == 'l') {
+                m.list_only = 1;
+            } else if (*flag == 'e') {
+                // -ePATTERN or -e PATTERN
+                const char *pattern = flag[1] ? flag + 1 : args[first + 1];
+                if (!pattern) {
+                    out_printf(wsh_err, "wsh: match: option requires an argument -- 'e'\n");
+                    usage = 1;
+                    break;
+                }
+                if (!flag[1]) first++;
+                match_add_pattern(&m, pattern);
+                explicit_patterns = 1;
+                break;
+            } else {
+                out_printf(wsh_err, "wsh: match: invalid option -- '%c'\n", *flag);
+                usage = 1;
+            }
+        }
+        if (usage) break;
+    }
+    if (!usage && !explicit_patterns) {
+        if (args[first]) {
+            match_add_pattern(&m, args[first++]);
+        } else {
+            out_printf(wsh_err, "wsh: match: usage: match [-cvl] [-e PATTERN]... [PATTERN] [FILE...]\n");
+            usage = 1;
+        }
+    }
+    if (!usage && !m.match_all && m.count > MATCH_SIMD_PATTERNS &&
+        ac_build(&m.ac, m.patterns, m.lengths, m.count) == -1) {
+        out_printf(wsh_err, "wsh: match: allocation error\n");
+        usage = 1;
+    }
+    if (usage) {
+        free(m.patterns);
+        free(m.lengths);
+        free(m.hits);
+        return 1;
+    }
+
+    char **files = &args[first];
+    int nfiles = 0;
+    while (files[nfiles]) nfiles++;
+    m.show_names = nfiles > 1;
+
+    uintmax_t total = 0;
+    for (int i = 0; i < (nfiles ? nfiles : 1); i++) {
+        const char *name = nfiles && strcmp(files[i], "-") != 0 ? files[i] : "(standard input)";
+        int fd = open_text_input("match", nfiles ? files[i] : NULL);
+        if (fd == -1) continue;
+        uintmax_t selected = 0;
+        if (match_input(&m, fd, name, &selected) == -1) {
+            out_printf(wsh_err, "wsh: match: %s: %s\n", name, strerror(errno));
+        }
+        close_text_input(fd);
+        total += selected;
+        if (m.list_only) {
+            if (selected) out_printf(wsh_out, "%s\n", name);
+        } else if (m.count_only) {
+            if (m.show_names) out_printf(wsh_out, "%s:", name);
+            out_printf(wsh_out, "%ju\n", selected);
+        }
+    }
+
+    // Nothing selected is a failure without a message, as with grep
+    if (total == 0) builtin_errors++;
+    free(m.ac.next);
+    free(m.ac.accept);
+    free(m.patterns);
+    free(m.lengths);
+    free(m.hits);
+    return 1;
+}
+
+/**
+ * @brief Built-in command: braces WORD...
+ * 
+ * Prints each word's brace expansion one word per line, generating ranges
+ * as it goes: `braces {1..100000000} >file` never holds the list. The
+ * words reach it unexpanded.
+ */
+int wsh_braces(char **args) {
+    for (int i = 1; args[i]; i++) {
+        BraceWord word = {NULL, 0};
+        parse_brace_word(args[i], strlen(args[i]), &word);
+        size_t words, longest;
+        brace_size(&word, &words, NULL, &longest);
+        char *buf = malloc(longest + 1);
+        if (!buf) {
+            out_printf(wsh_err, "wsh: braces: allocation error\n");
+            brace_free(&word);
+            return 1;
+        }
+        BraceSink sink = {NULL, NULL, 0};
+        brace_emit(&word, 0, NULL, buf, 0, &sink);
+        free(buf);
+        brace_free(&word);
+    }
+    return 1;
+}
+
+/**
+ * @brief Drops a reference to a cached sourced file, freeing it at zero.
+ */
+static void release_sourced_script(SourcedScript *sourced) {
+    if (--sourced->refs > 0) return;
+    for (size_t i = 0; i < sourced->count; i++) {
+        free_tokens(sourced->lines[i]);
+    }
+    free(sourced->lines);
+    free(sourced);
+}
+
+/**
+ * @brief Reads and tokenizes a file for `source`.
+ * 
+ * @return SourcedScript* The tokenized file, or NULL on error.
+ */
+static SourcedScript *load_sourced_script(FILE *fp, const struct stat *st) {
+    SourcedScript *sourced = calloc(1, sizeof(SourcedScript));
+    if (!sourced) return NULL;
+    sourced->dev = st->st_dev;
+    sourced->ino = st->st_ino;
+    sourced->mtime = st->st_mtim;
+    sourced->size = st->st_size;
+    sourced->refs = 1;
+
+    size_t capacity = 0;
+    char *line;
+    while ((line = read_line(fp)) != NULL) {
+        // Comments and blank lines are dropped once, here
+        char *trimmed = line;
+        while (*trimmed == ' ' || *trimmed == '\t') trimmed++;
+        if (*trimmed == '#' || *trimmed == '\0' || *trimmed == '\n') {
+            free(line);
+            continue;
+        }
+        char **raw = tokenize_line(trimmed);
+        free(line);
+        if (!raw[0]) {
+            free_tokens(raw);
+            continue;
+        }
+        if (sourced->count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            char ***grown = realloc(sourced->lines, capacity * sizeof(char**));
+            if (!grown) {
+                free_tokens(raw);
+                release_sourced_script(sourced);
+                return NULL;
+            }
+            sourced->lines = grown;
+        }
+        sourced->lines[sourced->count++] = raw;
+    }
+    return sourced;
+}
+
+/**
+ * @brief Built-in command: run a file in the current shell.
+ * 
+ * Files are tokenized once and cached by device and inode; the cached copy
+ * is reused while the file's mtime and size are unchanged, so repeated
+ * sourcing only pays for variable substitution.
+ */
+int wsh_source(char **args) {
+    if (args[1] == NULL) {
+        out_printf(wsh_err, "wsh: %s requires a file\n", args[0]);
+        return 1;
+    }
+    if (source_depth >= MAX_SOURCE_DEPTH) {
+        out_printf(wsh_err, "wsh: %s: too many nested source calls\n", args[1]);
+        return 1;
+    }
+
+    struct stat st;
+    if (stat(args[1], &st) != 0) {
+        out_perror("wsh");
+        return 1;
+    }
+
+    char key[64];
+    snprintf(key, sizeof(key), "%llx:%llx", (unsigned long long)st.st_dev, (unsigned long long)st.st_ino);
+    void *cached = NULL;
+    SourcedScript *sourced = NULL;
+    if (strmap_get(&source_cache, key, &cached)) {
+        sourced = cached;
+        if (sourced->size != st.st_size || sourced->mtime.tv_sec != st.st_mtim.tv_sec
+            || sourced->mtime.tv_nsec != st.st_mtim.tv_nsec) {
+            sourced = NULL;
+        }
+    }
+
+    if (!sourced) {
+        FILE *fp = fopen(args[1], "r");
+        if (!fp) {
+            out_perror("wsh");
+            return 1;
+        }
+        sourced = load_sourced_script(fp, &st);
+        fclose(fp);
+        if (!sourced) {
+            out_printf(wsh_err, "wsh: allocation error for %s\n", args[1]);
+            return 1;
+        }
+        if (strmap_put(&source_cache, key, sourced) == -1) {
+            release_sourced_script(sourced);
+            out_printf(wsh_err, "wsh: allocation error for %s\n", args[1]);
+            return 1;
+        }
+        if (cached) {
+            // The stale copy may still be running in an outer `source`
+            release_sourced_script(cached);
+        }
+    }
+
+    sourced->refs++;
+    source_depth++;
+    int status = 1;
+    for (size_t i = 0; i < sourced->count && status; i++) {
+        char **line_args = expand_tokens(sourced->lines[i]);
+        status = execute_command(line_args);
+        free_tokens(line_args);
+    }
+    source_depth--;
+    release_sourced_script(sourced);
+    return status;
+}
+
+/**
+ * @brief Displays the shell prompt.
+ */
+void display_prompt(void) {
+    printf("wsh> ");
+    fflush(stdout);
+}
+
+/**
+ * @brief Reads a line of input from the user or batch file.
+ * 
+ * @param input_stream The input stream to read from.
+ * @return char* The input line.
+ */
+char *read_line(FILE *input_stream) {
+    char *line = NULL;
+    size_t bufsize = 0; // getline allocates buffer
+    ssize_t nread;
+
+    nread = getline(&line, &bufsize, input_stream);
+    if (nread == -1) {
+        free(line);
+        return NULL;
+    }
+
+    return line;
+}
+
+/**
+ * @brief Finds a name in one of the snapshot's hash tables.
+ * 
+ * @return int64_t The entry index, or -1 if absent.
+ */
+static int64_t snapshot_find(uint64_t table, uint32_t slots, uint64_t entries, const char *name) {
+    if (!snapshot.base || slots == 0) return -1;
+    const uint32_t *hash_table = (const uint32_t *)(snapshot.base + table);
+    const SnapshotEntry *entry_list = (const SnapshotEntry *)(snapshot.base + entries);
+    size_t mask = slots - 1;
+    for (size_t i = strmap_hash(name) & mask; hash_table[i]; i = (i + 1) & mask) {
+        uint32_t index = hash_table[i] - 1;
+        if (strcmp(snapshot.base + entry_list[index].name, name) == 0) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Finds a shell variable in the loaded snapshot.
+ * 
+ * @return int64_t The entry index, or -1 if absent.
+ */
+static int64_t snapshot_find_variable(const char *name) {
+    if (!snapshot.base) return -1;
+    return snapshot_find(snapshot.header->var_table, snapshot.header->var_slots,
+                         snapshot.header->vars, name);
+}
+
+/**
+ * @brief Looks up a shell variable's current value in the loaded snapshot.
+ */
+static const char *snapshot_lookup_variable(const char *name) {
+    int64_t index = snapshot_find_variable(name);
+    if (index < 0) return NULL;
+    if (snapshot.overrides && snapshot.overrides[index]) {
+        return snapshot.overrides[index];
+    }
+    const SnapshotEntry *entries = (const SnapshotEntry *)(snapshot.base + snapshot.header->vars);
+    return snapshot.base + entries[index].value;
+}
+
+// Growable buffer a snapshot is assembled in before it is written
+typedef struct SnapshotBuilder {
+    char *data;
+    size_t size;
+    size_t capacity;
+    int failed;
+    SnapshotEntry *entries;   // entries collected for the current table
+    uint32_t count;
+    uint32_t entries_capacity;
+} SnapshotBuilder;
+
+/**
+ * @brief Appends bytes to the snapshot, 8-byte aligned, returning their offset.
+ */
+static uint64_t snapshot_append(SnapshotBuilder *b, const void *data, size_t len) {
+    size_t offset = (b->size + 7) & ~(size_t)7;
+    if (offset + len > b->capacity) {
+        size_t capacity = b->capacity ? b->capacity : 4096;
+        while (offset + len > capacity) capacity *= 2;
+        char *grown = realloc(b->data, capacity);
+        if (!grown) {
+            b->failed = 1;
+            return 0;
+        }
+        b->data = grown;
+        b->capacity = capacity;
+    }
+    memset(b->data + b->size, 0, offset - b->size);
+    if (data) memcpy(b->data + offset, data, len);
+    b->size = offset + len;
+    return offset;
+}
+
+/**
+ * @brief Appends a NUL-terminated string without padding, returning its offset.
+ */
+static uint64_t snapshot_string(SnapshotBuilder *b, const char *str) {
+    size_t len = strlen(str) + 1;
+    if (b->size + len > b->capacity) {
+        // Let snapshot_append() grow the buffer, then drop its alignment
+        size_t saved = b->size;
+        snapshot_append(b, NULL, len);
+        b->size = saved;
+        if (b->failed) return 0;
+    }
+    memcpy(b->data + b->size, str, len);
+    b->size += len;
+    return b->size - len;
+}
+
+/**
+ * @brief Collects a name/value entry for the table being built.
+ */
+static void snapshot_add_entry(const char *name, const char *value, void *ctx) {
+    SnapshotBuilder *b = ctx;
+    if (b->count == b->entries_capacity) {
+        uint32_t capacity = b->entries_capacity ? b->entries_capacity * 2 : 64;
+        SnapshotEntry *grown = realloc(b->entries, capacity * sizeof(SnapshotEntry));
+        if (!grown) {
+            b->failed = 1;
+            return;
+        }
+        b->entries = grown;
+        b->entries_capacity = capacity;
+    }
+    b->entries[b->count].name = snapshot_string(b, name);
+    b->entries[b->count].value = snapshot_string(b, value);
+    b->count++;
+}
+
+/**
+ * @brief Writes the collected entries and a hash table over them.
+ */
+static void snapshot_emit_table(SnapshotBuilder *b, uint64_t *entries, uint64_t *table, uint32_t *slots) {
+    *slots = 16;
+    while (*slots < b->count * 2) *slots *= 2;
+    uint32_t *hash_table = calloc(*slots, sizeof(uint32_t));
+    if (!hash_table) {
+        b->failed = 1;
+        return;
+    }
+    for (uint32_t i = 0; i < b->count && !b->failed; i++) {
+        size_t mask = *slots - 1;
+        size_t slot = strmap_hash(b->data + b->entries[i].name) & mask;
+        while (hash_table[slot]) slot = (slot + 1) & mask;
+        hash_table[slot] = i + 1;
+    }
+    *entries = snapshot_append(b, b->entries, b->count * sizeof(SnapshotEntry));
+    *table = snapshot_append(b, hash_table, *slots * sizeof(uint32_t));
+    free(hash_table);
+    b->count = 0;
+}
+
+/**
+ * @brief Saves variables, environment, history, cwd and the path cache.
+ * 
+ * @param path The snapshot file to write.
+ * @return int 0 on success, -1 on error.
+ */
+int save_state(const char *path) {
+    SnapshotBuilder b = {NULL, 0, 0, 0, NULL, 0, 0};
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    snapshot_append(&b, &header, sizeof(header));
+
+    header.cwd = snapshot_string(&b, current_directory() ? current_directory() : "");
+
+    for_each_variable(snapshot_add_entry, &b);
+    header.var_count = b.count;
+    snapshot_emit_table(&b, &header.vars, &header.var_table, &header.var_slots);
+
+    extern char **environ;
+    size_t env_count = 0;
+    while (environ && environ[env_count]) env_count++;
+    uint64_t *offsets = malloc((env_count + history.count + 1) * sizeof(uint64_t));
+    if (!offsets) {
+        b.failed = 1;
+    } else {
+        for (size_t i = 0; i < env_count; i++) {
+            offsets[i] = snapshot_string(&b, environ[i]);
+        }
+        header.env_count = env_count;
+        header.env = snapshot_append(&b, offsets, env_count * sizeof(uint64_t));
+
+        for (int i = 0; i < history.count; i++) {
+            offsets[i] = snapshot_string(&b, history.commands[(history.start + i) % history.capacity]);
+        }
+        header.history_capacity = history.capacity;
+        header.history_count = history.count;
+        header.history = snapshot_append(&b, offsets, history.count * sizeof(uint64_t));
+        free(offsets);
+    }
+
+    // Cached command paths, including still-valid ones from a loaded snapshot
+    header.path_env = snapshot_string(&b, path_cache_env ? path_cache_env : "");
+    for (size_t i = 0; i < path_cache.capacity; i++) {
+        if (path_cache.keys[i]) {
+            snapshot_add_entry(path_cache.keys[i], path_cache.values[i], &b);
+        }
+    }
+    if (snapshot.paths_valid) {
+        const SnapshotEntry *entries = (const SnapshotEntry *)(snapshot.base + snapshot.header->paths);
+        for (uint32_t i = 0; i < snapshot.header->path_count; i++) {
+            const char *name = snapshot.base + entries[i].name;
+            if (!strmap_get(&path_cache, name, NULL)) {
+                snapshot_add_entry(name, snapshot.base + entries[i].value, &b);
+            }
+        }
+    }
+    header.path_count = b.count;
+    snapshot_emit_table(&b, &header.paths, &header.path_table, &header.path_slots);
+
+    // A final NUL lets the loader know every string ends inside the file
+    snapshot_string(&b, "");
+
+    free(b.entries);
+    if (b.failed) {
+        fprintf(stderr, "wsh: allocation error when saving state\n");
+        free(b.data);
+        return -1;
+    }
+    header.size = b.size;
+    memcpy(b.data, &header, sizeof(header));
+
+    // Write to a temporary file and rename so readers never see a partial snapshot
+    size_t tmp_len = strlen(path) + 5;
+    char *tmp_path = malloc(tmp_len);
+    int fd = -1;
+    if (tmp_path) {
+        snprintf(tmp_path, tmp_len, "%s.tmp", path);
+        fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    int failed = fd == -1;
+    for (size_t written = 0; !failed && written < b.size; ) {
+        ssize_t n = write(fd, b.data + written, b.size - written);
+        if (n <= 0) {
+            failed = 1;
+        } else {
+            written += n;
+        }
+    }
+    if (fd != -1 && close(fd) != 0) {
+        failed = 1;
+    }
+    if (failed || rename(tmp_path, path) != 0) {
+        perror("wsh: save state");
+        if (tmp_path) unlink(tmp_path);
+        failed = 1;
+    }
+    free(tmp_path);
+    free(b.data);
+    return failed ? -1 : 0;
+}
+
+/**
+ * @brief Tells whether count items of item_size at offset lie inside the file, 8-byte aligned as written.
+ */
+static int snapshot_range_valid(uint64_t offset, uint64_t count, size_t item_size, size_t size) {
+    return offset % sizeof(uint64_t) == 0 && offset <= size && count <= (size - offset) / item_size;
+}
+
+/**
+ * @brief Tells whether a hash table's slots are a power of two, index real entries and leave one empty.
+ */
+static int snapshot_table_valid(const char *base, uint64_t table, uint32_t slots, uint32_t count) {
+    if (slots == 0) return 1;
+    if (slots & (slots - 1)) return 0;
+    const uint32_t *hash_table = (const uint32_t *)(base + table);
+    int empty = 0;
+    for (uint32_t i = 0; i < slots; i++) {
+        if (hash_table[i] > count) return 0;
+        if (hash_table[i] == 0) empty = 1;
+    }
+    // Probing stops at an empty slot, so a full table would never end
+    return empty;
+}
+
+/**
+ * @brief Checks a mapped snapshot before any offset in it is followed.
+ *
+ * Every array must lie inside the file, every string offset must point
+ * into it, and the file must end in a NUL, so every string it holds is
+ * terminated before the end of the mapping.
+ */
+static int snapshot_valid(const char *base, size_t size) {
+    const SnapshotHeader *header = (const SnapshotHeader *)base;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0
+        || header->version != SNAPSHOT_VERSION || header->size != size || base[size - 1] != '\0'
+        || !snapshot_range_valid(header->vars, header->var_count, sizeof(SnapshotEntry), size)
+        || !snapshot_range_valid(header->var_table, header->var_slots, sizeof(uint32_t), size)
+        || !snapshot_range_valid(header->env, header->env_count, sizeof(uint64_t), size)
+        || !snapshot_range_valid(header->history, header->history_count, sizeof(uint64_t), size)
+        || !snapshot_range_valid(header->paths, header->path_count, sizeof(SnapshotEntry), size)
+        || !snapshot_range_valid(header->path_table, header->path_slots, sizeof(uint32_t), size)
+        || header->path_env >= size || header->cwd >= size
+        || header->history_capacity == 0 || header->history_count > header->history_capacity
+        || !snapshot_table_valid(base, header->var_table, header->var_slots, header->var_count)
+        || !snapshot_table_valid(base, header->path_table, header->path_slots, header->path_count)) {
+        return 0;
+    }
+
+    const SnapshotEntry *vars = (const SnapshotEntry *)(base + header->vars);
+    for (uint32_t i = 0; i < header->var_count; i++) {
+        if (vars[i].name >= size || vars[i].value >= size) return 0;
+    }
+    const SnapshotEntry *paths = (const SnapshotEntry *)(base + header->paths);
+    for (uint32_t i = 0; i < header->path_count; i++) {
+        if (paths[i].name >= size || paths[i].value >= size) return 0;
+    }
+    const uint64_t *env = (const uint64_t *)(base + header->env);
+    for (uint32_t i = 0; i < header->env_count; i++) {
+        if (env[i] >= size) return 0;
+    }
+    const uint64_t *commands = (const uint64_t *)(base + header->history);
+    for (uint32_t i = 0; i < header->history_count; i++) {
+        if (commands[i] >= size) return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Maps a snapshot and adopts its state in place.
+ * 
+ * Variables and cached paths are looked up through the snapshot's hash
+ * tables; history and environment strings point into the mapping.
+ * 
+ * @param path The snapshot file.
+ * @return int 0 on success, -1 on error.
+ */
+int load_state(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("wsh: load state");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        fprintf(stderr, "wsh: %s is not a state snapshot\n", path);
+        close(fd);
+        return -1;
+    }
+    char *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("wsh: load state");
+        return -1;
+    }
+
+    // Validate everything once; the offsets it holds are trusted after this
+    const SnapshotHeader *header = (const SnapshotHeader *)base;
+    size_t size = st.st_size;
+    if (!snapshot_valid(base, size)) {
+        fprintf(stderr, "wsh: %s is not a valid state snapshot\n", path);
+        munmap(base, size);
+        return -1;
+    }
+
+    char **env = malloc((header->env_count + 1) * sizeof(char*));
+    char **commands = calloc(header->history_capacity, sizeof(char*));
+    if (!env || !commands) {
+        fprintf(stderr, "wsh: allocation error when loading state\n");
+        free(env);
+        free(commands);
+        munmap(base, size);
+        return -1;
+    }
+
+    if (snapshot.base) {
+        fprintf(stderr, "wsh: a state snapshot is already loaded\n");
+        free(env);
+        free(commands);
+        munmap(base, size);
+        return -1;
+    }
+    snapshot.base = base;
+    snapshot.size = size;
+    snapshot.header = header;
+
+    // The environment array is the only per-entry work: one pointer each
+    extern char **environ;
+    const uint64_t *env_offsets = (const uint64_t *)(base + header->env);
+    for (uint32_t i = 0; i < header->env_count; i++) {
+        env[i] = base + env_offsets[i];
+    }
+    env[header->env_count] = NULL;
+    clearenv();
+    strmap_clear(&env_strings, free);
+    snapshot.environ = env;
+    environ = env;
+
+    const uint64_t *history_offsets = (const uint64_t *)(base + header->history);
+    for (int i = 0; i < history.capacity; i++) {
+        free_string(history.commands[i]);
+    }
+    free(history.commands);
+    for (uint32_t i = 0; i < header->history_count; i++) {
+        commands[i] = base + history_offsets[i];
+    }
+    history.commands = commands;
+    history.capacity = header->history_capacity;
+    history.count = header->history_count;
+    history.start = 0;
+
+    // Force resolve_command() to compare PATH with the snapshot's
+    free(path_cache_env);
+    path_cache_env = NULL;
+
+    if (base[header->cwd] && change_directory(base + header->cwd) != 0) {
+        perror("wsh: load state");
+    }
+    return 0;
+}
+
+/**
+ * @brief Reports a pre-flight problem for a script line.
+ */
+static void preflight_report(const char *script, long line_no, const char *fmt, const char *arg) {
+    fprintf(stderr, "wsh: %s:%ld: ", script, line_no);
+    fprintf(stderr, fmt, arg);
+    fputc('\n', stderr);
+}
+
+/**
+ * @brief Validates a whole batch script without running any of its commands.
+ * 
+ * Every line is tokenized and its command resolved against the built-ins and
+ * PATH, redirection inputs must exist and outputs must be writable, and
+ * variables must be set before use. `cd`, `local` and `export` are applied so
+ * later lines are checked against the state the script would have built.
+ * 
+ * @param fp The open batch script.
+ * @param script The script's name, for reports.
+ * @return int The number of problems found.
+ */
+int preflight_script(FILE *fp, const char *script) {
+    StrMap missing = {NULL, NULL, 0, 0};   // commands known not to resolve
+    StrMap writable = {NULL, NULL, 0, 0};  // output paths already checked
+    StrMap created = {NULL, NULL, 0, 0};   // files the script will create
+    StrMap readable = {NULL, NULL, 0, 0};  // input paths already checked
+    char cwd[PATH_MAX];
+    char *path_env = NULL;
+    int problems = 0;
+    long line_no = 0;
+    char *line = NULL;
+    size_t bufsize = 0;
+
+    // Reports can number in the thousands; write them in blocks
+    static char report_buffer[1 << 16];
+    setvbuf(stderr, report_buffer, _IOFBF, sizeof(report_buffer));
+    snprintf(cwd, sizeof(cwd), "%s", current_directory() ? current_directory() : "");
+
+    while (getline(&line, &bufsize, fp) != -1) {
+        line_no++;
+
+        char *trimmed = line;
+        while (*trimmed == ' ' || *trimmed == '\t') trimmed++;
+        if (*trimmed == '#' || *trimmed == '\0' || *trimmed == '\n') {
+            continue;
+        }
+
+        // Undefined variables are only visible before substitution
+        char *copy = strdup(trimmed);
+        if (!copy) {
+            fprintf(stderr, "wsh: allocation error\n");
             break;
         }
-        i++;
+        int is_local = 0;
+        char clock_value[32];
+        for (char *token = strtok(copy, DELIMITERS); token; token = strtok(NULL, DELIMITERS)) {
+            char *name = NULL;
+            if (token[0] == '$') {
+                name = token + 1;
+            } else if (is_local && strchr(token, '=') && strchr(token, '=')[1] == '$') {
+                // `local` substitutes its value as well
+                name = strchr(token, '=') + 2;
+            }
+            if (name && name[0] == '(') {
+                // $(...) runs a command and $(<FILE) reads a file rather than a variable
+            } else if (name && *name && !lookup_variable(name)
+                       && !time_variable(name, clock_value, sizeof(clock_value))) {
+                preflight_report(script, line_no, "undefined variable: %s", name);
+                problems++;
+            }
+            is_local = token == copy && strcmp(token, "local") == 0;
+        }
+        free(copy);
+
+        // Variables only: a dry run never runs a $(...)
+        char **args = split_line(trimmed, 1);
+
+        char *input, *output;
+        int append, redirect_stderr;
+        parse_redirection(args, &input, &output, &append, &redirect_stderr);
+
+        // VAR=x prefixes only reach the command after them; alone they set variables
+        char **command = args;
+        int assignments = 0;
+        while (command[0] && is_assignment(command[0])) {
+            command++;
+            assignments++;
+        }
+        if (assignments > 0 && !command[0]) {
+            assign_shell_variables(args, assignments);
+        }
+
+        // ratelimit's command is checked like any other
+        if (command[0] && strcmp(command[0], "ratelimit") == 0) {
+            RateLimit limit;
+            const char *error = parse_rate_limit(command, &limit);
+            if (error) {
+                preflight_report(script, line_no, "ratelimit: %s", error);
+                problems++;
+                while (command[0]) command++;
+            } else {
+                command = limit.command;
+                while (command[0] && is_assignment(command[0])) command++;
+            }
+        }
+
+        if (command[0] && strcmp(command[0], "cd") == 0) {
+            if (command[1] && change_directory(command[1]) != 0) {
+                preflight_report(script, line_no, "cd: cannot change directory to %s", command[1]);
+                problems++;
+            } else if (command[1]) {
+                snprintf(cwd, sizeof(cwd), "%s", current_directory() ? current_directory() : "");
+            }
+        } else if (command[0] && (strcmp(command[0], "local") == 0 || strcmp(command[0], "export") == 0)) {
+            // Applying assignments here is safe: nothing else runs in -n mode
+            if (command[1] && strchr(command[1], '=')) {
+                (strcmp(command[0], "local") == 0 ? wsh_local_cmd : wsh_export)(command);
+            }
+        } else if (command[0]) {
+            int builtin = 0;
+            for (int i = 0; i < num_builtins(); i++) {
+                if (strcmp(command[0], builtin_str[i]) == 0) {
+                    builtin = 1;
+                    break;
+                }
+            }
+
+            // Remember misses per PATH value so repeated typos stay cheap
+            char *current_path = getenv("PATH");
+            if (!path_env || !current_path || strcmp(path_env, current_path) != 0) {
+                strmap_clear(&missing, NULL);
+                free(path_env);
+                path_env = current_path ? strdup(current_path) : NULL;
+            }
+            if (!builtin && !strmap_get(&missing, command[0], NULL)) {
+                const char *executable = resolve_command(command[0]);
+                if (!executable || (executable == command[0] && access(executable, X_OK) != 0)) {
+                    strmap_put(&missing, command[0], NULL);
+                }
+            }
+            if (!builtin && strmap_get(&missing, command[0], NULL)) {
+                preflight_report(script, line_no, "command not found: %s", command[0]);
+                problems++;
+            }
+        }
+
+        // Redirection targets are checked relative to the simulated cwd
+        char resolved[PATH_MAX];
+        char *target = input ? input : output;
+        if (target && *target) {
+            int len;
+            if (target[0] == '/' || cwd[0] == '\0') {
+                len = snprintf(resolved, sizeof(resolved), "%s", target);
+            } else {
+                len = snprintf(resolved, sizeof(resolved), "%s/%s", cwd, target);
+            }
+            if (len >= (int)sizeof(resolved)) {
+                preflight_report(script, line_no, "redirection path too long: %s", target);
+                problems++;
+                input = output = NULL;
+            }
+        }
+        if ((input && !*input) || (output && !*output)) {
+            preflight_report(script, line_no, "%s", "missing redirection target");
+            problems++;
+        } else if (input && !strmap_get(&created, resolved, NULL) && !strmap_get(&readable, resolved, NULL)) {
+            if (access(resolved, R_OK) == 0) {
+                strmap_put(&readable, resolved, NULL);
+            } else {
+                preflight_report(script, line_no, "cannot read redirection input %s", input);
+                problems++;
+            }
+        } else if (output && !strmap_get(&writable, resolved, NULL)) {
+            int ok = access(resolved, W_OK) == 0;
+            if (!ok && errno == ENOENT) {
+                // A new file needs a writable directory
+                char *slash = strrchr(resolved, '/');
+                if (slash == resolved) {
+                    ok = access("/", W_OK | X_OK) == 0;
+                } else if (slash) {
+                    *slash = '\0';
+                    ok = access(resolved, W_OK | X_OK) == 0;
+                    *slash = '/';
+                } else {
+                    ok = access(".", W_OK | X_OK) == 0;
+                }
+            }
+            if (ok) {
+                strmap_put(&writable, resolved, NULL);
+                strmap_put(&created, resolved, NULL);
+            } else {
+                preflight_report(script, line_no, "cannot write redirection output %s", output);
+                problems++;
+            }
+        }
+
+        free_tokens(args);
+    }
+
+    fflush(stderr);
+    setvbuf(stderr, NULL, _IONBF, 0);
+    free(line);
+    free(path_env);
+    strmap_clear(&readable, NULL);
+    strmap_clear(&missing, NULL);
+    strmap_clear(&writable, NULL);
+    strmap_clear(&created, NULL);
+    return problems;
+}
+
+/**
+ * @brief Classifies a line's words for --lint-perf.
+ * 
+ * @param command Receives the words of the command that runs: past VAR=x
+ *        prefixes and a ratelimit prefix.
+ */
+static LintClass lint_classify(char **words, char ***command) {
+    while (words[0] && is_assignment(words[0])) words++;
+    if (words[0] && strcmp(words[0], "ratelimit") == 0) {
+        RateLimit limit;
+        if (parse_rate_limit(words, &limit)) {
+            words += 1;
+            while (words[0]) words++;
+        } else {
+            words = limit.command;
+            while (words[0] && is_assignment(words[0])) words++;
+        }
+    }
+    *command = words;
+    if (!words[0]) return LINT_INTERNAL;
+    if (strcmp(words[0], "history") == 0 && words[1] && atoi(words[1]) > 0) return LINT_DYNAMIC;
+    return is_builtin(words[0]) ? LINT_BUILTIN : LINT_EXTERNAL;
+}
+
+/**
+ * @brief Counts the $(...) on a line that run a command, one fork each.
+ */
+static long lint_substitutions(const char *line) {
+    long count = 0;
+    for (const char *p = line; (p = strstr(p, "$(")) != NULL; p += 2) {
+        if (p[2] != '<') count++;
+    }
+    return count;
+}
+
+/**
+ * @brief Returns a cheaper way to do what an external command does, or NULL.
+ */
+static const char *lint_equivalent(char **command) {
+    const char *slash = strrchr(command[0], '/');
+    const char *name = slash ? slash + 1 : command[0];
+    if (slash && is_builtin(name)) {
+        return "it is also a builtin; without the path it runs in-process";
+    }
+    if (strcmp(name, "cat") == 0) {
+        return "`tee <FILE` copies a file in-process, and `$(<FILE)` reads one into a variable";
+    }
+    if (strcmp(name, "fgrep") == 0) {
+        return "the match builtin finds fixed strings in-process";
+    }
+    if (strcmp(name, "grep") == 0) {
+        for (int i = 1; command[i]; i++) {
+            if (strcmp(command[i], "-F") == 0 || strcmp(command[i], "--fixed-strings") == 0) {
+                return "the match builtin finds fixed strings in-process";
+            }
+        }
+    }
+    if (strcmp(name, "seq") == 0) {
+        return "`braces {FIRST..LAST}` prints a range in-process";
+    }
+    if (strcmp(name, "printenv") == 0 || strcmp(name, "basename") == 0 || strcmp(name, "dirname") == 0) {
+        return "its result is fixed for the run; compute it once into a variable";
+    }
+    return NULL;
+}
+
+/**
+ * @brief Counts the forks one run of a sourced file costs, including files it sources.
+ * 
+ * @param seen Results by path, so a file sourced many times is read once.
+ * @return long The forks, or -1 if the file cannot be read.
+ */
+static long lint_file_forks(const char *path, int depth, StrMap *seen) {
+    void *known;
+    if (strmap_get(seen, path, &known)) return (long)(intptr_t)known - 1;
+    if (depth >= MAX_SOURCE_DEPTH) return 0;
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+
+    // A file that sources itself counts once
+    strmap_put(seen, path, (void *)(intptr_t)1);
+    long forks = 0;
+    char *line = NULL;
+    size_t bufsize = 0;
+    while (getline(&line, &bufsize, fp) != -1) {
+        char *trimmed = line;
+        while (*trimmed == ' ' || *trimmed == '\t') trimmed++;
+        if (*trimmed == '#' || *trimmed == '\0' || *trimmed == '\n') continue;
+        forks += lint_substitutions(trimmed);
+        char **words = tokenize_line(trimmed);
+        char **command;
+        LintClass class = lint_classify(words, &command);
+        if (class == LINT_EXTERNAL) {
+            forks++;
+        } else if (class == LINT_BUILTIN && command[1] && command[1][0] != '$'
+                   && (strcmp(command[0], "source") == 0 || strcmp(command[0], ".") == 0)) {
+            long nested = lint_file_forks(command[1], depth + 1, seen);
+            if (nested > 0) forks += nested;
+        }
+        free_tokens(words);
+    }
+    free(line);
+    fclose(fp);
+    strmap_put(seen, path, (void *)(intptr_t)(forks + 1));
+    return forks;
+}
+
+/**
+ * @brief Orders offenders by forks per run, most first, then by line.
+ */
+static int lint_compare(const void *a, const void *b) {
+    const LintCommand *x = *(LintCommand *const *)a;
+    const LintCommand *y = *(LintCommand *const *)b;
+    if (x->forks != y->forks) return x->forks < y->forks ? 1 : -1;
+    return x->lines[0] < y->lines[0] ? -1 : x->lines[0] > y->lines[0];
+}
+
+/**
+ * @brief Orders offenders by their first line.
+ */
+static int lint_compare_lines(const void *a, const void *b) {
+    const LintCommand *x = *(LintCommand *const *)a;
+    const LintCommand *y = *(LintCommand *const *)b;
+    return x->lines[0] < y->lines[0] ? -1 : x->lines[0] > y->lines[0];
+}
+
+/**
+ * @brief Reports what each line of a script costs to run and which lines fork most.
+ * 
+ * Every line is classified as shell-internal, builtin, external or dynamic without
+ * running anything but cd. Sourced files are read to count their forks. Repeated
+ * identical programs and programs with in-process equivalents are called out.
+ * 
+ * @param fp The open batch script.
+ * @param script The script's name, for reports.
+ * @return long The estimated forks per run.
+ */
+long lint_perf_script(FILE *fp, const char *script) {
+    static const char *class_names[] = {"internal", "builtin", "external", "dynamic"};
+    StrMap commands = {NULL, NULL, 0, 0};   // LintCommand by line text
+    StrMap seen = {NULL, NULL, 0, 0};       // forks of sourced files by path
+    long counts[4] = {0, 0, 0, 0};
+    long forks = 0, sourced_forks = 0;
+    long line_no = 0;
+    char *line = NULL;
+    size_t bufsize = 0;
+
+    printf("%5s  %-8s  %s\n", "line", "class", "command");
+    while (getline(&line, &bufsize, fp) != -1) {
+        line_no++;
+        char *trimmed = line;
+        while (*trimmed == ' ' || *trimmed == '\t') trimmed++;
+        if (*trimmed == '#' || *trimmed == '\0' || *trimmed == '\n') continue;
+        size_t len = strlen(trimmed);
+        if (trimmed[len - 1] == '\n') trimmed[--len] = '\0';
+
+        char *text = strdup(trimmed);
+        if (!text) {
+            fprintf(stderr, "wsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        char **words = tokenize_line(trimmed);
+        char **command;
+        LintClass class = lint_classify(words, &command);
+        counts[class]++;
+
+        long line_forks = class == LINT_EXTERNAL;
+        const char *hint = NULL;
+        int sources = class == LINT_BUILTIN && command[1] && command[1][0] != '$'
+            && (strcmp(command[0], "source") == 0 || strcmp(command[0], ".") == 0);
+        if (class == LINT_EXTERNAL && command[0][0] != '$') {
+            hint = lint_equivalent(command);
+        }
+        if (class == LINT_BUILTIN && strcmp(command[0], "cd") == 0 && command[1] && command[1][0] != '$') {
+            // Follow cd so sourced files are found; nothing else runs here
+            change_directory(command[1]);
+        }
+        if (sources) {
+            line_forks = lint_file_forks(command[1], 1, &seen);
+            if (line_forks < 0) {
+                printf("%5ld  %-8s  %s  (not read: %s)\n", line_no, class_names[class], text, strerror(errno));
+                line_forks = 0;
+            } else {
+                printf("%5ld  %-8s  %s  (%ld forks)\n", line_no, class_names[class], text, line_forks);
+            }
+            sourced_forks += line_forks;
+        } else {
+            printf("%5ld  %-8s  %s\n", line_no, class_names[class], text);
+        }
+        line_forks += lint_substitutions(text);
+        forks += line_forks;
+
+        if (line_forks > 0) {
+            void *value;
+            LintCommand *entry;
+            if (strmap_get(&commands, text, &value)) {
+                entry = value;
+            } else {
+                entry = calloc(1, sizeof(LintCommand));
+                if (!entry || strmap_put(&commands, text, entry) == -1) {
+                    fprintf(stderr, "wsh: allocation error\n");
+                    exit(EXIT_FAILURE);
+                }
+                entry->hint = hint;
+                entry->external = class == LINT_EXTERNAL;
+            }
+            if (entry->count < LINT_LINES_SHOWN) entry->lines[entry->count] = line_no;
+            entry->count++;
+            entry->forks += line_forks;
+        }
+        free_tokens(words);
+        free(text);
+    }
+    free(line);
+
+    printf("\n%ld lines: %ld builtin, %ld external, %ld shell-internal",
+           counts[LINT_BUILTIN] + counts[LINT_EXTERNAL] + counts[LINT_INTERNAL] + counts[LINT_DYNAMIC],
+           counts[LINT_BUILTIN], counts[LINT_EXTERNAL], counts[LINT_INTERNAL]);
+    if (counts[LINT_DYNAMIC] > 0) printf(", %ld dynamic (not counted)", counts[LINT_DYNAMIC]);
+    printf("\n");
+    printf("estimated forks per run: %ld", forks);
+    if (sourced_forks > 0) printf(" (%ld from sourced files)", sourced_forks);
+    printf("\n");
+
+    // Offenders, most forks first; the map's keys double as their text
+    LintCommand **sorted = malloc((commands.count + 1) * sizeof(LintCommand *));
+    if (!sorted) {
+        fprintf(stderr, "wsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < commands.capacity; i++) {
+        if (commands.keys[i]) {
+            LintCommand *entry = commands.values[i];
+            entry->text = commands.keys[i];
+            sorted[n++] = entry;
+        }
+    }
+    qsort(sorted, n, sizeof(LintCommand *), lint_compare);
+
+    if (n > 0) {
+        printf("\ntop offenders (forks per run):\n");
+    }
+    for (size_t i = 0; i < n && i < LINT_TOP_OFFENDERS; i++) {
+        printf("%7ld  %s  (line", sorted[i]->forks, sorted[i]->text);
+        printf(sorted[i]->count > 1 ? "s " : " ");
+        for (long k = 0; k < sorted[i]->count && k < LINT_LINES_SHOWN; k++) {
+            printf("%s%ld", k ? ", " : "", sorted[i]->lines[k]);
+        }
+        if (sorted[i]->count > LINT_LINES_SHOWN) printf(", +%ld more", sorted[i]->count - LINT_LINES_SHOWN);
+        printf(")\n");
+    }
+
+    // Findings in script order
+    qsort(sorted, n, sizeof(LintCommand *), lint_compare_lines);
+    long findings = 0;
+    for (size_t i = 0; i < n; i++) {
+        LintCommand *entry = sorted[i];
+        if (entry->hint) {
+            if (findings++ == 0) printf("\n");
+            printf("%s:%ld: %s forks; %s\n", script, entry->lines[0], entry->text, entry->hint);
+        }
+        if (entry->external && entry->count > 1) {
+            if (findings++ == 0) printf("\n");
+            printf("%s:%ld: %s runs %ld times with the same arguments; run it once into a file "
+                   "(>FILE) and read that back with $(<FILE)\n", script, entry->lines[0], entry->text,
+                   entry->count);
+        }
+    }
+
+    free(sorted);
+    strmap_clear(&commands, free);
+    strmap_clear(&seen, NULL);
+    return forks;
+}
+
+/**
+ * @brief SIGINT/SIGTERM/SIGHUP handler while checkpointing: notes the signal.
+ * 
+ * checkpoint_commit() writes the checkpoint and exits at the end of the
+ * running line, without recording that line, so a resume runs it again.
+ */
+static void checkpoint_signal_handler(int sig) {
+    checkpoint_signal = sig;
+}
+
+/**
+ * @brief Writes a length-prefixed string record to a checkpoint file.
+ */
+static void checkpoint_put(FILE *fp, const char *tag, const char *str) {
+    fprintf(fp, "%s %zu\n", tag, strlen(str));
+    fputs(str, fp);
+    fputc('\n', fp);
+}
+
+/**
+ * @brief Writes a shell variable as a name/value record pair.
+ */
+static void checkpoint_put_variable(const char *name, const char *value, void *ctx) {
+    checkpoint_put(ctx, "name", name);
+    checkpoint_put(ctx, "value", value);
+}
+
+/**
+ * @brief Reads the body of a length-prefixed string record.
+ * 
+ * @return char* Newly allocated string, or NULL on a malformed record.
+ */
+static char *checkpoint_get(FILE *fp) {
+    size_t len;
+    if (fscanf(fp, "%zu", &len) != 1 || fgetc(fp) != '\n') {
+        return NULL;
+    }
+    char *str = malloc(len + 1);
+    if (!str) {
+        return NULL;
+    }
+    if (fread(str, 1, len, fp) != len || fgetc(fp) != '\n') {
+        free(str);
+        return NULL;
+    }
+    str[len] = '\0';
+    return str;
+}
+
+/**
+ * @brief Atomically writes the current checkpoint to disk.
+ * 
+ * @return int 0 on success, -1 on error.
+ */
+int checkpoint_write(void) {
+    if (!checkpoint.path) return 0;
+
+    size_t tmp_len = strlen(checkpoint.path) + 5;
+    char *tmp_path = malloc(tmp_len);
+    if (!tmp_path) {
+        fprintf(stderr, "wsh: allocation error for checkpoint\n");
+        return -1;
+    }
+    snprintf(tmp_path, tmp_len, "%s.tmp", checkpoint.path);
+
+    FILE *fp = fopen(tmp_path, "w");
+    if (!fp) {
+        perror("wsh: checkpoint");
+        free(tmp_path);
+        return -1;
+    }
+
+    fprintf(fp, "%s\n", CHECKPOINT_MAGIC);
+    checkpoint_put(fp, "script", checkpoint.script);
+    fprintf(fp, "size %lld\nmtime %lld\noffset %ld\n",
+            (long long)checkpoint.size, (long long)checkpoint.mtime, checkpoint.offset);
+
+    if (current_directory()) {
+        checkpoint_put(fp, "cwd", current_directory());
+    }
+
+    extern char **environ;
+    for (char **env = environ; *env; env++) {
+        checkpoint_put(fp, "env", *env);
+    }
+
+    for_each_variable(checkpoint_put_variable, fp);
+
+    // History is stored oldest first so it can be replayed with add_history()
+    fprintf(fp, "history %d\n", history.capacity);
+    for (int i = 0; i < history.count; i++) {
+        checkpoint_put(fp, "command", history.commands[(history.start + i) % history.capacity]);
+    }
+
+    int failed = fflush(fp) != 0 || fsync(fileno(fp)) != 0;
+    if (fclose(fp) != 0) {
+        failed = 1;
+    }
+    if (failed || rename(tmp_path, checkpoint.path) != 0) {
+        perror("wsh: checkpoint");
+        unlink(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+    free(tmp_path);
+
+    checkpoint.pending = 0;
+    clock_gettime(CLOCK_MONOTONIC, &checkpoint.last_write);
+    return 0;
+}
+
+/**
+ * @brief Makes a path absolute against the current directory.
+ * 
+ * @return char* Newly allocated absolute path, or NULL on allocation failure.
+ */
+static char *absolute_path(const char *path) {
+    if (path[0] == '/') {
+        return strdup(path);
+    }
+    const char *cwd = current_directory();
+    if (!cwd) {
+        return strdup(path);
+    }
+    size_t len = strlen(cwd) + strlen(path) + 2;
+    char *joined = malloc(len);
+    if (joined) {
+        snprintf(joined, len, "%s/%s", cwd, path);
+    }
+    return joined;
+}
+
+/**
+ * @brief Starts checkpointing a batch script to a file.
+ * 
+ * @param path The checkpoint file.
+ * @param script The batch script being run.
+ * @return int 0 on success, -1 on error.
+ */
+int checkpoint_start(const char *path, const char *script) {
+    struct stat st;
+    if (stat(script, &st) != 0) {
+        perror("wsh");
+        return -1;
+    }
+
+    // Remember the absolute path since the script may change directory
+    char *abs_script = realpath(script, NULL);
+    char *abs_path = absolute_path(path);
+    if (!abs_script || !abs_path) {
+        fprintf(stderr, "wsh: cannot resolve checkpoint paths\n");
+        free(abs_script);
+        free(abs_path);
+        return -1;
     }
 
+    free(checkpoint.path);
+    free(checkpoint.script);
+    checkpoint.path = abs_path;
+    checkpoint.script = abs_script;
+    checkpoint.size = st.st_size;
+    checkpoint.mtime = st.st_mtime;
+    checkpoint.pending = 0;
+    clock_gettime(CLOCK_MONOTONIC, &checkpoint.last_write);
+
+    // Keep going long enough to record progress when asked to stop
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = checkpoint_signal_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
     return 0;
 }
 
 /**
- * @brief Applies redirections by modifying file descriptors.
+ * @brief Restores shell state from a checkpoint file.
  * 
- * @param input Redirected input file (if any).
- * @param output Redirected output file (if any).
- * @param append Whether to append to the output file.
- * @param redirect_stderr Whether to redirect stderr.
- * @return int Status of applying redirections (0 on success, -1 on error).
+ * @param path The checkpoint file.
+ * @return int 0 on success, -1 on error.
  */
-int apply_redirection(char *input, char *output, int append, int redirect_stderr) {
-    // Backup original file descriptors
-    int stdin_fd = dup(STDIN_FILENO);
-    int stdout_fd = dup(STDOUT_FILENO);
-    int stderr_fd = dup(STDERR_FILENO);
-    
-    if (stdin_fd == -1 || stdout_fd == -1 || stderr_fd == -1) {
-        perror("wsh: dup failed");
+int checkpoint_resume(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror("wsh: resume");
         return -1;
     }
 
-    // Handle input redirection
-    if (input) {
-        int fd = open(input, O_RDONLY);
-        if (fd == -1) {
-            perror("wsh: input redirection failed");
-            return -1;
-        }
-        if (dup2(fd, STDIN_FILENO) == -1) {
-            perror("wsh: dup2 for stdin failed");
-            close(fd);
-            return -1;
-        }
-        close(fd);
+    char magic[sizeof(CHECKPOINT_MAGIC) + 1];
+    if (!fgets(magic, sizeof(magic), fp) || strncmp(magic, CHECKPOINT_MAGIC, strlen(CHECKPOINT_MAGIC)) != 0) {
+        fprintf(stderr, "wsh: %s is not a checkpoint file\n", path);
+        fclose(fp);
+        return -1;
     }
 
-    // Handle output redirection
-    if (output) {
-        int flags = O_WRONLY | O_CREAT;
-        if (append) {
-            flags |= O_APPEND; // Append to the file
-        } else {
-            flags |= O_TRUNC; // Truncate the file
-        }
-        int fd = open(output, flags, 0644);
-        if (fd == -1) {
-            perror("wsh: output redirection failed");
-            return -1;
-        }
-        if (dup2(fd, STDOUT_FILENO) == -1) {
-            perror("wsh: dup2 for stdout failed");
-            close(fd);
-            return -1;
-        }
-        close(fd);
-    }
+    char *script = NULL;
+    char *cwd = NULL;
+    char *name = NULL;
+    long long size = -1, mtime = -1;
+    long offset = -1;
+    int env_cleared = 0;
+    int ok = 1;
+    char tag[16];
 
-    // Handle stderr redirection
-    if (redirect_stderr) {
-        if (output) {
-            // Redirect stderr to stdout if output redirection is active
-            if (dup2(STDOUT_FILENO, STDERR_FILENO) == -1) {
-                perror("wsh: dup2 for stderr failed");
-                return -1;
+    while (ok && fscanf(fp, "%15s", tag) == 1) {
+        if (strcmp(tag, "size") == 0) {
+            ok = fscanf(fp, "%lld", &size) == 1;
+        } else if (strcmp(tag, "mtime") == 0) {
+            ok = fscanf(fp, "%lld", &mtime) == 1;
+        } else if (strcmp(tag, "offset") == 0) {
+            ok = fscanf(fp, "%ld", &offset) == 1;
+        } else if (strcmp(tag, "history") == 0) {
+            int capacity;
+            ok = fscanf(fp, "%d", &capacity) == 1 && capacity > 0;
+            if (ok) {
+                set_history_capacity(capacity);
             }
         } else {
-            // If no output file is specified, redirect stderr to /dev/null
-            int fd = open("/dev/null", O_WRONLY);
-            if (fd == -1) {
-                perror("wsh: opening /dev/null failed");
-                return -1;
-            }
-            if (dup2(fd, STDERR_FILENO) == -1) {
-                perror("wsh: dup2 for stderr failed");
-                close(fd);
-                return -1;
+            char *str = checkpoint_get(fp);
+            if (!str) {
+                ok = 0;
+            } else if (strcmp(tag, "script") == 0) {
+                free(script);
+                script = str;
+            } else if (strcmp(tag, "cwd") == 0) {
+                free(cwd);
+                cwd = str;
+            } else if (strcmp(tag, "env") == 0) {
+                if (!env_cleared) {
+                    clearenv();
+                    strmap_clear(&env_strings, free);
+                    env_cleared = 1;
+                }
+                char *equal_sign = strchr(str, '=');
+                if (equal_sign) {
+                    *equal_sign = '\0';
+                    set_environment(str, equal_sign + 1);
+                }
+                free(str);
+            } else if (strcmp(tag, "name") == 0) {
+                free(name);
+                name = str;
+            } else if (strcmp(tag, "value") == 0 && name) {
+                // Values were substituted when first assigned; store them as is
+                set_shell_variable(name, str);
+                free(name);
+                name = NULL;
+            } else if (strcmp(tag, "command") == 0) {
+                add_history(str);
+                free(str);
+            } else {
+                free(str);
             }
-            close(fd);
         }
     }
+    fclose(fp);
+    free(name);
 
-   // Restore original file descriptors (optional, depending on use case)
-    //dup2(stdin_fd, STDIN_FILENO);
-    //dup2(stdout_fd, STDOUT_FILENO);
-    //dup2(stderr_fd, STDERR_FILENO);
+    struct stat st;
+    if (!ok || !script || offset < 0) {
+        fprintf(stderr, "wsh: %s is corrupt\n", path);
+    } else if (stat(script, &st) != 0) {
+        perror("wsh: resume");
+    } else if (st.st_size != size || st.st_mtime != mtime) {
+        fprintf(stderr, "wsh: %s changed since the checkpoint was taken\n", script);
+    } else if (cwd && change_directory(cwd) != 0) {
+        perror("wsh: resume");
+    } else if (checkpoint_start(path, script) == 0) {
+        checkpoint.offset = offset;
+        free(script);
+        free(cwd);
+        return 0;
+    }
+    free(script);
+    free(cwd);
+    return -1;
+}
 
-    //Close backup descriptors
-    close(stdin_fd);
-    close(stdout_fd);
-    close(stderr_fd);
+/**
+ * @brief Records that the script line ending at offset has completed.
+ * 
+ * Writes are batched: the checkpoint only reaches the disk once every
+ * CHECKPOINT_INTERVAL_MS, or immediately when a termination signal arrived.
+ * 
+ * @param offset Byte offset just past the completed line.
+ */
+void checkpoint_commit(long offset) {
+    if (!checkpoint.path) return;
 
-    return 0;
+    if (checkpoint_signal) {
+        // The line may have been cut short by the signal, so it is not recorded
+        int sig = checkpoint_signal;
+        checkpoint_write();
+        cleanup_shell();
+        exit(128 + sig);
+    }
+
+    checkpoint.offset = offset;
+    checkpoint.pending++;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed_ms = (now.tv_sec - checkpoint.last_write.tv_sec) * 1000
+                    + (now.tv_nsec - checkpoint.last_write.tv_nsec) / 1000000;
+    if (elapsed_ms >= CHECKPOINT_INTERVAL_MS) {
+        checkpoint_write();
+    }
 }
+
 /**
- * @brief Resets file descriptors to their original state.
- * 
- * @param stdin_fd Original stdin file descriptor.
- * @param stdout_fd Original stdout file descriptor.
- * @param stderr_fd Original stderr file descriptor.
+ * @brief Frees a line produced by the parse-ahead thread.
  */
-void reset_redirection(int stdin_fd, int stdout_fd, int stderr_fd) {
-    dup2(stdin_fd, STDIN_FILENO);
-    dup2(stdout_fd, STDOUT_FILENO);
-    dup2(stderr_fd, STDERR_FILENO);
-    close(stdin_fd);
-    close(stdout_fd);
-    close(stderr_fd);
+static void free_parsed_line(ParsedLine *parsed) {
+    if (parsed->raw) free_tokens(parsed->raw);
+    free(parsed->text);
+    free(parsed);
 }
 
 /**
- * @brief Executes the parsed command.
+ * @brief Queues a parsed line, waiting for room unless the executor is stopping.
  * 
- * @param args Array of arguments.
- * @return int Status of execution.
+ * @return int 0 if queued, -1 if the line was dropped because of a stop.
  */
-int execute_command(char **args) {
-    if (args[0] == NULL) {
-        // Empty command
-        return 1;
+static int parse_ahead_push(ParsedLine *parsed) {
+    while (sem_wait(&parse_ahead.queue.spaces) != 0) {}
+    if (atomic_load(&parse_ahead.stopping)) {
+        if (parsed) free_parsed_line(parsed);
+        return -1;
     }
+    spsc_store(&parse_ahead.queue, parsed);
+    return 0;
+}
 
-    // Check if the command is a history execution
-    if (strcmp(args[0], "history") == 0 && args[1] != NULL) {
-        int num = atoi(args[1]);
-        if (num > 0) {
-            return execute_history_command(num);
+/**
+ * @brief Interrupts a blocking read in the parser thread; nothing else to do.
+ */
+static void parse_ahead_wake(int sig) {
+    (void)sig;
+}
+
+/**
+ * @brief Parser thread: reads and tokenizes script lines ahead of the executor.
+ * 
+ * Only tokenizing happens here. Variables are substituted by the executor
+ * with expand_tokens(), so `local`/`export` on one line are seen by the next.
+ */
+static void *parse_ahead_main(void *arg) {
+    (void)arg;
+    char *line;
+    while (!atomic_load(&parse_ahead.stopping) && (line = read_line(parse_ahead.input)) != NULL) {
+        // Ignore comments and empty lines
+        char *trimmed = line;
+        while (*trimmed == ' ' || *trimmed == '\t') trimmed++;
+        if (*trimmed == '#' || *trimmed == '\0' || *trimmed == '\n') {
+            free(line);
+            continue;
+        }
+
+        ParsedLine *parsed = malloc(sizeof(ParsedLine));
+        if (!parsed) {
+            free(line);
+            break;
+        }
+        // Remove trailing newline
+        size_t len = strlen(trimmed);
+        if (len > 0 && trimmed[len-1] == '\n') {
+            trimmed[len-1] = '\0';
+        }
+        parsed->text = strdup(trimmed);
+        parsed->raw = tokenize_line(trimmed);
+        parsed->offset = ftell(parse_ahead.input);
+        free(line);
+        if (parse_ahead_push(parsed) == -1) {
+            atomic_store(&parse_ahead.done, 1);
+            return NULL;
         }
     }
 
-    // Check for built-in commands
-    for (int i = 0; i < num_builtins(); i++) {
-        if (strcmp(args[0], builtin_str[i]) == 0) {
-            return (*builtin_func[i])(args);
+    // End-of-script marker carries the final offset
+    if (!atomic_load(&parse_ahead.stopping)) {
+        ParsedLine *end = calloc(1, sizeof(ParsedLine));
+        if (end) {
+            end->offset = ftell(parse_ahead.input);
         }
+        parse_ahead_push(end);
     }
+    atomic_store(&parse_ahead.done, 1);
+    return NULL;
+}
 
-    // Not a built-in command; launch external program
-    // Add to history
-    // Reconstruct the command string
-    int len = 0;
-    for (int i = 0; args[i] != NULL; i++) {
-        len += strlen(args[i]) + 1; // +1 for space or null terminator
+/**
+ * @brief Starts the parse-ahead thread on a batch script.
+ * 
+ * @param input The open script.
+ * @return int 0 on success, -1 if the thread could not be started.
+ */
+int parse_ahead_start(FILE *input) {
+    if (spsc_init(&parse_ahead.queue, PARSE_AHEAD_DEPTH) == -1) {
+        return -1;
     }
-    char *command_str = malloc(len);
-    if (!command_str) {
-        fprintf(stderr, "wsh: allocation error when adding to history\n");
-        return 1;
+    parse_ahead.input = input;
+    parse_ahead.owner = getpid();
+    atomic_store(&parse_ahead.stopping, 0);
+    atomic_store(&parse_ahead.done, 0);
+
+    // No SA_RESTART, so a read from a pipe returns when the stop signals it
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = parse_ahead_wake;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGRTMIN, &sa, NULL);
+
+    if (pthread_create(&parse_ahead.thread, NULL, parse_ahead_main, NULL) != 0) {
+        spsc_destroy(&parse_ahead.queue);
+        return -1;
     }
-    command_str[0] = '\0';
-    for (int i = 0; args[i] != NULL; i++) {
-        strcat(command_str, args[i]);
-        if (args[i+1] != NULL) {
-            strcat(command_str, " ");
+    parse_ahead.running = 1;
+    return 0;
+}
+
+/**
+ * @brief Stops the parse-ahead thread and drops lines it read ahead.
+ */
+void parse_ahead_stop(void) {
+    if (!parse_ahead.running) return;
+    parse_ahead.running = 0;
+
+    // A forked child has a copy of the queue but not the thread
+    if (getpid() != parse_ahead.owner) return;
+
+    // The thread may be blocked on a full queue or on a slow input; the
+    // extra space wakes the first, the signal interrupts the second and is
+    // repeated in case it lands just before the read starts
+    atomic_store(&parse_ahead.stopping, 1);
+    sem_post(&parse_ahead.queue.spaces);
+    while (!atomic_load(&parse_ahead.done)) {
+        pthread_kill(parse_ahead.thread, SIGRTMIN);
+        nanosleep(&(struct timespec){0, 1000000}, NULL);
+    }
+    pthread_join(parse_ahead.thread, NULL);
+    size_t head = atomic_load(&parse_ahead.queue.head);
+    size_t tail = atomic_load(&parse_ahead.queue.tail);
+    for (; head != tail; head++) {
+        ParsedLine *parsed = parse_ahead.queue.slots[head & (parse_ahead.queue.capacity - 1)];
+        if (parsed) free_parsed_line(parsed);
+    }
+    spsc_destroy(&parse_ahead.queue);
+}
+
+/**
+ * @brief Runs a batch script, overlapping reading and tokenizing with execution.
+ * 
+ * @param input The open script.
+ * @return int 0 if the script ran, -1 if parse-ahead could not start.
+ */
+int run_parse_ahead(FILE *input) {
+    if (parse_ahead_start(input) == -1) {
+        return -1;
+    }
+
+    int status = 1;
+    while (status) {
+        ParsedLine *parsed = spsc_pop(&parse_ahead.queue);
+        if (!parsed) {
+            // The parser ran out of memory
+            fprintf(stderr, "wsh: allocation error\n");
+            break;
+        }
+        if (!parsed->text) {
+            // End of script
+            checkpoint_commit(parsed->offset);
+            free_parsed_line(parsed);
+            break;
         }
+
+        // Add to history before executing, as for lines read directly
+        add_history(parsed->text);
+
+        char **args = expand_tokens(parsed->raw);
+        long offset = parsed->offset;
+        free_parsed_line(parsed);
+        status = execute_command(args);
+        free_tokens(args);
+
+        checkpoint_commit(offset);
     }
-    add_history(command_str);
-    free(command_str);
 
-    return launch_process(args);
+    parse_ahead_stop();
+    return 0;
 }
 
 /**
- * @brief Launches a program and waits for it to terminate.
+ * @brief Runs a script compiled by wsh2c.
  * 
- * @param args Array of arguments.
- * @return int Status of execution.
+ * Lines bound at translation time go straight to their builtin or to
+ * launch_process(); the rest are substituted and dispatched as the
+ * interpreter would. Either way the words are copied first, since
+ * redirection parsing and builtins modify them.
  */
-int launch_process(char **args) {
-    pid_t pid, wpid;
-    int status;
+int run_compiled(const CompiledLine *lines, size_t count) {
+    initialize_shell();
+    int status = 1;
+    for (size_t i = 0; i < count && status; i++) {
+        const CompiledLine *line = &lines[i];
+        add_history(line->text);
+        char **args = expand_tokens(line->words);
+        if (line->kind == COMPILED_BUILTIN && !audit.running) {
+            status = run_builtin(builtin_func[line->builtin], args);
+        } else if (line->kind == COMPILED_PROGRAM && !audit.running) {
+            add_history(line->command);
+            status = launch_process(args, args, 0);
+        } else {
+            // The audit log records every command through execute_command()
+            status = execute_command(args);
+        }
+        free_tokens(args);
+    }
+    cleanup_shell();
+    return EXIT_SUCCESS;
+}
 
-    // Parse redirections
-    char *input = NULL;
-    char *output = NULL;
-    int append = 0;
-    int redirect_stderr = 0;
-    parse_redirection(args, &input, &output, &append, &redirect_stderr);
+/**
+ * @brief Opens the job FIFO for reading without waiting for a writer, creating it if needed.
+ */
+static int serve_open(const char *path) {
+    if (mkfifo(path, 0600) == -1 && errno != EEXIST) {
+        fprintf(stderr, "wsh: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || !S_ISFIFO(st.st_mode)) {
+        fprintf(stderr, "wsh: %s: %s\n", path, fd == -1 ? strerror(errno) : "not a FIFO");
+        if (fd != -1) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Appends a job id to a completion record: a number as is, anything else as a JSON string.
+ */
+static void serve_put_id(OutBuf *out, const char *id) {
+    size_t digits = strspn(id, "0123456789");
+    if (digits > 0 && id[digits] == '\0' && (id[0] != '0' || digits == 1)) {
+        out_write(out, id, digits);
+        return;
+    }
+    out_write(out, "\"", 1);
+    for (const unsigned char *p = (const unsigned char *)id; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            char escaped[2] = {'\\', (char)*p};
+            out_write(out, escaped, 2);
+        } else if (*p < 0x20) {
+            out_printf(out, "\\u%04x", *p);
+        } else {
+            out_write(out, p, 1);
+        }
+    }
+    out_write(out, "\"", 1);
+}
 
-    pid = fork();
+/**
+ * @brief Starts one job in a free slot.
+ * 
+ * The child runs the line like a batch script would. A line that is one
+ * external program execs it in the child itself, so such a job costs one
+ * fork; any other line forks its programs as usual.
+ */
+static void serve_start(ServeJob *slot, const char *id, char *command, const sigset_t *mask, int fds[2]) {
+    clock_gettime(CLOCK_MONOTONIC, &slot->start);
+    snprintf(slot->id, sizeof(slot->id), "%s", id);
+    out_flush_all();
+    pid_t pid = fork();
     if (pid == 0) {
-        // Child process
+        close(fds[0]);
+        close(fds[1]);
+        signal(SIGPIPE, SIG_DFL);
+        sigprocmask(SIG_SETMASK, mask, NULL);
+        forked_child = 1;
+        exec_in_place = is_single_program(command);
+        char **args = parse_line(command);
+        execute_command(args);
+        out_flush_all();
+        _exit(last_status & 0xff);
+    }
+    if (pid == -1) {
+        perror("wsh");
+        slot->pid = 0;
+        return;
+    }
+    slot->pid = pid;
+}
 
-        // Apply redirections
-        if (apply_redirection(input, output, append, redirect_stderr) == -1) {
-            exit(EXIT_FAILURE);
+/**
+ * @brief Reaps finished jobs and records each one's id, status and duration.
+ * 
+ * @return int The number of jobs reaped.
+ */
+static int serve_reap(ServeJob *slots, int jobs, OutBuf *results) {
+    int reaped = 0;
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (int i = 0; i < jobs; i++) {
+            if (slots[i].pid != pid) continue;
+            int code = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+            out_write(results, "{\"id\":", 6);
+            serve_put_id(results, slots[i].id);
+            out_printf(results, ",\"status\":%d,\"duration_ms\":%.3f}\n", code,
+                       elapsed_ms(&slots[i].start, &now));
+            slots[i].pid = 0;
+            reaped++;
+            break;
         }
+    }
+    return reaped;
+}
 
-        // Handle variable substitution already done in parse_line()
+/**
+ * @brief Runs commands read from a FIFO as jobs, up to jobs at a time, until SIGTERM or SIGINT.
+ *
+ * Lines are split as they arrive; when every writer has closed, an
+ * unterminated last line is run as it stands before the FIFO is reopened.
+ *
+ * @param path The FIFO; created if it does not exist.
+ * @param results_path Where completion records go (a file or FIFO), or NULL for stdout.
+ * @param jobs The most jobs running at once.
+ * @return int 0 after a clean shutdown, -1 if the FIFO or results cannot be opened.
+ */
+int serve_fifo(const char *path, const char *results_path, int jobs) {
+    // Children and stop requests arrive through a signalfd, next to the FIFO in one poll()
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, &old_mask);
+    int fds[2];
+    fds[0] = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fds[0] == -1) {
+        perror("wsh: signalfd");
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        return -1;
+    }
+    fds[1] = serve_open(path);
+    if (fds[1] == -1) {
+        close(fds[0]);
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        return -1;
+    }
 
-        // If the command contains a slash, execute it directly
-        if (strchr(args[0], '/')) {
-            execv(args[0], args);
-            // If execv returns, there was an error
-            perror("wsh");
-            exit(EXIT_FAILURE);
-        } else {
-            // Search in PATH
-            char *path_env = getenv("PATH");
-            if (!path_env) {
-                fprintf(stderr, "wsh: PATH not set\n");
-                exit(EXIT_FAILURE);
-            }
+    // Records are buffered and written once per wakeup; a results FIFO
+    // waits here for its reader, and a reader leaving is not fatal
+    int results_fd = STDOUT_FILENO;
+    if (results_path) {
+        results_fd = open(results_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (results_fd == -1) {
+            fprintf(stderr, "wsh: %s: %s\n", results_path, strerror(errno));
+            close(fds[0]);
+            close(fds[1]);
+            sigprocmask(SIG_SETMASK, &old_mask, NULL);
+            return -1;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    static OutBuf results;
+    results.fd = results_fd;
+    results.used = 0;
 
-            // Duplicate PATH to tokenize
-            char *path_dup = strdup(path_env);
-            if (!path_dup) {
-                fprintf(stderr, "wsh: allocation error\n");
-                exit(EXIT_FAILURE);
-            }
+    // Everything is sized up front, so memory stays flat however many jobs run
+    ServeJob *slots = calloc(jobs, sizeof(ServeJob));
+    static char buffer[SERVE_LINE_MAX];
+    if (!slots) {
+        fprintf(stderr, "wsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t used = 0;
+    int running = 0, stopping = 0, discarding = 0;
+    uint64_t sequence = 0;
 
-            char *dir = strtok(path_dup, ":");
-            char executable_path[1024];
-            int found = 0;
+    while (!stopping || running > 0) {
+        // Start buffered lines while there are free slots
+        size_t start = 0;
+        char *newline;
+        while (!stopping && running < jobs && (newline = memchr(buffer + start, '\n', used - start))) {
+            char *line = buffer + start;
+            *newline = '\0';
+            start = newline + 1 - buffer;
+            if (discarding) {
+                discarding = 0;
+                continue;
+            }
+            while (*line == ' ' || *line == '\t') line++;
+            if (*line == '\0' || *line == '#') continue;
 
-            while (dir != NULL) {
-                snprintf(executable_path, sizeof(executable_path), "%s/%s", dir, args[0]);
-                if (access(executable_path, X_OK) == 0) {
-                    found = 1;
+            // "ID<TAB>command" names the job; otherwise it is numbered
+            char id[SERVE_ID_MAX];
+            char *tab = strchr(line, '\t');
+            sequence++;
+            if (tab && tab - line < SERVE_ID_MAX) {
+                *tab = '\0';
+                snprintf(id, sizeof(id), "%s", line);
+                line = tab + 1;
+            } else {
+                snprintf(id, sizeof(id), "%" PRIu64, sequence);
+            }
+            for (int i = 0; i < jobs; i++) {
+                if (slots[i].pid == 0) {
+                    serve_start(&slots[i], id, line, &old_mask, fds);
+                    running += slots[i].pid != 0;
                     break;
                 }
-                dir = strtok(NULL, ":");
             }
+        }
+        memmove(buffer, buffer + start, used - start);
+        used -= start;
+        if (used == sizeof(buffer)) {
+            fprintf(stderr, "wsh: %s: line longer than %d bytes dropped\n", path, SERVE_LINE_MAX);
+            used = 0;
+            discarding = 1;
+        }
 
-            if (!found) {
-                fprintf(stderr, "wsh: command not found: %s\n", args[0]);
-                free(path_dup);
-                exit(EXIT_FAILURE);
-            }
+        // Read more only with a free slot, so a full queue pushes back on writers
+        struct pollfd polls[2] = {{fds[0], POLLIN, 0}, {fds[1], POLLIN, 0}};
+        int watch_fifo = !stopping && running < jobs;
+        if (poll(polls, watch_fifo ? 2 : 1, -1) == -1 && errno != EINTR) {
+            perror("wsh: poll");
+            break;
+        }
 
-            execv(executable_path, args);
-            // If execv returns, there was an error
-            perror("wsh");
-            free(path_dup);
-            exit(EXIT_FAILURE);
+        if (polls[0].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            while (read(fds[0], &info, sizeof(info)) == sizeof(info)) {
+                if (info.ssi_signo != SIGCHLD) stopping = 1;
+            }
+            running -= serve_reap(slots, jobs, &results);
         }
-    } else if (pid < 0) {
-        // Error forking
-        perror("wsh");
-    } else {
-        // Parent process
-        do {
-            wpid = waitpid(pid, &status, WUNTRACED);
-            if (wpid == -1) {
-                perror("wsh");
-                break;
+        if (watch_fifo && polls[1].revents) {
+            ssize_t n = read(fds[1], buffer + used, sizeof(buffer) - used);
+            if (n > 0) {
+                used += n;
+            } else if (n == 0) {
+                // Every writer has gone; a last line left unterminated ends here
+                // rather than running into the next writer's first line
+                if (used > 0 && buffer[used - 1] != '\n') {
+                    buffer[used++] = '\n';
+                } else if (used == 0) {
+                    discarding = 0;
+                }
+                close(fds[1]);
+                fds[1] = serve_open(path);
+                if (fds[1] == -1) stopping = 1;
+            } else if (errno != EAGAIN && errno != EINTR) {
+                perror("wsh: read");
+                stopping = 1;
             }
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+        }
+        out_drain(&results, NULL, 0);
     }
 
-    return 1;
+    out_drain(&results, NULL, 0);
+    if (results_fd != STDOUT_FILENO) close(results_fd);
+    if (fds[1] != -1) close(fds[1]);
+    close(fds[0]);
+    free(slots);
+    signal(SIGPIPE, SIG_DFL);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return 0;
 }
 
 /**
- * @brief Built-in command: change directory.
+ * @brief Appends s to a JSON record as a quoted, escaped string.
  */
-int wsh_cd(char **args) {
-    if (args[1] == NULL) {
-        fprintf(stderr, "wsh: expected argument to \"cd\"\n");
-    } else {
-        if (chdir(args[1]) != 0) {
-            perror("wsh");
+static void audit_json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+        switch (*p) {
+        case '"': fputs("\\\"", out); break;
+        case '\\': fputs("\\\\", out); break;
+        case '\n': fputs("\\n", out); break;
+        case '\t': fputs("\\t", out); break;
+        case '\r': fputs("\\r", out); break;
+        default:
+            if (*p < 0x20) {
+                fprintf(out, "\\u%04x", *p);
+            } else {
+                fputc(*p, out);
+            }
         }
     }
-    return 1;
+    fputc('"', out);
 }
 
-
-
 /**
- * @brief Built-in command: exit the shell.
+ * @brief Starts an audit record with the fields known before a command runs.
+ * 
+ * Only formatting happens here; the record reaches the disk from the writer thread.
+ * 
+ * @param args The command about to run.
+ * @return AuditRecord* The partial record, or NULL if auditing is off or out of memory.
  */
-int wsh_exit_cmd(char **args) {
-    if (args[1] != NULL) {
-        fprintf(stderr, "wsh: exit takes no arguments\n");
-        return 1;
+AuditRecord *audit_begin(char **args) {
+    if (!audit.running) {
+        return NULL;
     }
-    cleanup_shell();
-    exit(EXIT_SUCCESS);
-}
-
-/**
- * @brief Built-in command: export environment variable.
- */
-int wsh_export(char **args) {
-    if (args[1] == NULL) {
-        fprintf(stderr, "wsh: export requires an argument\n");
-        return 1;
+    AuditRecord *record = calloc(1, sizeof(AuditRecord));
+    if (!record) {
+        return NULL;
     }
-
-    char *arg = args[1];
-    char *equal_sign = strchr(arg, '=');
-    if (!equal_sign) {
-        fprintf(stderr, "wsh: export requires VAR=VALUE format\n");
-        return 1;
+    FILE *out = open_memstream(&record->text, &record->len);
+    if (!out) {
+        free(record);
+        return NULL;
     }
 
-    *equal_sign = '\0';
-    char *var = arg;
-    char *value = equal_sign + 1;
-
-    if (setenv(var, value, 1) != 0) {
-        perror("wsh");
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct tm tm;
+    gmtime_r(&now.tv_sec, &tm);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    fprintf(out, "{\"time\":\"%s.%03ldZ\",\"user\":", stamp, now.tv_nsec / 1000000);
+    audit_json_string(out, audit.user);
+    fputs(",\"cwd\":", out);
+    audit_json_string(out, current_directory() ? current_directory() : "");
+    fputs(",\"argv\":[", out);
+    for (int i = 0; args[i]; i++) {
+        if (i) fputc(',', out);
+        audit_json_string(out, args[i]);
     }
-
-    return 1;
+    fputc(']', out);
+    fclose(out);
+    clock_gettime(CLOCK_MONOTONIC, &record->start);
+    return record;
 }
 
 /**
- * @brief Built-in command: local shell variable.
+ * @brief Completes a record with the exit status and duration and queues it.
+ * 
+ * Never blocks: when the writer has fallen behind the record is dropped and counted.
+ * 
+ * @param record The record from audit_begin(), or NULL.
+ * @param status The command's exit status.
  */
-int wsh_local_cmd(char **args) {
-    if (args[1] == NULL) {
-        fprintf(stderr, "wsh: local requires an argument\n");
-        return 1;
+void audit_finish(AuditRecord *record, int status) {
+    if (!record) {
+        return;
     }
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = (end.tv_sec - record->start.tv_sec) * 1e3 +
+                (end.tv_nsec - record->start.tv_nsec) / 1e6;
 
-    char *arg = args[1];
-    char *equal_sign = strchr(arg, '=');
-    if (!equal_sign) {
-        fprintf(stderr, "wsh: local requires VAR=VALUE format\n");
-        return 1;
+    char tail[64];
+    int len = snprintf(tail, sizeof(tail), ",\"status\":%d,\"duration_ms\":%.3f}\n", status, ms);
+    char *text = realloc(record->text, record->len + len + 1);
+    if (!text) {
+        free(record->text);
+        free(record);
+        atomic_fetch_add(&audit.dropped, 1);
+        return;
     }
+    memcpy(text + record->len, tail, len + 1);
+    record->text = text;
+    record->len += len;
 
-    *equal_sign = '\0';
-    char *var = arg;
-    char *value = equal_sign + 1;
-
-    // Handle variable substitution in value
-    char *processed_value = handle_variable_substitution(value);
-    if (!processed_value) {
-        processed_value = strdup("");
+    atomic_fetch_add(&audit.records, 1);
+    if (spsc_try_push(&audit.queue, record) == -1) {
+        free(record->text);
+        free(record);
+        atomic_fetch_add(&audit.dropped, 1);
     }
+}
 
-    // Check if variable already exists
-    VarNode *current = var_head;
-    while (current) {
-        if (strcmp(current->name, var) == 0) {
-            // Update existing variable
-            free(current->value);
-            current->value = processed_value;
-            return 1;
-        }
-        current = current->next;
+/**
+ * @brief Opens the audit log for appending, noting its current size.
+ * 
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int audit_open(void) {
+    audit.fd = open(audit.path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (audit.fd == -1) {
+        return -1;
     }
+    struct stat st;
+    audit.size = fstat(audit.fd, &st) == 0 ? (size_t)st.st_size : 0;
+    return 0;
+}
 
-    // Add new variable
-    VarNode *new_var = malloc(sizeof(VarNode));
-    if (!new_var) {
-        fprintf(stderr, "wsh: allocation error for shell variable\n");
-        free(processed_value);
-        return 1;
+/**
+ * @brief Moves a full log to PATH.1 and starts a new one.
+ */
+static void audit_rotate(void) {
+    size_t len = strlen(audit.path) + 3;
+    char *rotated = malloc(len);
+    if (!rotated) {
+        return;
     }
-    new_var->name = strdup(var);
-    new_var->value = processed_value;
-    new_var->next = NULL;
-
-    // Append to the end of the list to maintain insertion order
-    if (var_head == NULL) {
-        var_head = new_var;
-    } else {
-        VarNode *tail = var_head;
-        while (tail->next) {
-            tail = tail->next;
-        }
-        tail->next = new_var;
+    snprintf(rotated, len, "%s.1", audit.path);
+    close(audit.fd);
+    audit.fd = -1;
+    if (rename(audit.path, rotated) == 0) {
+        atomic_fetch_add(&audit.rotations, 1);
+    }
+    free(rotated);
+    if (audit_open() == -1) {
+        perror("wsh: audit log");
     }
-
-    return 1;
 }
 
 /**
- * @brief Built-in command: display shell variables.
+ * @brief Appends records to the log with one write(), rotating first if it would overflow.
  */
-int wsh_vars(char **args) {
-    (void)args; // Mark as unused to prevent compiler warnings
-    VarNode *current = var_head;
-    while (current) {
-        printf("%s=%s\n", current->name, current->value);
-        current = current->next;
+static void audit_flush(const char *data, size_t len, size_t count) {
+    if (audit.size > 0 && audit.size + len > audit.max_size) {
+        audit_rotate();
+    }
+    size_t done = 0;
+    while (audit.fd != -1 && done < len) {
+        ssize_t n = write(audit.fd, data + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        done += n;
+    }
+    audit.size += done;
+    if (done == len) {
+        atomic_fetch_add(&audit.written, count);
     }
-    return 1;
 }
 
 /**
- * @brief Built-in command: history management.
+ * @brief Writer thread: gathers whatever is queued into one buffer per write().
  */
-int wsh_history_cmd(char **args) {
-    if (args[1] == NULL) {
-        // Display history
-        show_history();
-    } else if (strcmp(args[1], "set") == 0) {
-        if (args[2] == NULL) {
-            fprintf(stderr, "wsh: history set requires a number\n");
-            return 1;
-        }
-        int new_capacity = atoi(args[2]);
-        if (new_capacity <= 0) {
-            fprintf(stderr, "wsh: history set requires a positive integer\n");
-            return 1;
+static void *audit_main(void *arg) {
+    (void)arg;
+    char *batch = malloc(AUDIT_BATCH_BYTES);
+    size_t capacity = batch ? AUDIT_BATCH_BYTES : 0;
+    AuditRecord *record;
+    do {
+        size_t used = 0, count = 0;
+        record = spsc_pop(&audit.queue);
+        while (record && record != AUDIT_STOP) {
+            if (used + record->len > capacity && used > 0) {
+                audit_flush(batch, used, count);
+                used = count = 0;
+            }
+            if (record->len > capacity) {
+                audit_flush(record->text, record->len, 1);
+            } else {
+                memcpy(batch + used, record->text, record->len);
+                used += record->len;
+                count++;
+            }
+            free(record->text);
+            free(record);
+            record = spsc_try_pop(&audit.queue);
         }
-        set_history_capacity(new_capacity);
-    } else {
-        // Attempt to execute a history command
-        int num = atoi(args[1]);
-        if (num > 0) {
-            return execute_history_command(num);
+        if (used > 0) {
+            audit_flush(batch, used, count);
         }
-    }
-    return 1;
+    } while (record != AUDIT_STOP);
+    free(batch);
+    return NULL;
 }
 
 /**
- * @brief Built-in command: ls.
+ * @brief Frees the log path and user name, marking auditing as never started.
  */
-int wsh_ls(char **args) {
-    (void)args; // Mark as unused to prevent compiler warnings
+static void audit_release(void) {
+    free(audit.path);
+    free(audit.user);
+    audit.path = audit.user = NULL;
+}
 
-    pid_t pid, wpid;
-    int status;
+/**
+ * @brief Starts audit logging to path on a background writer thread.
+ * 
+ * @param path The log file.
+ * @return int 0 on success, -1 on error.
+ */
+int audit_start(const char *path) {
+    audit.path = strdup(path);
+    if (!audit.path) {
+        return -1;
+    }
+    const char *max = getenv("WSH_AUDIT_LOG_MAX");
+    audit.max_size = max && atoll(max) > 0 ? (size_t)atoll(max) : AUDIT_ROTATE_BYTES;
 
-    pid = fork();
-    if (pid == 0) {
-        // Child process
-        // Set LANG=C and execute ls -1 --color=never
-        setenv("LANG", "C", 1);
-        char *ls_args[] = {"ls", "-1", "--color=never", NULL};
-        execv("/bin/ls", ls_args);
-        // If execv returns, there was an error
-        perror("wsh");
-        exit(EXIT_FAILURE);
-    } else if (pid < 0) {
-        // Error forking
-        perror("wsh");
+    struct passwd *pw = getpwuid(geteuid());
+    if (pw) {
+        audit.user = strdup(pw->pw_name);
     } else {
-        // Parent process
-        do {
-            wpid = waitpid(pid, &status, WUNTRACED);
-            if (wpid == -1) {
-                perror("wsh");
-                break;
-            }
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+        char uid[16];
+        snprintf(uid, sizeof(uid), "%u", (unsigned)geteuid());
+        audit.user = strdup(uid);
     }
 
-    return 1;
+    if (!audit.user || audit_open() == -1) {
+        perror("wsh: audit log");
+        audit_release();
+        return -1;
+    }
+    if (spsc_init(&audit.queue, AUDIT_QUEUE_DEPTH) == -1) {
+        close(audit.fd);
+        audit.fd = -1;
+        audit_release();
+        return -1;
+    }
+    if (pthread_create(&audit.thread, NULL, audit_main, NULL) != 0) {
+        spsc_destroy(&audit.queue);
+        close(audit.fd);
+        audit.fd = -1;
+        audit_release();
+        return -1;
+    }
+    audit.running = 1;
+    return 0;
 }
 
 /**
- * @brief Displays the shell prompt.
+ * @brief Writes out every queued record and stops the writer thread.
  */
-void display_prompt(void) {
-    printf("wsh> ");
-    fflush(stdout);
+void audit_stop(void) {
+    if (!audit.running) {
+        return;
+    }
+    audit.running = 0;
+    spsc_push(&audit.queue, AUDIT_STOP);
+    pthread_join(audit.thread, NULL);
+    spsc_destroy(&audit.queue);
+    if (audit.fd != -1) {
+        close(audit.fd);
+    }
+    audit_release();
 }
 
 /**
- * @brief Reads a line of input from the user or batch file.
- * 
- * @param input_stream The input stream to read from.
- * @return char* The input line.
+ * @brief Built-in command: show audit log counters.
  */
-char *read_line(FILE *input_stream) {
-    char *line = NULL;
-    size_t bufsize = 0; // getline allocates buffer
-    ssize_t nread;
-
-    nread = getline(&line, &bufsize, input_stream);
-    if (nread == -1) {
-        free(line);
-        return NULL;
+int wsh_audit(char **args) {
+    (void)args; // Mark as unused to prevent compiler warnings
+    if (!audit.path) {
+        out_printf(wsh_err, "wsh: audit: WSH_AUDIT_LOG is not set\n");
+        return 1;
     }
+    out_printf(wsh_out, "log: %s\nrecords: %zu\nwritten: %zu\ndropped: %zu\nrotations: %zu\n",
+               audit.path, atomic_load(&audit.records), atomic_load(&audit.written),
+               atomic_load(&audit.dropped), atomic_load(&audit.rotations));
+    return 1;
+}
 
-    return line;
+#ifndef WSH_NO_MAIN
+/**
+ * @brief Prints command-line usage.
+ */
+static void usage(void) {
+    fprintf(stderr, "usage: wsh [--load-state FILE] [--save-state FILE] [--checkpoint FILE]\n"
+                    "           [--[no-]parse-ahead] [--serial-substitution] [--pressure]\n"
+                    "           [--pressure-limits SPEC] [script]\n"
+                    "       wsh -j N|auto[:MIN:MAX] [--pressure-limits SPEC] script\n"
+                    "           (a line waits for the running ones if it is a builtin such as cd,\n"
+                    "           has a redirection, or names a path they name or one inside it)\n"
+                    "       wsh -n script\n"
+                    "       wsh --lint-perf script\n"
+                    "       wsh --serve-fifo FIFO [-j N] [--results FILE] [--load-state FILE]\n"
+                    "       wsh --resume FILE\n");
 }
 
 /**
@@ -841,23 +8515,159 @@ int main(int argc, char **argv) {
     char **args;
     int status = 1;
     FILE *input_stream = stdin;
+    char *script = NULL;
+    char *checkpoint_file = NULL;
+    char *resume_file = NULL;
+    char *load_state_file = NULL;
+    int no_exec = 0;
+    int lint_perf = 0;
+    char *serve_path = NULL;
+    char *results_path = NULL;
+    int parse_ahead_enabled = 1;    // 0 off, 1 with more than one CPU, 2 always
 
     initialize_shell();
 
+    // Parse command-line options
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            checkpoint_file = argv[++i];
+        } else if (strcmp(argv[i], "--resume") == 0 && i + 1 < argc) {
+            resume_file = argv[++i];
+        } else if (strcmp(argv[i], "--load-state") == 0 && i + 1 < argc) {
+            load_state_file = argv[++i];
+        } else if (strcmp(argv[i], "--save-state") == 0 && i + 1 < argc) {
+            // Resolve now: the script may change directory before exiting
+            free(save_state_path);
+            save_state_path = absolute_path(argv[++i]);
+        } else if (strcmp(argv[i], "--no-parse-ahead") == 0) {
+            parse_ahead_enabled = 0;
+        } else if (strcmp(argv[i], "--parse-ahead") == 0) {
+            parse_ahead_enabled = 2;
+        } else if (strcmp(argv[i], "--serial-substitution") == 0) {
+            concurrent_substitution = 0;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            if (launcher_set_jobs(argv[++i]) == -1) {
+                fprintf(stderr, "wsh: -j expects a count, auto or auto:MIN:MAX\n");
+                cleanup_shell();
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--pressure") == 0) {
+            launcher.gating = 1;
+        } else if (strcmp(argv[i], "--pressure-limits") == 0 && i + 1 < argc) {
+            if (launcher_set_limits(argv[++i]) == -1) {
+                fprintf(stderr, "wsh: --pressure-limits expects cpu=N,memory=N,io=N,load=N\n");
+                cleanup_shell();
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "-n") == 0) {
+            no_exec = 1;
+        } else if (strcmp(argv[i], "--lint-perf") == 0) {
+            lint_perf = 1;
+        } else if (strcmp(argv[i], "--serve-fifo") == 0 && i + 1 < argc) {
+            serve_path = argv[++i];
+        } else if (strcmp(argv[i], "--results") == 0 && i + 1 < argc) {
+            results_path = argv[++i];
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            usage();
+            cleanup_shell();
+            exit(EXIT_FAILURE);
+        } else if (script == NULL) {
+            script = argv[i];
+        } else {
+            fprintf(stderr, "wsh: too many arguments\n");
+            cleanup_shell();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (((no_exec || lint_perf) && (!script || checkpoint_file || resume_file))
+        || (no_exec && lint_perf)
+        || (resume_file && (script || checkpoint_file || load_state_file))
+        || (serve_path && (script || no_exec || lint_perf || checkpoint_file || resume_file || launcher.adaptive))
+        || (results_path && !serve_path)
+        || (launcher.async && !serve_path && (!script || no_exec || lint_perf || checkpoint_file))) {
+        usage();
+        cleanup_shell();
+        exit(EXIT_FAILURE);
+    }
+
+    if (resume_file) {
+        // The checkpoint knows which script to continue and where
+        if (checkpoint_resume(resume_file) == -1) {
+            cleanup_shell();
+            exit(EXIT_FAILURE);
+        }
+        script = checkpoint.script;
+    } else if (checkpoint_file) {
+        if (!script) {
+            fprintf(stderr, "wsh: --checkpoint requires a script\n");
+            cleanup_shell();
+            exit(EXIT_FAILURE);
+        }
+        if (checkpoint_start(checkpoint_file, script) == -1) {
+            cleanup_shell();
+            exit(EXIT_FAILURE);
+        }
+    }
+
     // Batch mode if a file is provided
-    if (argc == 2) {
-        input_stream = fopen(argv[1], "r");
+    if (script) {
+        input_stream = fopen(script, "r");
         if (!input_stream) {
             perror("wsh");
             cleanup_shell();
             exit(EXIT_FAILURE);
         }
-    } else if (argc > 2) {
-        fprintf(stderr, "wsh: too many arguments\n");
+        if (checkpoint.path && fseek(input_stream, checkpoint.offset, SEEK_SET) != 0) {
+            perror("wsh: resume");
+            fclose(input_stream);
+            cleanup_shell();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Loading may change directory, so it happens after the script is open
+    if (load_state_file && load_state(load_state_file) == -1) {
+        if (input_stream != stdin) {
+            fclose(input_stream);
+        }
         cleanup_shell();
         exit(EXIT_FAILURE);
     }
 
+    if (serve_path) {
+        // -j is the number of jobs at once; each job's own commands run in the foreground
+        int jobs = launcher.async ? launcher.limit : 1;
+        launcher.async = 0;
+        int served = serve_fifo(serve_path, results_path, jobs);
+        cleanup_shell();
+        exit(served == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    if (lint_perf) {
+        // Static analysis only: nothing in the script runs
+        lint_perf_script(input_stream, script);
+        fclose(input_stream);
+        cleanup_shell();
+        exit(EXIT_SUCCESS);
+    }
+
+    if (no_exec) {
+        // Pre-flight only: report problems and never run the script
+        int problems = preflight_script(input_stream, script);
+        fclose(input_stream);
+        cleanup_shell();
+        exit(problems == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    // Batch scripts are read and tokenized ahead on a separate thread,
+    // which only pays off when it can run beside the executor unless forced
+    if (input_stream != stdin && parse_ahead_enabled
+        && (parse_ahead_enabled == 2 || sysconf(_SC_NPROCESSORS_ONLN) > 1)
+        && run_parse_ahead(input_stream) == 0) {
+        status = 0;
+    }
+
     // Main loop
     while (status) {
         if (input_stream == stdin) {
@@ -875,6 +8685,7 @@ int main(int argc, char **argv) {
         while (*trimmed == ' ' || *trimmed == '\t') trimmed++;
         if (*trimmed == '#' || *trimmed == '\0' || *trimmed == '\n') {
             free(line);
+            checkpoint_commit(ftell(input_stream));
             continue;
         }
 
@@ -895,11 +8706,9 @@ int main(int argc, char **argv) {
         status = execute_command(args);
 
         free(line);
-        // Free each token
-        for (int i = 0; args[i] != NULL; i++) {
-            free(args[i]);
-        }
-        free(args);
+        free_tokens(args);
+
+        checkpoint_commit(ftell(input_stream));
     }
 
     if (input_stream != stdin) {
@@ -910,3 +8719,4 @@ int main(int argc, char **argv) {
 
     return EXIT_SUCCESS;
 }
+#endif // WSH_NO_MAIN
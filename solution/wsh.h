@@ -1,6 +1,11 @@
 #ifndef WSH_H
 #define WSH_H
 
+// O_PATH and other Linux extensions
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 // Include necessary standard libraries
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,6 +15,34 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <dirent.h>
+#include <stdarg.h>
+#include <sys/uio.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <inttypes.h>
+#include <pwd.h>
+#include <grp.h>
+#include <ctype.h>
+#include <math.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>) && !defined(WSH_NO_IO_URING)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define WSH_HAVE_IO_URING 1
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 // Define constants
 #define MAX_INPUT_SIZE 1024
@@ -17,9 +50,82 @@
 #define DELIMITERS " \t\r\n\a"
 #define DEFAULT_PATH "/bin"
 #define MAX_HISTORY 5
+#define MAX_SOURCE_DEPTH 64
+#define PARSE_AHEAD_DEPTH 256
+#define CHECKPOINT_MAGIC "wsh-checkpoint 1"
+#define CHECKPOINT_INTERVAL_MS 1000
+#define SNAPSHOT_MAGIC "WSHSNAP\0"
+#define SNAPSHOT_VERSION 2
+#define OUTBUF_SIZE 65536
+#define AUDIT_QUEUE_DEPTH 4096
+#define AUDIT_BATCH_BYTES 65536
+#define AUDIT_ROTATE_BYTES (64 * 1024 * 1024)
+#define LAUNCH_SAMPLE_MS 250
+#define LAUNCH_COOLDOWN_MS 2000
+#define LAUNCH_BACKOFF_MIN_MS 10
+#define LAUNCH_BACKOFF_MAX_MS 1000
+#define LAUNCH_MAX_DELAY_MS 30000
+#define LAUNCH_LOG_SIZE 32
+#define LAUNCH_LOG_WIDTH 96
+#define PRESSURE_CPU_LIMIT 50.0
+#define PRESSURE_MEMORY_LIMIT 10.0
+#define PRESSURE_IO_LIMIT 50.0
+#define PRESSURE_LOAD_LIMIT 1.5
+#define RATE_SHM_PREFIX "/wsh-ratelimit-"
+#define TEE_BUFFER_SIZE (1024 * 1024)
+#define TEE_MAX_OUTPUTS 64
+#define TEXT_BLOCK 65536
+#define MATCH_SIMD_PATTERNS 8
+#define BRACE_MAX_WORDS (1 << 24)
+#define LINT_TOP_OFFENDERS 5
+#define LINT_LINES_SHOWN 5
+#define SERVE_LINE_MAX 65536
+#define SERVE_ID_MAX 64
+#define LS_RING_ENTRIES 256
+#define LS_RING_RETRIES 8
+#define LS_STAT_THREADS 8
+#define LS_ID_CACHE 16
+#define LS_RECENT_SECONDS (31556952 / 2)
 
 // Function declarations
 
+typedef struct OutBuf OutBuf;
+
+/**
+ * @brief Builtin output buffers for stdout and stderr.
+ */
+extern OutBuf *wsh_out;
+extern OutBuf *wsh_err;
+
+/**
+ * @brief Appends bytes to a builtin output buffer, writing through when it is full.
+ * 
+ * @param out wsh_out or wsh_err.
+ * @param data The bytes to append.
+ * @param len Number of bytes.
+ */
+void out_write(OutBuf *out, const void *data, size_t len);
+
+/**
+ * @brief Formats straight into a builtin output buffer.
+ * 
+ * @param out wsh_out or wsh_err.
+ * @param format printf-style format.
+ */
+void out_printf(OutBuf *out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * @brief Like perror(), but through the builtin stderr buffer.
+ * 
+ * @param prefix Text printed before the error message.
+ */
+void out_perror(const char *prefix);
+
+/**
+ * @brief Writes out both builtin buffers with writev.
+ */
+void out_flush_all(void);
+
 /**
  * @brief Displays the shell prompt.
  */
@@ -33,6 +139,72 @@ void display_prompt(void);
  */
 char *read_line(FILE *input_stream);
 
+/**
+ * @brief Looks up a variable, checking the environment before shell variables.
+ * 
+ * @param name The variable name.
+ * @return char* The value, or NULL if the variable is not set.
+ */
+char *lookup_variable(const char *name);
+
+/**
+ * @brief Calls fn for every shell variable in insertion order.
+ * 
+ * @param fn Callback receiving each name and value.
+ * @param ctx Passed through to fn.
+ */
+void for_each_variable(void (*fn)(const char *name, const char *value, void *ctx), void *ctx);
+
+/**
+ * @brief Sets a shell variable, appending it if it is new.
+ * 
+ * @param name The variable name.
+ * @param value The new value; ownership passes to the shell.
+ * @return int 0 on success, -1 on allocation failure.
+ */
+int set_shell_variable(const char *name, char *value);
+
+/**
+ * @brief Frees a string unless it lives inside the loaded snapshot.
+ * 
+ * @param str The string to free.
+ */
+void free_string(char *str);
+
+/**
+ * @brief Resolves a command name to an executable path using $PATH.
+ * 
+ * @param name The command name.
+ * @return const char* The executable path, or NULL if not found.
+ */
+const char *resolve_command(const char *name);
+
+/**
+ * @brief Selects the byte classifier used by the tokenizer, the wc/tail counters and match.
+ * 
+ * @param name "scalar", "sse2", "avx2", or NULL for the best one this CPU supports.
+ * @return int 0 on success, -1 if the classifier is unknown or unsupported.
+ */
+int select_classifier(const char *name);
+
+/**
+ * @brief Counts newline bytes with the counter picked by select_classifier().
+ * 
+ * @param s The buffer.
+ * @param len The buffer length.
+ * @return size_t The number of '\n' bytes.
+ */
+size_t count_lines(const char *s, size_t len);
+
+/**
+ * @brief Counts whitespace-separated words the way wc does.
+ * 
+ * @param s The buffer.
+ * @param len The buffer length.
+ * @return size_t The number of words.
+ */
+size_t count_words(const char *s, size_t len);
+
 /**
  * @brief Parses the input line into tokens, handling variable substitution.
  * 
@@ -41,6 +213,98 @@ char *read_line(FILE *input_stream);
  */
 char **parse_line(char *line);
 
+/**
+ * @brief Splits the input line into tokens without substituting variables.
+ * 
+ * @param line The input line.
+ * @return char** Array of raw tokens, for expand_tokens().
+ */
+char **tokenize_line(char *line);
+
+/**
+ * @brief Substitutes variables in raw tokens from tokenize_line().
+ * 
+ * @param raw Array of raw tokens.
+ * @return char** A new token array, released with free_tokens().
+ */
+char **expand_tokens(char **raw);
+
+/**
+ * @brief Frees a token array returned by parse_line().
+ * 
+ * @param tokens The token array.
+ */
+void free_tokens(char **tokens);
+
+/**
+ * @brief Expands {a,b} lists and {x..y[..step]} ranges in a line's words as written.
+ * 
+ * Called before substitution; assignment words, the arguments of local and
+ * export, and words with a $(...) are left alone. Every word is sized before any is generated, so an expansion that is too
+ * large, or too long for execve() when the command is not a builtin, is
+ * refused without being built; the rest are generated straight into the
+ * new argv.
+ * 
+ * @param args The raw words from tokenize_line().
+ * @param expanded Set to a new token array (release with free_tokens()), or
+ *                 NULL when no argument has a brace expansion.
+ * @return int 0 on success, -1 on error (already reported).
+ */
+int expand_braces(char **args, char ***expanded);
+
+typedef struct AuditRecord AuditRecord;
+
+/**
+ * @brief Parses pressure thresholds such as "cpu=40,memory=10,io=40,load=1.5" and enables gating.
+ * 
+ * @param spec Comma-separated metric=limit pairs; cpu, memory and io are PSI "some avg10"
+ *        percentages, load is the 1-minute load average per CPU.
+ * @return int 0 on success, -1 if spec is malformed.
+ */
+int launcher_set_limits(const char *spec);
+
+/**
+ * @brief Parses a -j argument: a fixed count, "auto" or "auto:MIN:MAX".
+ * 
+ * @param spec The argument.
+ * @return int 0 on success, -1 if spec is malformed.
+ */
+int launcher_set_jobs(const char *spec);
+
+/**
+ * @brief Waits for every background command started with -j.
+ */
+void launcher_wait_all(void);
+
+/**
+ * @brief Starts audit logging to path on a background writer thread.
+ * 
+ * @param path The log file; rotated to PATH.1 past WSH_AUDIT_LOG_MAX bytes.
+ * @return int 0 on success, -1 on error.
+ */
+int audit_start(const char *path);
+
+/**
+ * @brief Writes out every queued record and stops the writer thread.
+ */
+void audit_stop(void);
+
+/**
+ * @brief Starts an audit record with the fields known before a command runs.
+ * 
+ * @param args The command about to run.
+ * @return AuditRecord* The partial record, or NULL if auditing is off.
+ */
+AuditRecord *audit_begin(char **args);
+
+/**
+ * @brief Completes a record and queues it for the writer, dropping it if the queue is full.
+ * 
+ * @param record The record from audit_begin(), or NULL.
+ * @param status The command's exit status.
+ */
+void audit_finish(AuditRecord *record, int status);
+
 /**
  * @brief Executes the parsed command.
  * 
@@ -53,9 +317,11 @@ int execute_command(char **args);
  * @brief Launches a program and waits for it to terminate.
  * 
  * @param args Array of arguments.
+ * @param assignments NAME=value words for the child's environment only.
+ * @param count Number of assignments.
  * @return int Status of execution.
  */
-int launch_process(char **args);
+int launch_process(char **args, char **assignments, int count);
 
 /**
  * @brief Initializes the shell environment.
@@ -134,6 +400,21 @@ int apply_redirection(char *input, char *output, int append, int redirect_stderr
  */
 void reset_redirection(int stdin_fd, int stdout_fd, int stderr_fd);
 
+/**
+ * @brief Changes the current directory, keeping the tracked descriptor in sync.
+ * 
+ * @param target The directory to change to.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+int change_directory(const char *target);
+
+/**
+ * @brief Returns the current directory without a system call.
+ * 
+ * @return const char* The canonical path, or NULL if it is unknown.
+ */
+const char *current_directory(void);
+
 /**
  * @brief Built-in command: change directory.
  */
@@ -165,8 +446,210 @@ int wsh_vars(char **args);
 int wsh_history_cmd(char **args);
 
 /**
- * @brief Built-in command: ls.
+ * @brief Built-in command: ls [-1alR] [FILE...].
  */
 int wsh_ls(char **args);
 
+/**
+ * @brief Releases the io_uring instance used by ls.
+ */
+void stat_ring_close(void);
+
+/**
+ * @brief Built-in command: print the current directory.
+ */
+int wsh_pwd(char **args);
+
+/**
+ * @brief Built-in command: push a directory and change to it.
+ */
+int wsh_pushd(char **args);
+
+/**
+ * @brief Built-in command: return to the directory on top of the stack.
+ */
+int wsh_popd(char **args);
+
+/**
+ * @brief Built-in command: show audit log counters.
+ */
+int wsh_audit(char **args);
+
+/**
+ * @brief Built-in command: show pressure readings and launcher decisions.
+ */
+int wsh_pressure(char **args);
+
+/**
+ * @brief Built-in command: copy stdin to stdout and files (tee [-a] [FILE...]).
+ */
+int wsh_tee(char **args);
+
+/**
+ * @brief Built-in command: print the first lines or bytes of files (head [-n [-]N|-c [-]N]).
+ */
+int wsh_head(char **args);
+
+/**
+ * @brief Built-in command: print the last lines or bytes of files (tail [-n [+]N|-c [+]N]).
+ */
+int wsh_tail(char **args);
+
+/**
+ * @brief Built-in command: count lines, words and bytes (wc [-lwmc]).
+ */
+int wsh_wc(char **args);
+
+/**
+ * @brief Built-in command: print lines containing fixed strings (match [-cvl] [-e PATTERN]...).
+ */
+int wsh_match(char **args);
+
+/**
+ * @brief Built-in command: print brace expansions one word per line (braces WORD...).
+ */
+int wsh_braces(char **args);
+
+/**
+ * @brief Built-in command: print the time with strftime() (date [-u] [+FORMAT]).
+ */
+int wsh_date(char **args);
+
+/**
+ * @brief Built-in command: pause for fractional seconds with clock_nanosleep() (sleep NUMBER[smhd]...).
+ */
+int wsh_sleep(char **args);
+
+/**
+ * @brief Built-in command: run a file in the current shell (`source`/`.`).
+ */
+int wsh_source(char **args);
+
+/**
+ * @brief Starts checkpointing a batch script to a file.
+ * 
+ * @param path The checkpoint file.
+ * @param script The batch script being run.
+ * @return int 0 on success, -1 on error.
+ */
+int checkpoint_start(const char *path, const char *script);
+
+/**
+ * @brief Restores shell state from a checkpoint file.
+ * 
+ * @param path The checkpoint file.
+ * @return int 0 on success, -1 on error.
+ */
+int checkpoint_resume(const char *path);
+
+/**
+ * @brief Records that the script line ending at offset has completed.
+ * 
+ * @param offset Byte offset just past the completed line.
+ */
+void checkpoint_commit(long offset);
+
+/**
+ * @brief Atomically writes the current checkpoint to disk.
+ * 
+ * @return int 0 on success, -1 on error.
+ */
+int checkpoint_write(void);
+
+/**
+ * @brief Validates a whole batch script without running any of its commands.
+ * 
+ * @param fp The open batch script.
+ * @param script The script's name, for reports.
+ * @return int The number of problems found.
+ */
+int preflight_script(FILE *fp, const char *script);
+
+/**
+ * @brief Reports what each line of a batch script costs and which lines fork most.
+ * 
+ * @param fp The open batch script.
+ * @param script The script's name, for reports.
+ * @return long The estimated forks per run.
+ */
+long lint_perf_script(FILE *fp, const char *script);
+
+/**
+ * @brief Saves variables, environment, history, cwd and the path cache.
+ * 
+ * @param path The snapshot file to write.
+ * @return int 0 on success, -1 on error.
+ */
+int save_state(const char *path);
+
+/**
+ * @brief Maps a snapshot and adopts its state in place.
+ * 
+ * @param path The snapshot file.
+ * @return int 0 on success, -1 on error.
+ */
+int load_state(const char *path);
+
+/**
+ * @brief Starts the parse-ahead thread on a batch script.
+ * 
+ * @param input The open script.
+ * @return int 0 on success, -1 if the thread could not be started.
+ */
+int parse_ahead_start(FILE *input);
+
+/**
+ * @brief Stops the parse-ahead thread and drops lines it read ahead.
+ */
+void parse_ahead_stop(void);
+
+/**
+ * @brief Runs a batch script, overlapping reading and tokenizing with execution.
+ * 
+ * @param input The open script.
+ * @return int 0 if the script ran, -1 if parse-ahead could not start.
+ */
+int run_parse_ahead(FILE *input);
+
+/**
+ * @brief Builtin names, indexed like builtin_func.
+ */
+extern char *builtin_str[];
+int num_builtins(void);
+
+// How a line of a compiled script runs
+typedef enum CompiledKind {
+    COMPILED_DYNAMIC,       // substituted and dispatched at run time
+    COMPILED_BUILTIN,       // bound to builtin_func[builtin] by wsh2c
+    COMPILED_PROGRAM,       // bound to a program launch by wsh2c
+} CompiledKind;
+
+// One line of a script compiled by wsh2c
+typedef struct CompiledLine {
+    CompiledKind kind;
+    int builtin;
+    const char *text;       // the line as written, for history
+    const char *command;    // COMPILED_PROGRAM: the words joined by spaces, as history records a launch
+    char **words;           // as tokenize_line() split them
+} CompiledLine;
+
+/**
+ * @brief Runs a script compiled by wsh2c, from initialization to cleanup.
+ * 
+ * @param lines The script's lines, comments and blank lines left out.
+ * @param count Number of lines.
+ * @return int The process exit status.
+ */
+int run_compiled(const CompiledLine *lines, size_t count);
+
+/**
+ * @brief Runs commands read from a FIFO as jobs, up to jobs at a time, until SIGTERM or SIGINT.
+ * 
+ * @param path The FIFO; created if it does not exist.
+ * @param results Where completion records go (a file or FIFO), or NULL for stdout.
+ * @param jobs The most jobs running at once.
+ * @return int 0 after a clean shutdown, -1 if the FIFO or results cannot be opened.
+ */
+int serve_fifo(const char *path, const char *results, int jobs);
+
 #endif // WSH_H
@@ -0,0 +1,266 @@
+// wsh2c: translates a wsh batch script into C and compiles it against libwsh.a.
+//
+// Usage: wsh2c [-c] [-o OUTPUT] SCRIPT
+//
+// Each script line becomes a static array of its words, tokenized here
+// once, and an entry in a table that run_compiled() walks. Lines whose
+// words are fixed are bound to their builtin or to a program launch at
+// translation time; lines that depend on variables, $(...), brace
+// expansion, VAR=x prefixes, ratelimit or `history N` are left for the
+// runtime to substitute and dispatch as the interpreter would. The
+// program is compiled with $CC (default cc) using the wsh.h and libwsh.a
+// that sit next to wsh2c. -c writes the C source instead (to stdout
+// without -o).
+
+#include "wsh.h"
+#include <libgen.h>
+#include <spawn.h>
+
+extern char **environ;
+
+/**
+ * @brief Writes s as a C string literal.
+ */
+static void emit_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fprintf(out, "\\%c", *p);
+        } else if (*p < 0x20 || *p >= 0x7f) {
+            // Always three digits, so a following digit is not absorbed
+            fprintf(out, "\\%03o", *p);
+        } else if (*p == '?' && p[1] == '?') {
+            // Keep "??" from forming a trigraph
+            fputs("?\\?", out);
+            p++;
+        } else {
+            fputc(*p, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/**
+ * @brief Returns the builtin_func index of name, or -1.
+ */
+static int builtin_index(const char *name) {
+    for (int i = 0; i < num_builtins(); i++) {
+        if (strcmp(name, builtin_str[i]) == 0) return i;
+    }
+    return -1;
+}
+
+/**
+ * @brief Tells whether a line's words and meaning are fixed, so it can be bound now.
+ */
+static int is_static_line(char **words) {
+    if (!words[0]) return 0;
+    for (int i = 0; words[i]; i++) {
+        if (words[i][0] == '$' || strstr(words[i], "$(")) return 0;
+    }
+    // Prefixes and commands that run other commands are left to dispatch
+    if (strchr(words[0], '=') || strcmp(words[0], "ratelimit") == 0) return 0;
+    if (strcmp(words[0], "history") == 0 && words[1]) return 0;
+
+    // `braces` takes its words unexpanded; anything else must not expand
+    if (strcmp(words[0], "braces") == 0) return 1;
+    char **expanded = NULL;
+    int expands = expand_braces(words, &expanded) == -1 || expanded != NULL;
+    free_tokens(expanded);
+    return !expands;
+}
+
+/**
+ * @brief Translates a script into a C program: word arrays, then a table of lines.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+static int translate(FILE *script, const char *name, FILE *out) {
+    fprintf(out, "// Generated by wsh2c from %s; edit the script instead.\n\n", name);
+    fprintf(out, "#include \"wsh.h\"\n\n");
+
+    // The table goes into a buffer so the word arrays can be written first
+    char *table = NULL;
+    size_t table_len = 0;
+    FILE *body = open_memstream(&table, &table_len);
+    if (!body) {
+        perror("wsh2c");
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t bufsize = 0;
+    long line_no = 0;
+    while (getline(&line, &bufsize, script) != -1) {
+        line_no++;
+
+        // Comments and empty lines are skipped as by the interpreter
+        char *trimmed = line;
+        while (*trimmed == ' ' || *trimmed == '\t') trimmed++;
+        if (*trimmed == '#' || *trimmed == '\0' || *trimmed == '\n') {
+            continue;
+        }
+        size_t len = strlen(trimmed);
+        if (trimmed[len - 1] == '\n') {
+            trimmed[--len] = '\0';
+        }
+
+        char *text = strdup(trimmed);
+        if (!text) {
+            fprintf(stderr, "wsh2c: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        char **words = tokenize_line(trimmed);
+
+        fprintf(out, "static char *line_%ld[] = {", line_no);
+        for (int i = 0; words[i]; i++) {
+            emit_string(out, words[i]);
+            fputs(", ", out);
+        }
+        fputs("NULL};\n", out);
+
+        int builtin = words[0] ? builtin_index(words[0]) : -1;
+        if (!is_static_line(words)) {
+            fputs("    {COMPILED_DYNAMIC, 0, ", body);
+            emit_string(body, text);
+            fputs(", NULL", body);
+        } else if (builtin >= 0) {
+            fprintf(body, "    {COMPILED_BUILTIN, %d /* %s */, ", builtin, words[0]);
+            emit_string(body, text);
+            fputs(", NULL", body);
+        } else {
+            // History records a launch as its words joined by single spaces,
+            // which is never longer than the line as written
+            char joined[len + 1];
+            size_t used = 0;
+            for (int i = 0; words[i]; i++) {
+                size_t word_len = strlen(words[i]);
+                memcpy(joined + used, words[i], word_len);
+                used += word_len;
+                if (words[i + 1]) joined[used++] = ' ';
+            }
+            joined[used] = '\0';
+            fputs("    {COMPILED_PROGRAM, 0, ", body);
+            emit_string(body, text);
+            fputs(", ", body);
+            emit_string(body, joined);
+        }
+        fprintf(body, ", line_%ld},\n", line_no);
+
+        free_tokens(words);
+        free(text);
+    }
+    free(line);
+    int failed = ferror(script);
+    fclose(body);
+    if (failed) {
+        perror("wsh2c");
+        free(table);
+        return -1;
+    }
+
+    // An empty script still needs a well-formed table
+    fprintf(out, "\nstatic const CompiledLine script[] = {\n");
+    fwrite(table, 1, table_len, out);
+    fprintf(out, "    {COMPILED_DYNAMIC, 0, NULL, NULL, NULL},\n};\n\n");
+    fprintf(out, "int main(void) {\n");
+    fprintf(out, "    return run_compiled(script, sizeof(script) / sizeof(script[0]) - 1);\n}\n");
+    free(table);
+    return ferror(out) ? -1 : 0;
+}
+
+/**
+ * @brief Compiles a translated program with $CC against the libwsh.a beside this executable.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+static int compile(const char *source, const char *output) {
+    char self[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (len == -1) {
+        perror("wsh2c: /proc/self/exe");
+        return -1;
+    }
+    self[len] = '\0';
+    const char *dir = dirname(self);
+
+    char include[PATH_MAX + 2], library[PATH_MAX + 16];
+    snprintf(include, sizeof(include), "-I%s", dir);
+    snprintf(library, sizeof(library), "%s/libwsh.a", dir);
+    if (access(library, R_OK) != 0) {
+        fprintf(stderr, "wsh2c: %s: %s (run make)\n", library, strerror(errno));
+        return -1;
+    }
+
+    const char *cc = getenv("CC") && *getenv("CC") ? getenv("CC") : "cc";
+    char *argv[] = {(char *)cc, "-O2", "-pthread", include, "-o", (char *)output,
+                    (char *)source, library, NULL};
+    pid_t pid;
+    int err = posix_spawnp(&pid, cc, NULL, NULL, argv, environ);
+    if (err != 0) {
+        fprintf(stderr, "wsh2c: %s: %s\n", cc, strerror(err));
+        return -1;
+    }
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+        perror("wsh2c");
+        return -1;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    int source_only = 0;
+    const char *output = NULL;
+    const char *script = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0) {
+            source_only = 1;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (argv[i][0] == '-' || script) {
+            fprintf(stderr, "usage: wsh2c [-c] [-o OUTPUT] SCRIPT\n");
+            return EXIT_FAILURE;
+        } else {
+            script = argv[i];
+        }
+    }
+    if (!script) {
+        fprintf(stderr, "usage: wsh2c [-c] [-o OUTPUT] SCRIPT\n");
+        return EXIT_FAILURE;
+    }
+
+    FILE *in = fopen(script, "r");
+    if (!in) {
+        fprintf(stderr, "wsh2c: %s: %s\n", script, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if (source_only) {
+        FILE *out = output ? fopen(output, "w") : stdout;
+        if (!out) {
+            fprintf(stderr, "wsh2c: %s: %s\n", output, strerror(errno));
+            fclose(in);
+            return EXIT_FAILURE;
+        }
+        int ok = translate(in, script, out) == 0;
+        fclose(in);
+        if (fclose(out) != 0) ok = 0;
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    char source[] = "/tmp/wsh2c-XXXXXX.c";
+    int fd = mkstemps(source, 2);
+    FILE *out = fd == -1 ? NULL : fdopen(fd, "w");
+    if (!out) {
+        perror("wsh2c");
+        fclose(in);
+        return EXIT_FAILURE;
+    }
+    int ok = translate(in, script, out) == 0;
+    fclose(in);
+    if (fclose(out) != 0) ok = 0;
+    ok = ok && compile(source, output ? output : "a.out") == 0;
+    unlink(source);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
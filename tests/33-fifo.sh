@@ -0,0 +1,5 @@
+# One end of the t33.fifo handshake; gives up after 5 s without the other end
+case $1 in
+read) timeout 5 cat t33.fifo || echo "no writer" ;;
+write) timeout 5 sh -c 'echo handshake > t33.fifo' && echo sent || echo "no reader" ;;
+esac
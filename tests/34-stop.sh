@@ -0,0 +1,4 @@
+# Stops the shell that runs it, once: a second run finds the marker
+[ -e "$1" ] && exit 0
+: > "$1"
+kill -TERM $PPID
@@ -0,0 +1,30 @@
+# Saves a snapshot, loads it back, then loads damaged copies that must be refused
+wsh=../solution/wsh
+$wsh --save-state t35.snap tests/35.wsh
+$wsh --load-state t35.snap tests/35-show.wsh
+size=$(stat -c %s t35.snap)
+
+# Cut short
+head -c $((size / 2)) t35.snap > t35.bad
+$wsh --load-state t35.bad tests/35-show.wsh; echo truncated $?
+
+# Last byte no longer NUL
+cp t35.snap t35.bad
+printf x | dd of=t35.bad bs=1 seek=$((size - 1)) conv=notrunc 2>/dev/null
+$wsh --load-state t35.bad tests/35-show.wsh; echo unterminated $?
+
+# First environment string offset past the end (the env array's offset is at byte 56)
+cp t35.snap t35.bad
+env=$(od -An -t u8 -j 56 -N 8 t35.snap | tr -d ' ')
+printf '\377\377\377\377\377\377\377\177' | dd of=t35.bad bs=1 seek=$env conv=notrunc 2>/dev/null
+$wsh --load-state t35.bad tests/35-show.wsh; echo env-offset $?
+
+# Variable hash table with every slot taken (its offset is at byte 48, its size at byte 16)
+cp t35.snap t35.bad
+table=$(od -An -t u8 -j 48 -N 8 t35.snap | tr -d ' ')
+slots=$(od -An -t u4 -j 16 -N 4 t35.snap | tr -d ' ')
+i=0; while [ $i -lt $slots ]; do printf '\1\0\0\0'; i=$((i + 1)); done |
+    dd of=t35.bad bs=1 seek=$table conv=notrunc 2>/dev/null
+$wsh --load-state t35.bad tests/35-show.wsh; echo full-table $?
+
+rm -f t35.snap t35.bad
@@ -0,0 +1,3 @@
+# Run a command after a delay, so one started later would finish first
+sleep 0.2
+exec "$@"